@@ -0,0 +1,278 @@
+/*
+ * Smoothing Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* AVX2 versions of the row primitives, 8 values at a time using fused multiply-add.
+ * The lut lookups use the AVX2 gather instructions.
+ * This file is built with -mavx2 -mfma and only used when the CPU reports both at plugin load.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <immintrin.h>
+
+#include "gstsmoothingengine.h"
+
+// Look up 8 consecutive input values in the forward lut
+static inline __m256
+load8 (const guint8 *src, const float *forward_gamma)
+{
+	__m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)src));
+
+	return _mm256_i32gather_ps(forward_gamma, idx, 4);
+}
+
+// Look up 8 consecutive input values in the 16 bit forward lut, it has a spare entry at the end so the 32 bit gather stays inside it
+static inline __m256i
+load8_16 (const guint8 *src, const guint16 *forward_gamma16)
+{
+	__m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)src));
+
+	return _mm256_and_si256(_mm256_i32gather_epi32((const int *)forward_gamma16, idx, 2), _mm256_set1_epi32(0xffff));
+}
+
+// Look up 8 indices in the inverse lut and write the 8 output values
+static inline void
+lookup8 (guint8 *dst, __m256i idx, const unsigned int *inverse_gamma)
+{
+	__m256i out = _mm256_i32gather_epi32((const int *)inverse_gamma, idx, 4);
+	__m128i out16 = _mm_packus_epi32(_mm256_castsi256_si128(out), _mm256_extracti128_si256(out, 1));
+
+	_mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(out16, out16));
+}
+
+// Clamp 8 linear intensities into the inverse lut and write the 8 output values
+static inline void
+store8 (guint8 *dst, __m256 val, const unsigned int *inverse_gamma, __m256 limit)
+{
+	lookup8(dst, _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(val, _mm256_setzero_ps()), limit)), inverse_gamma);
+}
+
+// Store 8 32 bit values as unsigned 16 bit
+static inline void
+store8_u16 (guint16 *dst, __m256i val)
+{
+	_mm_storeu_si128((__m128i *)dst, _mm_packus_epi32(_mm256_castsi256_si128(val), _mm256_extracti128_si256(val, 1)));
+}
+
+static void
+linearise_avx2 (float *dst, const guint8 *src, gint len, const float *forward_gamma)
+{
+	gint x;
+
+	for(x=0; x+8<=len; x+=8)
+		_mm256_storeu_ps(dst+x, load8(src+x, forward_gamma));
+	if (x<len)
+		smoothing_linearise_c(dst+x, src+x, len-x, forward_gamma);
+}
+
+static void
+linearise_u16_avx2 (float *dst, const guint16 *src, gint len, const float *forward_gamma)
+{
+	gint x;
+
+	for(x=0; x+8<=len; x+=8){
+		__m256i idx = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src+x)));
+		_mm256_storeu_ps(dst+x, _mm256_i32gather_ps(forward_gamma, idx, 4));
+	}
+	if (x<len)
+		smoothing_linearise_u16_c(dst+x, src+x, len-x, forward_gamma);
+}
+
+static void
+convolve_row_avx2 (float *dst, const float *src, gint len, gint step, const float *kernel, gint taps)
+{
+	gint x, j;
+
+	for(x=0; x+8<=len; x+=8){
+		__m256 acc = _mm256_mul_ps(_mm256_set1_ps(kernel[0]), _mm256_loadu_ps(src+x));
+		for(j=1; j<taps; j++)
+			acc = _mm256_fmadd_ps(_mm256_set1_ps(kernel[j]), _mm256_loadu_ps(src+x+j*step), acc);
+		_mm256_storeu_ps(dst+x, acc);
+	}
+	if (x<len)
+		smoothing_convolve_row_c(dst+x, src+x, len-x, step, kernel, taps);
+}
+
+static void
+convolve_column_avx2 (guint8 *dst, const float **rows, gint len, const float *kernel, gint taps,
+		const unsigned int *inverse_gamma, gint out_limit)
+{
+	const float *tail[SMOOTHING_MAX_TAPS];
+	__m256 half = _mm256_set1_ps(0.5f);
+	__m256 limit = _mm256_set1_ps(out_limit);
+	gint x, i;
+
+	for(x=0; x+8<=len; x+=8){
+		__m256 acc = _mm256_fmadd_ps(_mm256_set1_ps(kernel[0]), _mm256_loadu_ps(rows[0]+x), half);
+		for(i=1; i<taps; i++)
+			acc = _mm256_fmadd_ps(_mm256_set1_ps(kernel[i]), _mm256_loadu_ps(rows[i]+x), acc);
+		store8(dst+x, acc, inverse_gamma, limit);
+	}
+	if (x<len){
+		for(i=0; i<taps; i++)
+			tail[i] = rows[i]+x;
+		smoothing_convolve_column_c(dst+x, tail, len-x, kernel, taps, inverse_gamma, out_limit);
+	}
+}
+
+static void
+direct_row_avx2 (guint8 *dst, const float **rows, gint len, gint step, const float *kernel, gint s,
+		const unsigned int *inverse_gamma, gint out_limit)
+{
+	const float *tail[2*MAX_KERNELSIZE+1];
+	__m256 half = _mm256_set1_ps(0.5f);
+	__m256 limit = _mm256_set1_ps(out_limit);
+	gint x, i, j;
+
+	for(x=0; x+8<=len; x+=8){
+		__m256 acc = half;
+		for(i=0; i<s; i++){
+			for(j=0; j<s; j++)
+				acc = _mm256_fmadd_ps(_mm256_set1_ps(kernel[i*s+j]), _mm256_loadu_ps(rows[i]+x+j*step), acc);
+		}
+		store8(dst+x, acc, inverse_gamma, limit);
+	}
+	if (x<len){
+		for(i=0; i<s; i++)
+			tail[i] = rows[i]+x;
+		smoothing_direct_row_c(dst+x, tail, len-x, step, kernel, s, inverse_gamma, out_limit);
+	}
+}
+
+static void
+linearise16_avx2 (guint16 *dst, const guint8 *src, gint len, const guint16 *forward_gamma16)
+{
+	gint x;
+
+	for(x=0; x+8<=len; x+=8)
+		store8_u16(dst+x, load8_16(src+x, forward_gamma16));
+	if (x<len)
+		smoothing_linearise16_c(dst+x, src+x, len-x, forward_gamma16);
+}
+
+static void
+convolve_row16_avx2 (guint16 *dst, const guint16 *src, gint len, gint step, const gint16 *kernel, gint taps)
+{
+	__m256i half = _mm256_set1_epi32(SMOOTHING_FIXED_ONE/2);
+	gint x, j;
+
+	for(x=0; x+8<=len; x+=8){
+		__m256i acc = half;
+		for(j=0; j<taps; j++){
+			__m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src+x+j*step)));
+			acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(v, _mm256_set1_epi32(kernel[j])));
+		}
+		store8_u16(dst+x, _mm256_srli_epi32(acc, SMOOTHING_FIXED_BITS));
+	}
+	if (x<len)
+		smoothing_convolve_row16_c(dst+x, src+x, len-x, step, kernel, taps);
+}
+
+static void
+convolve_column16_avx2 (guint8 *dst, const guint16 **rows, gint len, const gint16 *kernel, gint taps,
+		const unsigned int *inverse_gamma, gint shift, gint out_limit)
+{
+	const guint16 *tail[2*MAX_KERNELSIZE+1];
+	__m256i round = _mm256_set1_epi32((SMOOTHING_FIXED_ONE/2) << shift);
+	__m256i limit = _mm256_set1_epi32(out_limit);
+	__m128i count = _mm_cvtsi32_si128(SMOOTHING_FIXED_BITS+shift);
+	gint x, i;
+
+	for(x=0; x+8<=len; x+=8){
+		__m256i acc = round;
+		for(i=0; i<taps; i++){
+			__m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(rows[i]+x)));
+			acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(v, _mm256_set1_epi32(kernel[i])));
+		}
+		lookup8(dst+x, _mm256_min_epi32(_mm256_srl_epi32(acc, count), limit), inverse_gamma);
+	}
+	if (x<len){
+		for(i=0; i<taps; i++)
+			tail[i] = rows[i]+x;
+		smoothing_convolve_column16_c(dst+x, tail, len-x, kernel, taps, inverse_gamma, shift, out_limit);
+	}
+}
+
+static void
+direct_row16_avx2 (guint8 *dst, const guint16 **rows, gint len, gint step, const gint16 *kernel, gint s,
+		const unsigned int *inverse_gamma, gint shift, gint out_limit)
+{
+	const guint16 *tail[2*MAX_KERNELSIZE+1];
+	__m256i round = _mm256_set1_epi32((SMOOTHING_FIXED_ONE/2) << shift);
+	__m256i limit = _mm256_set1_epi32(out_limit);
+	__m128i count = _mm_cvtsi32_si128(SMOOTHING_FIXED_BITS+shift);
+	gint x, i, j;
+
+	for(x=0; x+8<=len; x+=8){
+		__m256i acc = round;
+		for(i=0; i<s; i++){
+			for(j=0; j<s; j++){
+				__m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(rows[i]+x+j*step)));
+				acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(v, _mm256_set1_epi32(kernel[i*s+j])));
+			}
+		}
+		lookup8(dst+x, _mm256_min_epi32(_mm256_srl_epi32(acc, count), limit), inverse_gamma);
+	}
+	if (x<len){
+		for(i=0; i<s; i++)
+			tail[i] = rows[i]+x;
+		smoothing_direct_row16_c(dst+x, tail, len-x, step, kernel, s, inverse_gamma, shift, out_limit);
+	}
+}
+
+const SmoothingFuncs smoothing_funcs_avx2 = {
+	"avx2",
+	linearise_avx2,
+	convolve_row_avx2,
+	convolve_column_avx2,
+	direct_row_avx2,
+	linearise16_avx2,
+	convolve_row16_avx2,
+	convolve_column16_avx2,
+	direct_row16_avx2,
+	linearise_u16_avx2,
+	smoothing_convolve_column_u16_c,
+	smoothing_direct_row_u16_c
+};
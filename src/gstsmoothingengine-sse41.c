@@ -0,0 +1,219 @@
+/*
+ * Smoothing Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* SSE4.1 versions of the row primitives, 4 values at a time.
+ * There is no gather before AVX2 so the luts are still read one value at a time, but all the arithmetic is vectorised.
+ * This file is built with -msse4.1 and only used when the CPU reports SSE4.1 at plugin load.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <smmintrin.h>
+
+#include "gstsmoothingengine.h"
+
+// Look up 4 indices in the inverse lut and write the 4 output values
+static inline void
+lookup4 (guint8 *dst, __m128i idx, const unsigned int *inverse_gamma)
+{
+	dst[0] = inverse_gamma[_mm_extract_epi32(idx, 0)];
+	dst[1] = inverse_gamma[_mm_extract_epi32(idx, 1)];
+	dst[2] = inverse_gamma[_mm_extract_epi32(idx, 2)];
+	dst[3] = inverse_gamma[_mm_extract_epi32(idx, 3)];
+}
+
+// Clamp 4 linear intensities into the inverse lut and write the 4 output values
+static inline void
+store4 (guint8 *dst, __m128 val, const unsigned int *inverse_gamma, __m128 limit)
+{
+	lookup4(dst, _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(val, _mm_setzero_ps()), limit)), inverse_gamma);
+}
+
+static void
+convolve_row_sse41 (float *dst, const float *src, gint len, gint step, const float *kernel, gint taps)
+{
+	gint x, j;
+
+	for(x=0; x+4<=len; x+=4){
+		__m128 acc = _mm_mul_ps(_mm_set1_ps(kernel[0]), _mm_loadu_ps(src+x));
+		for(j=1; j<taps; j++)
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(kernel[j]), _mm_loadu_ps(src+x+j*step)));
+		_mm_storeu_ps(dst+x, acc);
+	}
+	if (x<len)
+		smoothing_convolve_row_c(dst+x, src+x, len-x, step, kernel, taps);
+}
+
+static void
+convolve_column_sse41 (guint8 *dst, const float **rows, gint len, const float *kernel, gint taps,
+		const unsigned int *inverse_gamma, gint out_limit)
+{
+	const float *tail[SMOOTHING_MAX_TAPS];
+	__m128 half = _mm_set1_ps(0.5f);
+	__m128 limit = _mm_set1_ps(out_limit);
+	gint x, i;
+
+	for(x=0; x+4<=len; x+=4){
+		__m128 acc = _mm_mul_ps(_mm_set1_ps(kernel[0]), _mm_loadu_ps(rows[0]+x));
+		for(i=1; i<taps; i++)
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(kernel[i]), _mm_loadu_ps(rows[i]+x)));
+		store4(dst+x, _mm_add_ps(acc, half), inverse_gamma, limit);
+	}
+	if (x<len){
+		for(i=0; i<taps; i++)
+			tail[i] = rows[i]+x;
+		smoothing_convolve_column_c(dst+x, tail, len-x, kernel, taps, inverse_gamma, out_limit);
+	}
+}
+
+static void
+direct_row_sse41 (guint8 *dst, const float **rows, gint len, gint step, const float *kernel, gint s,
+		const unsigned int *inverse_gamma, gint out_limit)
+{
+	const float *tail[2*MAX_KERNELSIZE+1];
+	__m128 half = _mm_set1_ps(0.5f);
+	__m128 limit = _mm_set1_ps(out_limit);
+	gint x, i, j;
+
+	for(x=0; x+4<=len; x+=4){
+		__m128 acc = half;
+		for(i=0; i<s; i++){
+			for(j=0; j<s; j++)
+				acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(kernel[i*s+j]), _mm_loadu_ps(rows[i]+x+j*step)));
+		}
+		store4(dst+x, acc, inverse_gamma, limit);
+	}
+	if (x<len){
+		for(i=0; i<s; i++)
+			tail[i] = rows[i]+x;
+		smoothing_direct_row_c(dst+x, tail, len-x, step, kernel, s, inverse_gamma, out_limit);
+	}
+}
+
+static void
+convolve_row16_sse41 (guint16 *dst, const guint16 *src, gint len, gint step, const gint16 *kernel, gint taps)
+{
+	__m128i half = _mm_set1_epi32(SMOOTHING_FIXED_ONE/2);
+	gint x, j;
+
+	for(x=0; x+4<=len; x+=4){
+		__m128i acc = half;
+		for(j=0; j<taps; j++){
+			__m128i v = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(src+x+j*step)));
+			acc = _mm_add_epi32(acc, _mm_mullo_epi32(v, _mm_set1_epi32(kernel[j])));
+		}
+		acc = _mm_srli_epi32(acc, SMOOTHING_FIXED_BITS);
+		_mm_storel_epi64((__m128i *)(dst+x), _mm_packus_epi32(acc, acc));
+	}
+	if (x<len)
+		smoothing_convolve_row16_c(dst+x, src+x, len-x, step, kernel, taps);
+}
+
+static void
+convolve_column16_sse41 (guint8 *dst, const guint16 **rows, gint len, const gint16 *kernel, gint taps,
+		const unsigned int *inverse_gamma, gint shift, gint out_limit)
+{
+	const guint16 *tail[2*MAX_KERNELSIZE+1];
+	__m128i round = _mm_set1_epi32((SMOOTHING_FIXED_ONE/2) << shift);
+	__m128i limit = _mm_set1_epi32(out_limit);
+	__m128i count = _mm_cvtsi32_si128(SMOOTHING_FIXED_BITS+shift);
+	gint x, i;
+
+	for(x=0; x+4<=len; x+=4){
+		__m128i acc = round;
+		for(i=0; i<taps; i++){
+			__m128i v = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(rows[i]+x)));
+			acc = _mm_add_epi32(acc, _mm_mullo_epi32(v, _mm_set1_epi32(kernel[i])));
+		}
+		lookup4(dst+x, _mm_min_epi32(_mm_srl_epi32(acc, count), limit), inverse_gamma);
+	}
+	if (x<len){
+		for(i=0; i<taps; i++)
+			tail[i] = rows[i]+x;
+		smoothing_convolve_column16_c(dst+x, tail, len-x, kernel, taps, inverse_gamma, shift, out_limit);
+	}
+}
+
+static void
+direct_row16_sse41 (guint8 *dst, const guint16 **rows, gint len, gint step, const gint16 *kernel, gint s,
+		const unsigned int *inverse_gamma, gint shift, gint out_limit)
+{
+	const guint16 *tail[2*MAX_KERNELSIZE+1];
+	__m128i round = _mm_set1_epi32((SMOOTHING_FIXED_ONE/2) << shift);
+	__m128i limit = _mm_set1_epi32(out_limit);
+	__m128i count = _mm_cvtsi32_si128(SMOOTHING_FIXED_BITS+shift);
+	gint x, i, j;
+
+	for(x=0; x+4<=len; x+=4){
+		__m128i acc = round;
+		for(i=0; i<s; i++){
+			for(j=0; j<s; j++){
+				__m128i v = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(rows[i]+x+j*step)));
+				acc = _mm_add_epi32(acc, _mm_mullo_epi32(v, _mm_set1_epi32(kernel[i*s+j])));
+			}
+		}
+		lookup4(dst+x, _mm_min_epi32(_mm_srl_epi32(acc, count), limit), inverse_gamma);
+	}
+	if (x<len){
+		for(i=0; i<s; i++)
+			tail[i] = rows[i]+x;
+		smoothing_direct_row16_c(dst+x, tail, len-x, step, kernel, s, inverse_gamma, shift, out_limit);
+	}
+}
+
+const SmoothingFuncs smoothing_funcs_sse41 = {
+	"sse4.1",
+	smoothing_linearise_c,  // nothing to gain without a gather
+	convolve_row_sse41,
+	convolve_column_sse41,
+	direct_row_sse41,
+	smoothing_linearise16_c,
+	convolve_row16_sse41,
+	convolve_column16_sse41,
+	direct_row16_sse41,
+	smoothing_linearise_u16_c,
+	smoothing_convolve_column_u16_c,
+	smoothing_direct_row_u16_c
+};
@@ -0,0 +1,286 @@
+/*
+ * Smoothing Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Versions of the plain C row primitives specialised for one kernel size and pixel layout.
+ * Each function here is generated by a macro with the kernel size s and the step (the values from one pixel
+ * to the next of the same channel) as constants: 1 for GRAY and Y planes, 2 for the UV plane of NV12 and 3 for
+ * RGB and BGR. The tap lists spell out every tap, so an output value is a straight run of multiply-adds at fixed
+ * offsets from each row pointer, with no loop over the kernel and no index arithmetic.
+ * Taps are summed in the same order as the generic versions so the output is exactly the same.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "gstsmoothingengine.h"
+
+// T(j, ...) once for each tap j of a 3, 5 or 7 tap kernel
+#define TAPS_3(T, ...) T(0, __VA_ARGS__) T(1, __VA_ARGS__) T(2, __VA_ARGS__)
+#define TAPS_5(T, ...) TAPS_3(T, __VA_ARGS__) T(3, __VA_ARGS__) T(4, __VA_ARGS__)
+#define TAPS_7(T, ...) TAPS_5(T, __VA_ARGS__) T(5, __VA_ARGS__) T(6, __VA_ARGS__)
+
+// R(i, ...) once for each row i of a 2D kernel, a list of its own so that R can expand to a tap list
+#define ROWS_3(R, ...) R(0, __VA_ARGS__) R(1, __VA_ARGS__) R(2, __VA_ARGS__)
+#define ROWS_5(R, ...) ROWS_3(R, __VA_ARGS__) R(3, __VA_ARGS__) R(4, __VA_ARGS__)
+#define ROWS_7(R, ...) ROWS_5(R, __VA_ARGS__) R(5, __VA_ARGS__) R(6, __VA_ARGS__)
+
+// The row pointers and weights are copied to locals first, otherwise every store to dst
+// (which may alias anything) would have them all read again for the next value.
+
+// Weight (i,j) of the 2D kernel times the value j pixels along row i, for the direct engines
+#define DIRECT_TAP(j, i, S, STEP) acc += k[(i)*S+(j)] * row[i][x+(j)*STEP];
+#define DIRECT_ROW(i, S, STEP) TAPS_##S(DIRECT_TAP, i, S, STEP)
+
+// The weighted lut of tap (i,j) looked up with the value j pixels along row i
+#define WEIGHTED_TAP(j, i, S, STEP) acc += lut[(i)*S+(j)][row[i][x+(j)*STEP]];
+#define WEIGHTED_ROW(i, S, STEP) TAPS_##S(WEIGHTED_TAP, i, S, STEP)
+
+// Tap j of a 1D kernel, along the row for the horizontal pass and down the rows for the vertical pass.
+// The sums start from 0 rather than the first tap, which gives the same result.
+#define ROW_TAP(j, STEP) acc += k[j] * src[x+(j)*STEP];
+#define COLUMN_TAP(i, S) acc += k[i] * row[i][x];
+
+#define DEFINE_STEP(S, STEP) \
+static void \
+direct_row_##S##_##STEP (guint8 *dst, const float **rows, gint len, gint step, const float *kernel, gint s, \
+		const unsigned int *inverse_gamma, gint out_limit) \
+{ \
+	const float *row[S]; \
+	float k[S*S]; \
+	float limit = out_limit; \
+	gint x; \
+\
+	memcpy(row, rows, sizeof(row)); \
+	memcpy(k, kernel, sizeof(k)); \
+	for(x=0; x<len; x++){ \
+		float acc = 0.5f; \
+		ROWS_##S(DIRECT_ROW, S, STEP) \
+		dst[x] = inverse_gamma[(unsigned int)CLAMP(acc, 0.0f, limit)]; \
+	} \
+} \
+\
+static void \
+direct_row_u16_##S##_##STEP (guint16 *dst, const float **rows, gint len, gint step, const float *kernel, gint s, \
+		const unsigned int *inverse_gamma, gint out_limit) \
+{ \
+	const float *row[S]; \
+	float k[S*S]; \
+	float limit = out_limit; \
+	gint x; \
+\
+	memcpy(row, rows, sizeof(row)); \
+	memcpy(k, kernel, sizeof(k)); \
+	for(x=0; x<len; x++){ \
+		float acc = 0.5f; \
+		ROWS_##S(DIRECT_ROW, S, STEP) \
+		dst[x] = inverse_gamma[(unsigned int)CLAMP(acc, 0.0f, limit)]; \
+	} \
+} \
+\
+static void \
+direct_row16_##S##_##STEP (guint8 *dst, const guint16 **rows, gint len, gint step, const gint16 *kernel, gint s, \
+		const unsigned int *inverse_gamma, gint shift, gint out_limit) \
+{ \
+	const guint16 *row[S]; \
+	gint32 k[S*S]; \
+	gint32 round = (SMOOTHING_FIXED_ONE/2) << shift; \
+	gint x, i; \
+\
+	memcpy(row, rows, sizeof(row)); \
+	for(i=0; i<S*S; i++) \
+		k[i] = kernel[i]; \
+	for(x=0; x<len; x++){ \
+		gint32 acc = round; \
+		ROWS_##S(DIRECT_ROW, S, STEP) \
+		dst[x] = inverse_gamma[MIN(acc >> (SMOOTHING_FIXED_BITS+shift), out_limit)]; \
+	} \
+} \
+\
+static void \
+convolve_row_##S##_##STEP (float *dst, const float *src, gint len, gint step, const float *kernel, gint taps) \
+{ \
+	float k[S]; \
+	gint x; \
+\
+	memcpy(k, kernel, sizeof(k)); \
+	for(x=0; x<len; x++){ \
+		float acc = 0.0f; \
+		TAPS_##S(ROW_TAP, STEP) \
+		dst[x] = acc; \
+	} \
+} \
+\
+static void \
+convolve_row16_##S##_##STEP (guint16 *dst, const guint16 *src, gint len, gint step, const gint16 *kernel, gint taps) \
+{ \
+	gint32 k[S]; \
+	gint x, j; \
+\
+	for(j=0; j<S; j++) \
+		k[j] = kernel[j]; \
+	for(x=0; x<len; x++){ \
+		gint32 acc = 0; \
+		TAPS_##S(ROW_TAP, STEP) \
+		dst[x] = (acc + SMOOTHING_FIXED_ONE/2) >> SMOOTHING_FIXED_BITS; \
+	} \
+}
+
+// The weighted version only exists for the kernel sizes that have weighted luts
+#define DEFINE_WEIGHTED_STEP(S, STEP) \
+static void \
+direct_row_weighted_##S##_##STEP (guint8 *dst, const guint8 **rows, gint len, gint step, const float **luts, gint s, \
+		const unsigned int *inverse_gamma, gint out_limit) \
+{ \
+	const guint8 *row[S]; \
+	const float *lut[S*S]; \
+	float limit = out_limit; \
+	gint x; \
+\
+	memcpy(row, rows, sizeof(row)); \
+	memcpy(lut, luts, sizeof(lut)); \
+	for(x=0; x<len; x++){ \
+		float acc = 0.5f; \
+		ROWS_##S(WEIGHTED_ROW, S, STEP) \
+		dst[x] = inverse_gamma[(unsigned int)CLAMP(acc, 0.0f, limit)]; \
+	} \
+}
+
+// The vertical pass has no step, one version per kernel size
+#define DEFINE_SIZE(S) \
+static void \
+convolve_column_##S (guint8 *dst, const float **rows, gint len, const float *kernel, gint taps, \
+		const unsigned int *inverse_gamma, gint out_limit) \
+{ \
+	const float *row[S]; \
+	float k[S]; \
+	float limit = out_limit; \
+	gint x; \
+\
+	memcpy(row, rows, sizeof(row)); \
+	memcpy(k, kernel, sizeof(k)); \
+	for(x=0; x<len; x++){ \
+		float acc = 0.0f; \
+		TAPS_##S(COLUMN_TAP, S) \
+		dst[x] = inverse_gamma[(unsigned int)CLAMP(acc+0.5f, 0.0f, limit)]; \
+	} \
+} \
+\
+static void \
+convolve_column_u16_##S (guint16 *dst, const float **rows, gint len, const float *kernel, gint taps, \
+		const unsigned int *inverse_gamma, gint out_limit) \
+{ \
+	const float *row[S]; \
+	float k[S]; \
+	float limit = out_limit; \
+	gint x; \
+\
+	memcpy(row, rows, sizeof(row)); \
+	memcpy(k, kernel, sizeof(k)); \
+	for(x=0; x<len; x++){ \
+		float acc = 0.0f; \
+		TAPS_##S(COLUMN_TAP, S) \
+		dst[x] = inverse_gamma[(unsigned int)CLAMP(acc+0.5f, 0.0f, limit)]; \
+	} \
+} \
+\
+static void \
+convolve_column16_##S (guint8 *dst, const guint16 **rows, gint len, const gint16 *kernel, gint taps, \
+		const unsigned int *inverse_gamma, gint shift, gint out_limit) \
+{ \
+	const guint16 *row[S]; \
+	gint32 k[S]; \
+	gint32 round = (SMOOTHING_FIXED_ONE/2) << shift; \
+	gint x, i; \
+\
+	memcpy(row, rows, sizeof(row)); \
+	for(i=0; i<S; i++) \
+		k[i] = kernel[i]; \
+	for(x=0; x<len; x++){ \
+		gint32 acc = round; \
+		TAPS_##S(COLUMN_TAP, S) \
+		dst[x] = inverse_gamma[MIN(acc >> (SMOOTHING_FIXED_BITS+shift), out_limit)]; \
+	} \
+} \
+DEFINE_STEP(S, 1) \
+DEFINE_STEP(S, 2) \
+DEFINE_STEP(S, 3)
+
+DEFINE_SIZE(3)
+DEFINE_SIZE(5)
+DEFINE_SIZE(7)
+
+DEFINE_WEIGHTED_STEP(3, 1)
+DEFINE_WEIGHTED_STEP(3, 2)
+DEFINE_WEIGHTED_STEP(3, 3)
+DEFINE_WEIGHTED_STEP(5, 1)
+DEFINE_WEIGHTED_STEP(5, 2)
+DEFINE_WEIGHTED_STEP(5, 3)
+
+#define FUNCS(S, STEP) { \
+	"c-unrolled", \
+	smoothing_linearise_c, \
+	convolve_row_##S##_##STEP, \
+	convolve_column_##S, \
+	direct_row_##S##_##STEP, \
+	smoothing_linearise16_c, \
+	convolve_row16_##S##_##STEP, \
+	convolve_column16_##S, \
+	direct_row16_##S##_##STEP, \
+	smoothing_linearise_u16_c, \
+	convolve_column_u16_##S, \
+	direct_row_u16_##S##_##STEP \
+}
+
+const SmoothingFuncs smoothing_funcs_unrolled[SMOOTHING_UNROLLED_MAX_KERNELSIZE][SMOOTHING_UNROLLED_MAX_STEP] = {
+	{ FUNCS(3, 1), FUNCS(3, 2), FUNCS(3, 3) },
+	{ FUNCS(5, 1), FUNCS(5, 2), FUNCS(5, 3) },
+	{ FUNCS(7, 1), FUNCS(7, 2), FUNCS(7, 3) }
+};
+
+const SmoothingWeightedRowFunc smoothing_weighted_rows_unrolled[SMOOTHING_WEIGHTED_MAX_KERNELSIZE][SMOOTHING_UNROLLED_MAX_STEP] = {
+	{ direct_row_weighted_3_1, direct_row_weighted_3_2, direct_row_weighted_3_3 },
+	{ direct_row_weighted_5_1, direct_row_weighted_5_2, direct_row_weighted_5_3 }
+};
@@ -0,0 +1,1498 @@
+/*
+ * Smoothing Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* The convolution engines used by the smoothingfilter element.
+ * Each engine smooths one frame in linear intensity using the gamma luts and kernel it is given in a SmoothingJob.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <math.h>
+
+#include "gstsmoothingengine.h"
+
+static const SmoothingFuncs smoothing_funcs_c = {
+	"c",
+	smoothing_linearise_c,
+	smoothing_convolve_row_c,
+	smoothing_convolve_column_c,
+	smoothing_direct_row_c,
+	smoothing_linearise16_c,
+	smoothing_convolve_row16_c,
+	smoothing_convolve_column16_c,
+	smoothing_direct_row16_c,
+	smoothing_linearise_u16_c,
+	smoothing_convolve_column_u16_c,
+	smoothing_direct_row_u16_c
+};
+
+static const SmoothingFuncs *smoothing_funcs_best = &smoothing_funcs_c;
+
+/* Pick the fastest row functions this CPU can run, called once at plugin load */
+void
+smoothing_engine_init (void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+#ifdef HAVE_SSE41
+	if (__builtin_cpu_supports("sse4.1"))
+		smoothing_funcs_best = &smoothing_funcs_sse41;
+#endif
+#ifdef HAVE_AVX2
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		smoothing_funcs_best = &smoothing_funcs_avx2;
+#endif
+#endif
+}
+
+const SmoothingFuncs *
+smoothing_get_funcs (gboolean simd)
+{
+	return simd ? smoothing_funcs_best : &smoothing_funcs_c;
+}
+
+/* funcs, or a version of them with the taps unrolled for this kernel size and step if there is one.
+ * Called once per plane of a frame. Only the plain C functions are specialised, the SIMD ones already
+ * vectorise each tap across the row. The kernels passed to the row functions must then have 2*kernelsize+1 taps,
+ * so this is not for smoothing_downscale().
+ */
+const SmoothingFuncs *
+smoothing_get_funcs_unrolled (const SmoothingFuncs *funcs, gint kernelsize, gint step)
+{
+	if (funcs != &smoothing_funcs_c || kernelsize < 1 || kernelsize > SMOOTHING_UNROLLED_MAX_KERNELSIZE ||
+			step < 1 || step > SMOOTHING_UNROLLED_MAX_STEP)
+		return funcs;
+
+	return &smoothing_funcs_unrolled[kernelsize-1][step-1];
+}
+
+// Make sure *buffer holds at least size bytes, it keeps its old contents only if it was already big enough
+static gboolean
+smoothing_grow (gpointer *buffer, gsize *allocated, gsize size)
+{
+	if (*allocated >= size)
+		return TRUE;
+
+	g_free(*buffer);
+	*buffer = g_malloc(size);
+	*allocated = *buffer ? size : 0;
+
+	return *buffer != NULL;
+}
+
+// Bytes of the values of one pixel
+static inline gint
+smoothing_pixel_bytes (const SmoothingJob *job)
+{
+	return job->comp*job->depth;
+}
+
+static inline gboolean
+smoothing_job_is_packed (const SmoothingJob *job)
+{
+	return job->pstride != smoothing_pixel_bytes(job);
+}
+
+// Bytes spanned by one row of the plane, from its first value to its last
+static inline gint
+smoothing_row_bytes (const SmoothingJob *job)
+{
+	return (job->width-1)*job->pstride + smoothing_pixel_bytes(job);
+}
+
+/* Get the row buffers the job's engine needs, only ever growing them */
+gboolean
+smoothing_scratch_ensure (SmoothingScratch *scratch, const SmoothingJob *job)
+{
+	gint n = job->kernelsize;
+	gint s = 2*n+1;
+	gsize row_len = (gsize)job->width*job->comp;
+
+	if (job->engine == smoothing_separable || job->engine == smoothing_separable_fixed){
+		if (!smoothing_grow((gpointer *)&scratch->line_buffer, &scratch->line_size, (row_len+2*n*job->comp)*sizeof(float)))
+			return FALSE;
+	}
+
+	// One input row padded by n+factor pixels either side, and a ring of down_taps decimated rows
+	if (job->engine == smoothing_downscale){
+		if (!smoothing_grow((gpointer *)&scratch->line_buffer, &scratch->line_size,
+					(row_len+2*(n+job->factor)*job->comp)*sizeof(float)) ||
+				!smoothing_grow((gpointer *)&scratch->ring_buffer, &scratch->ring_size,
+					(gsize)job->down_taps*job->out_width*job->comp*sizeof(float)))
+			return FALSE;
+	}
+
+	// The ring of s linearised rows, the fixed point engines only use half of it
+	if (job->engine == smoothing_separable || job->engine == smoothing_separable_fixed ||
+			job->engine == smoothing_direct || job->engine == smoothing_direct_fixed){
+		if (!smoothing_grow((gpointer *)&scratch->ring_buffer, &scratch->ring_size, s*row_len*sizeof(float)))
+			return FALSE;
+	}
+
+	// One padded linearised input row followed by one output row, and rings of s padded rows in linear intensity and 8 bit levels
+	if (job->engine == smoothing_bilateral || job->engine == smoothing_bilateral_separable){
+		gsize padded_len = row_len + 2*n*job->comp;
+		if (!smoothing_grow((gpointer *)&scratch->line_buffer, &scratch->line_size, (padded_len+row_len)*sizeof(float)) ||
+				!smoothing_grow((gpointer *)&scratch->ring_buffer, &scratch->ring_size, s*padded_len*sizeof(float)) ||
+				!smoothing_grow((gpointer *)&scratch->level_buffer, &scratch->level_size, s*padded_len))
+			return FALSE;
+	}
+
+	// A ring of s packed or copied input rows for smoothing_direct_weighted(), and one packed output row
+	if ((smoothing_job_is_packed(job) || (job->engine == smoothing_direct_weighted && job->src == job->dst)) &&
+			!smoothing_grow((gpointer *)&scratch->pack_buffer, &scratch->pack_size, (s+1)*row_len*job->depth))
+		return FALSE;
+
+	return TRUE;
+}
+
+void
+smoothing_scratch_free (SmoothingScratch *scratch)
+{
+	g_free(scratch->line_buffer);   // no need to check for NULL
+	g_free(scratch->ring_buffer);
+	g_free(scratch->pack_buffer);
+	g_free(scratch->level_buffer);
+	scratch->line_buffer = NULL;
+	scratch->ring_buffer = NULL;
+	scratch->pack_buffer = NULL;
+	scratch->level_buffer = NULL;
+	scratch->line_size = 0;
+	scratch->ring_size = 0;
+	scratch->pack_size = 0;
+	scratch->level_size = 0;
+}
+
+/* Copy the input rows just outside the stripe, so they can be read after the neighbouring stripes have overwritten them */
+gboolean
+smoothing_stripe_save_halo (const SmoothingJob *job, SmoothingStripe *stripe)
+{
+	gint n = job->kernelsize;
+	gint row_bytes = smoothing_row_bytes(job);
+	gint k;
+
+	if (!smoothing_grow((gpointer *)&stripe->halo, &stripe->halo_size, (gsize)2*n*row_bytes))
+		return FALSE;
+	stripe->halo_stride = row_bytes;
+
+	for(k=0; k<n; k++){
+		gint above = stripe->y0-n+k;
+		gint below = stripe->y1+k;
+		if (above >= 0)
+			memcpy(stripe->halo + k*row_bytes, job->src + job->src_stride * above, row_bytes);
+		if (below < job->height)
+			memcpy(stripe->halo + (n+k)*row_bytes, job->src + job->src_stride * below, row_bytes);
+	}
+
+	return TRUE;
+}
+
+void
+smoothing_stripe_free (SmoothingStripe *stripe)
+{
+	g_free(stripe->halo);
+	stripe->halo = NULL;
+	stripe->halo_size = 0;
+	smoothing_scratch_free(&stripe->scratch);
+}
+
+// The input row y, which must be inside the image, taking it from the halo if it is outside the stripe
+static inline const guint8 *
+smoothing_src_row (const SmoothingJob *job, const SmoothingStripe *stripe, gint y)
+{
+	if (stripe->halo){
+		if (y < stripe->y0)
+			return stripe->halo + (y-stripe->y0+job->kernelsize) * stripe->halo_stride;
+		if (y >= stripe->y1)
+			return stripe->halo + (y-stripe->y1+job->kernelsize) * stripe->halo_stride;
+	}
+	return job->src + job->src_stride * y;
+}
+
+// Copy count pixels of bytes each, pstride bytes apart in both src and dst
+void
+smoothing_copy_pixels (guint8 *dst, const guint8 *src, gint count, gint bytes, gint pstride)
+{
+	gint x, c;
+
+	if (bytes == pstride){
+		memcpy(dst, src, count*bytes);
+		return;
+	}
+	for(x=0; x<count; x++){
+		for(c=0; c<bytes; c++)
+			dst[x*pstride+c] = src[x*pstride+c];
+	}
+}
+
+// Gather count pixels of bytes each, pstride bytes apart, into contiguous memory, and scatter them back
+static void
+smoothing_pack_row (guint8 *dst, const guint8 *src, gint count, gint bytes, gint pstride)
+{
+	gint x, c;
+
+	for(x=0; x<count; x++){
+		for(c=0; c<bytes; c++)
+			dst[x*bytes+c] = src[x*pstride+c];
+	}
+}
+
+static void
+smoothing_unpack_row (guint8 *dst, const guint8 *src, gint count, gint bytes, gint pstride)
+{
+	gint x, c;
+
+	for(x=0; x<count; x++){
+		for(c=0; c<bytes; c++)
+			dst[x*pstride+c] = src[x*bytes+c];
+	}
+}
+
+// Input row y with contiguous values, packing it into slot of the stripe's pack buffer if the plane needs it
+static inline const guint8 *
+smoothing_src_row_packed (const SmoothingJob *job, SmoothingStripe *stripe, gint y, gint slot)
+{
+	const guint8 *src = smoothing_src_row(job, stripe, y);
+	guint8 *packed;
+
+	if (!smoothing_job_is_packed(job))
+		return src;
+
+	packed = stripe->scratch.pack_buffer + (gsize)slot*job->width*smoothing_pixel_bytes(job);
+	smoothing_pack_row(packed, src, job->width, smoothing_pixel_bytes(job), job->pstride);
+	return packed;
+}
+
+void
+smoothing_linearise_c (float *dst, const guint8 *src, gint len, const float *forward_gamma)
+{
+	gint x;
+
+	for(x=0; x<len; x++)
+		dst[x] = forward_gamma[src[x]];
+}
+
+void
+smoothing_convolve_row_c (float *dst, const float *src, gint len, gint step, const float *kernel, gint taps)
+{
+	gint x, j;
+
+	for(x=0; x<len; x++)
+		dst[x] = kernel[0] * src[x];
+	for(j=1; j<taps; j++){
+		const float *tap = src + j*step;
+		for(x=0; x<len; x++)
+			dst[x] += kernel[j] * tap[x];
+	}
+}
+
+void
+smoothing_convolve_column_c (guint8 *dst, const float **rows, gint len, const float *kernel, gint taps,
+		const unsigned int *inverse_gamma, gint out_limit)
+{
+	float acc[256];   // accumulate a chunk of the row at a time so the inner loops stay simple
+	float limit = out_limit;
+	gint start, x, i;
+
+	for(start=0; start<len; start+=256){
+		gint count = MIN(256, len-start);
+
+		for(x=0; x<count; x++)
+			acc[x] = kernel[0] * rows[0][start+x];
+		for(i=1; i<taps; i++){
+			const float *row = rows[i] + start;
+			for(x=0; x<count; x++)
+				acc[x] += kernel[i] * row[x];
+		}
+		for(x=0; x<count; x++)
+			dst[start+x] = inverse_gamma[(unsigned int)CLAMP(acc[x]+0.5f, 0.0f, limit)];
+	}
+}
+
+void
+smoothing_direct_row_c (guint8 *dst, const float **rows, gint len, gint step, const float *kernel, gint s,
+		const unsigned int *inverse_gamma, gint out_limit)
+{
+	float acc[256];
+	float limit = out_limit;
+	gint start, x, i, j;
+
+	// A block of accumulators at a time so each tap is a plain multiply-add over contiguous values
+	for(start=0; start<len; start+=256){
+		gint count = MIN(256, len-start);
+
+		for(x=0; x<count; x++)
+			acc[x] = 0.5f;
+		for(i=0; i<s; i++){
+			for(j=0; j<s; j++){
+				const float *row = rows[i] + start + j*step;
+				float k = kernel[i*s+j];
+				for(x=0; x<count; x++)
+					acc[x] += k * row[x];
+			}
+		}
+		for(x=0; x<count; x++)
+			dst[start+x] = inverse_gamma[(unsigned int)CLAMP(acc[x], 0.0f, limit)];
+	}
+}
+
+/* Temporal averaging, fused into the output of the float engines.
+ * Each smoothed linear intensity is blended into the running average of earlier frames,
+ * history[x] += alpha*(smoothed[x]-history[x]), and the average is what gets written out.
+ * With init the history is simply set, for the first frame.
+ */
+
+// The vertical pass of the separable engine, into history
+void
+smoothing_temporal_column (float *history, const float **rows, gint len, const float *kernel, gint taps,
+		float alpha, gboolean init)
+{
+	float acc[256];
+	gint start, x, i;
+
+	for(start=0; start<len; start+=256){
+		gint count = MIN(256, len-start);
+
+		for(x=0; x<count; x++)
+			acc[x] = kernel[0] * rows[0][start+x];
+		for(i=1; i<taps; i++){
+			const float *row = rows[i] + start;
+			for(x=0; x<count; x++)
+				acc[x] += kernel[i] * row[x];
+		}
+		smoothing_temporal_blend(history + start, acc, count, alpha, init);
+	}
+}
+
+// One output row of the direct engine, into history
+void
+smoothing_temporal_direct_row (float *history, const float **rows, gint len, gint step, const float *kernel, gint s,
+		float alpha, gboolean init)
+{
+	float acc[256];
+	gint start, x, i, j;
+
+	for(start=0; start<len; start+=256){
+		gint count = MIN(256, len-start);
+
+		for(x=0; x<count; x++)
+			acc[x] = 0.0f;
+		for(i=0; i<s; i++){
+			for(j=0; j<s; j++){
+				const float *row = rows[i] + start + j*step;
+				float k = kernel[i*s+j];
+				for(x=0; x<count; x++)
+					acc[x] += k * row[x];
+			}
+		}
+		smoothing_temporal_blend(history + start, acc, count, alpha, init);
+	}
+}
+
+void
+smoothing_temporal_blend (float *history, const float *value, gint len, float alpha, gboolean init)
+{
+	gint x;
+
+	if (init){
+		memcpy(history, value, len*sizeof(float));
+		return;
+	}
+	for(x=0; x<len; x++)
+		history[x] += alpha * (value[x] - history[x]);
+}
+
+// dst[x] = inverse_gamma[src[x]], for 8 or 16 bit values
+void
+smoothing_delinearise (guint8 *dst, const float *src, gint len, gint depth, const unsigned int *inverse_gamma,
+		gint out_limit)
+{
+	float limit = out_limit;
+	gint x;
+
+	if (depth == 2){
+		for(x=0; x<len; x++)
+			((guint16 *)dst)[x] = inverse_gamma[(unsigned int)CLAMP(src[x]+0.5f, 0.0f, limit)];
+	}
+	else {
+		for(x=0; x<len; x++)
+			dst[x] = inverse_gamma[(unsigned int)CLAMP(src[x]+0.5f, 0.0f, limit)];
+	}
+}
+
+/* Quantise kernel weights that sum to 1 into Q14 weights that sum to exactly SMOOTHING_FIXED_ONE,
+ * so a flat area keeps its brightness. Any rounding error goes on the largest (central) weight.
+ */
+void
+smoothing_quantise_kernel (gint16 *dst, const float *kernel, gint len)
+{
+	gint i, sum = 0, largest = 0;
+
+	for(i=0; i<len; i++){
+		dst[i] = (gint16)(kernel[i]*SMOOTHING_FIXED_ONE + 0.5f);
+		sum += dst[i];
+		if (dst[i] > dst[largest])
+			largest = i;
+	}
+	dst[largest] += SMOOTHING_FIXED_ONE - sum;
+}
+
+/* Build one lut of forward_gamma multiplied by each distinct weight in the kernel, so the direct engine
+ * can look up a weighted linear intensity for each tap and only has to add them.
+ * weight_index gets the lut number for each tap and weighted_gamma needs room for taps luts.
+ * Returns the number of luts built.
+ */
+gint
+smoothing_weighted_gamma_build (float *weighted_gamma, guint8 *weight_index, const float *kernel, gint taps,
+		const float *forward_gamma)
+{
+	float weights[(2*SMOOTHING_WEIGHTED_MAX_KERNELSIZE+1)*(2*SMOOTHING_WEIGHTED_MAX_KERNELSIZE+1)];
+	gint n_weights = 0;
+	gint k, w, v;
+
+	g_return_val_if_fail(taps <= G_N_ELEMENTS(weights), 0);
+
+	for(k=0; k<taps; k++){
+		// A Gaussian kernel is symmetric so taps at the same distance from the centre have identical weights
+		for(w=0; w<n_weights; w++){
+			if (weights[w] == kernel[k])
+				break;
+		}
+		if (w == n_weights){
+			float *lut = weighted_gamma + n_weights*SMOOTHING_WEIGHTED_LUT_SIZE;
+			for(v=0; v<SMOOTHING_WEIGHTED_LUT_SIZE; v++)
+				lut[v] = forward_gamma[v] * kernel[k];
+			weights[n_weights++] = kernel[k];
+		}
+		weight_index[k] = w;
+	}
+
+	return n_weights;
+}
+
+void
+smoothing_linearise16_c (guint16 *dst, const guint8 *src, gint len, const guint16 *forward_gamma16)
+{
+	gint x;
+
+	for(x=0; x<len; x++)
+		dst[x] = forward_gamma16[src[x]];
+}
+
+void
+smoothing_convolve_row16_c (guint16 *dst, const guint16 *src, gint len, gint step, const gint16 *kernel, gint taps)
+{
+	gint32 acc[256];
+	gint start, x, j;
+
+	for(start=0; start<len; start+=256){
+		gint count = MIN(256, len-start);
+
+		for(x=0; x<count; x++)
+			acc[x] = kernel[0] * src[start+x];
+		for(j=1; j<taps; j++){
+			const guint16 *tap = src + start + j*step;
+			for(x=0; x<count; x++)
+				acc[x] += kernel[j] * tap[x];
+		}
+		for(x=0; x<count; x++)
+			dst[start+x] = (acc[x] + SMOOTHING_FIXED_ONE/2) >> SMOOTHING_FIXED_BITS;
+	}
+}
+
+void
+smoothing_convolve_column16_c (guint8 *dst, const guint16 **rows, gint len, const gint16 *kernel, gint taps,
+		const unsigned int *inverse_gamma, gint shift, gint out_limit)
+{
+	gint32 acc[256];
+	gint32 round = (SMOOTHING_FIXED_ONE/2) << shift;
+	gint start, x, i;
+
+	for(start=0; start<len; start+=256){
+		gint count = MIN(256, len-start);
+
+		for(x=0; x<count; x++)
+			acc[x] = kernel[0] * rows[0][start+x];
+		for(i=1; i<taps; i++){
+			const guint16 *row = rows[i] + start;
+			for(x=0; x<count; x++)
+				acc[x] += kernel[i] * row[x];
+		}
+		for(x=0; x<count; x++)
+			dst[start+x] = inverse_gamma[MIN((acc[x] + round) >> (SMOOTHING_FIXED_BITS+shift), out_limit)];
+	}
+}
+
+void
+smoothing_direct_row16_c (guint8 *dst, const guint16 **rows, gint len, gint step, const gint16 *kernel, gint s,
+		const unsigned int *inverse_gamma, gint shift, gint out_limit)
+{
+	gint32 round = (SMOOTHING_FIXED_ONE/2) << shift;
+	gint x, i, j;
+
+	for(x=0; x<len; x++){
+		gint32 acc = round;
+		for(i=0; i<s; i++){
+			for(j=0; j<s; j++)
+				acc += rows[i][x+j*step] * kernel[i*s+j];
+		}
+		dst[x] = inverse_gamma[MIN(acc >> (SMOOTHING_FIXED_BITS+shift), out_limit)];
+	}
+}
+
+void
+smoothing_linearise_u16_c (float *dst, const guint16 *src, gint len, const float *forward_gamma)
+{
+	gint x;
+
+	for(x=0; x<len; x++)
+		dst[x] = forward_gamma[src[x]];
+}
+
+void
+smoothing_convolve_column_u16_c (guint16 *dst, const float **rows, gint len, const float *kernel, gint taps,
+		const unsigned int *inverse_gamma, gint out_limit)
+{
+	float acc[256];
+	float limit = out_limit;
+	gint start, x, i;
+
+	for(start=0; start<len; start+=256){
+		gint count = MIN(256, len-start);
+
+		for(x=0; x<count; x++)
+			acc[x] = kernel[0] * rows[0][start+x];
+		for(i=1; i<taps; i++){
+			const float *row = rows[i] + start;
+			for(x=0; x<count; x++)
+				acc[x] += kernel[i] * row[x];
+		}
+		for(x=0; x<count; x++)
+			dst[start+x] = inverse_gamma[(unsigned int)CLAMP(acc[x]+0.5f, 0.0f, limit)];
+	}
+}
+
+void
+smoothing_direct_row_u16_c (guint16 *dst, const float **rows, gint len, gint step, const float *kernel, gint s,
+		const unsigned int *inverse_gamma, gint out_limit)
+{
+	float acc[256];
+	float limit = out_limit;
+	gint start, x, i, j;
+
+	for(start=0; start<len; start+=256){
+		gint count = MIN(256, len-start);
+
+		for(x=0; x<count; x++)
+			acc[x] = 0.5f;
+		for(i=0; i<s; i++){
+			for(j=0; j<s; j++){
+				const float *row = rows[i] + start + j*step;
+				float k = kernel[i*s+j];
+				for(x=0; x<count; x++)
+					acc[x] += k * row[x];
+			}
+		}
+		for(x=0; x<count; x++)
+			dst[start+x] = inverse_gamma[(unsigned int)CLAMP(acc[x], 0.0f, limit)];
+	}
+}
+
+/* The direct engines leave pixels closer than n to an edge as they are, out-of-place they still have to be copied across.
+ * Returns FALSE if the image is too small for the kernel, and there is nothing else to do.
+ */
+static gboolean
+smoothing_direct_borders (const SmoothingJob *job, const SmoothingStripe *stripe)
+{
+	gint n = job->kernelsize;
+	gint s = 2*n+1;
+	gint width = job->width;
+	gint height = job->height;
+	gint bytes = smoothing_pixel_bytes(job);
+	gint pstride = job->pstride;
+	gint y;
+
+	if (job->src != job->dst){
+		for(y=stripe->y0; y<stripe->y1; y++){
+			const guint8 *src = job->src + job->src_stride * y;
+			guint8 *dst = job->dst + job->dst_stride * y;
+			if (y < n || y >= height-n || width < s){
+				smoothing_copy_pixels(dst, src, width, bytes, pstride);
+			}
+			else {
+				smoothing_copy_pixels(dst, src, n, bytes, pstride);
+				smoothing_copy_pixels(dst+(width-n)*pstride, src+(width-n)*pstride, n, bytes, pstride);
+			}
+		}
+	}
+
+	return width >= s && height >= s;
+}
+
+// Point rows[] at the s input rows under output row y, for smoothing_direct_weighted().
+// Packed planes, and planes smoothed in-place, go through a ring of s rows in the pack buffer so the
+// input is never a pixel that has already been smoothed. *next_row is the next input row to copy and starts at 0.
+static void
+smoothing_direct_input (const SmoothingJob *job, SmoothingStripe *stripe, gint y, const guint8 **rows, gint *next_row)
+{
+	gint n = job->kernelsize;
+	gint s = 2*n+1;
+	gsize row_bytes = (gsize)job->width*smoothing_pixel_bytes(job);
+	gint i;
+
+	if (!smoothing_job_is_packed(job) && job->src != job->dst){
+		for(i=0; i<s; i++)
+			rows[i] = smoothing_src_row(job, stripe, y-n+i);
+		return;
+	}
+
+	*next_row = MAX(*next_row, y-n);
+	for(; *next_row<=y+n; (*next_row)++){
+		guint8 *slot = stripe->scratch.pack_buffer + (*next_row % s)*row_bytes;
+		const guint8 *src = smoothing_src_row(job, stripe, *next_row);
+		if (smoothing_job_is_packed(job))
+			smoothing_pack_row(slot, src, job->width, smoothing_pixel_bytes(job), job->pstride);
+		else
+			memcpy(slot, src, row_bytes);
+	}
+	for(i=0; i<s; i++)
+		rows[i] = stripe->scratch.pack_buffer + ((y-n+i) % s)*row_bytes;
+}
+
+// Where the direct engines write output row y, with contiguous values, starting at pixel 0
+static inline guint8 *
+smoothing_direct_output (const SmoothingJob *job, SmoothingStripe *stripe, gint y)
+{
+	if (smoothing_job_is_packed(job))
+		return stripe->scratch.pack_buffer + (gsize)(2*job->kernelsize+1)*job->width*smoothing_pixel_bytes(job);
+	return job->dst + job->dst_stride * y;
+}
+
+// Scatter a packed output row back into the plane
+static inline void
+smoothing_direct_finish (const SmoothingJob *job, SmoothingStripe *stripe, gint y, const guint8 *out)
+{
+	gint n = job->kernelsize;
+
+	if (smoothing_job_is_packed(job))
+		smoothing_unpack_row(job->dst + job->dst_stride * y + n*job->pstride, out + n*smoothing_pixel_bytes(job),
+				job->width-2*n, smoothing_pixel_bytes(job), job->pstride);
+}
+
+/* Direct implementation
+ * Applies the (2n+1)*(2n+1) kernel centred on each output pixel, s*s multiply-adds per channel.
+ * Pixels closer than n to an edge are left as they are.
+ * Each input row is linearised once, into a ring of the last s rows in the scratch ring_buffer, and every tap
+ * reads the ring rather than looking the input up in forward_gamma again. The ring is a few rows so it stays in cache.
+ * Input row y+n is in the ring before output row y is written, and rows are read in order, so in-place
+ * every output pixel is still calculated from the original input.
+ */
+void
+smoothing_direct (const SmoothingJob *job, SmoothingStripe *stripe)
+{
+	const SmoothingFuncs *funcs = job->funcs;
+	float *ring = stripe->scratch.ring_buffer;
+	const float *rows[2*MAX_KERNELSIZE+1];
+	gint n = job->kernelsize;
+	gint s = 2*n+1;
+	gint comp = job->comp;
+	gint width = job->width;
+	gint height = job->height;
+	gint row_len = width*comp;
+	gint next_row = MAX(n, stripe->y0) - n;
+	gint y, i;
+
+	if (!smoothing_direct_borders(job, stripe))
+		return;
+
+	for(y=MAX(n, stripe->y0); y<MIN(height-n, stripe->y1); y++){
+		guint8 *out;
+
+		// Linearise input rows into the ring until it holds row y+n
+		for(; next_row<=y+n; next_row++){
+			const guint8 *src = smoothing_src_row_packed(job, stripe, next_row, 0);
+			float *line = ring + (next_row % s) * row_len;
+			if (job->depth == 2)
+				funcs->linearise_u16(line, (const guint16 *)src, row_len, job->forward_gamma);
+			else
+				funcs->linearise(line, src, row_len, job->forward_gamma);
+		}
+
+		for(i=0; i<s; i++)
+			rows[i] = ring + ((y-n+i) % s) * row_len;
+
+		out = smoothing_direct_output(job, stripe, y);
+		if (job->temporal){
+			float *history = job->temporal + (gsize)y*row_len + n*comp;
+			smoothing_temporal_direct_row(history, rows, (width-2*n)*comp, comp, job->kernel2d, s,
+					job->alpha, job->temporal_init);
+			smoothing_delinearise(out + n*comp*job->depth, history, (width-2*n)*comp, job->depth,
+					job->inverse_gamma, job->out_limit);
+		}
+		else if (job->depth == 2)
+			funcs->direct_row_u16((guint16 *)out + n*comp, rows, (width-2*n)*comp, comp,
+					job->kernel2d, s, job->inverse_gamma, job->out_limit);
+		else
+			funcs->direct_row(out + n*comp, rows, (width-2*n)*comp, comp,
+					job->kernel2d, s, job->inverse_gamma, job->out_limit);
+		smoothing_direct_finish(job, stripe, y, out);
+	}
+}
+
+/* Fixed point version of smoothing_direct(), the ring holds 14 bit linear intensities */
+void
+smoothing_direct_fixed (const SmoothingJob *job, SmoothingStripe *stripe)
+{
+	const SmoothingFuncs *funcs = job->funcs;
+	guint16 *ring = (guint16 *)stripe->scratch.ring_buffer;
+	const guint16 *rows[2*MAX_KERNELSIZE+1];
+	gint n = job->kernelsize;
+	gint s = 2*n+1;
+	gint comp = job->comp;
+	gint width = job->width;
+	gint height = job->height;
+	gint row_len = width*comp;
+	gint next_row = MAX(n, stripe->y0) - n;
+	gint y, i;
+
+	g_return_if_fail(job->depth == 1);
+
+	if (!smoothing_direct_borders(job, stripe))
+		return;
+
+	for(y=MAX(n, stripe->y0); y<MIN(height-n, stripe->y1); y++){
+		guint8 *out;
+
+		for(; next_row<=y+n; next_row++)
+			funcs->linearise16(ring + (next_row % s) * row_len, smoothing_src_row_packed(job, stripe, next_row, 0),
+					row_len, job->forward_gamma16);
+
+		for(i=0; i<s; i++)
+			rows[i] = ring + ((y-n+i) % s) * row_len;
+
+		out = smoothing_direct_output(job, stripe, y);
+		funcs->direct_row16(out + n*comp, rows, (width-2*n)*comp, comp,
+				job->kernel2d_q, s, job->inverse_gamma, job->fixed_shift, job->out_limit);
+		smoothing_direct_finish(job, stripe, y, out);
+	}
+}
+
+// One output row of smoothing_direct_weighted(), for steps without an unrolled version
+static void
+smoothing_direct_row_weighted (guint8 *dst, const guint8 **rows, gint len, gint step, const float **luts, gint s,
+		const unsigned int *inverse_gamma, gint out_limit)
+{
+	float limit = out_limit;
+	gint x, i, j;
+
+	for(x=0; x<len; x++){
+		float val = 0.5f;
+		for(i=0; i<s; i++){
+			const float **row_luts = luts + i*s;
+			for(j=0; j<s; j++)
+				val += row_luts[j][rows[i][x+j*step]];
+		}
+		dst[x] = inverse_gamma[(unsigned int)CLAMP(val, 0.0f, limit)];
+	}
+}
+
+/* Version of smoothing_direct() for small kernels without SIMD.
+ * Each tap looks up its input value in a copy of forward_gamma already multiplied by the tap's weight,
+ * so there are no multiplies at all. Needs kernelsize <= SMOOTHING_WEIGHTED_MAX_KERNELSIZE.
+ * In-place each input row is copied to a ring before it is overwritten, as the luts need the raw values.
+ * Each row goes through the version of the row function unrolled for the kernel size and step.
+ */
+void
+smoothing_direct_weighted (const SmoothingJob *job, SmoothingStripe *stripe)
+{
+	const guint8 *rows[2*SMOOTHING_WEIGHTED_MAX_KERNELSIZE+1];
+	const float *luts[(2*SMOOTHING_WEIGHTED_MAX_KERNELSIZE+1)*(2*SMOOTHING_WEIGHTED_MAX_KERNELSIZE+1)];
+	SmoothingWeightedRowFunc direct_row = smoothing_direct_row_weighted;
+	gint n = job->kernelsize;
+	gint s = 2*n+1;
+	gint comp = job->comp;
+	gint width = job->width;
+	gint height = job->height;
+	gint next_row = 0;
+	gint y, i;
+
+	g_return_if_fail(n <= SMOOTHING_WEIGHTED_MAX_KERNELSIZE);
+	g_return_if_fail(job->depth == 1);
+
+	if (!smoothing_direct_borders(job, stripe))
+		return;
+
+	for(i=0; i<s*s; i++)
+		luts[i] = job->weighted_gamma + job->weight_index[i]*SMOOTHING_WEIGHTED_LUT_SIZE;
+	if (n >= 1 && comp <= SMOOTHING_UNROLLED_MAX_STEP)
+		direct_row = smoothing_weighted_rows_unrolled[n-1][comp-1];
+
+	for(y=MAX(n, stripe->y0); y<MIN(height-n, stripe->y1); y++){
+		guint8 *out = smoothing_direct_output(job, stripe, y);
+		smoothing_direct_input(job, stripe, y, rows, &next_row);
+		direct_row(out + n*comp, rows, (width-2*n)*comp, comp,
+				luts, s, job->inverse_gamma, job->out_limit);
+		smoothing_direct_finish(job, stripe, y, out);
+	}
+}
+
+/* Separable implementation
+ * The Gaussian e^(-(x^2+y^2)/sigma^2) is the product of two 1D Gaussians, so each input row is
+ * linearised once, filtered horizontally into a ring of 2n+1 rows and the rows of the ring are
+ * then combined vertically for each output row. This is 2s multiply-adds per channel instead of s*s.
+ * The kernel is centred on the output pixel and the image edges are extended by repeating the border pixels.
+ * Input row y+n is always in the ring before output row y is written, so this is safe in-place.
+ */
+void
+smoothing_separable (const SmoothingJob *job, SmoothingStripe *stripe)
+{
+	SmoothingScratch *scratch = &stripe->scratch;
+	const SmoothingFuncs *funcs = job->funcs;
+	const float *kernel = job->kernel1d;
+	float *line = scratch->line_buffer;
+	const float *rows[2*MAX_KERNELSIZE+1];
+	gint n = job->kernelsize;
+	gint s = 2*n+1;
+	gint width = job->width;
+	gint height = job->height;
+	gint comp = job->comp;
+	gint row_len = width*comp;   // values per row, the channels of each pixel are kept interleaved
+	gint next_row = MAX(0, stripe->y0-n);
+	gboolean packed = smoothing_job_is_packed(job);
+	guint8 *out = scratch->pack_buffer + (gsize)s*row_len*job->depth;
+	guint8 *dst;
+	gint y, i, j, c;
+
+	for(y=stripe->y0; y<stripe->y1; y++){
+
+		// Filter input rows horizontally into the ring until it holds row y+n
+		while(next_row <= MIN(y+n, height-1)){
+			const guint8 *src = smoothing_src_row_packed(job, stripe, next_row, 0);
+			if (job->depth == 2)
+				funcs->linearise_u16(line + n*comp, (const guint16 *)src, row_len, job->forward_gamma);
+			else
+				funcs->linearise(line + n*comp, src, row_len, job->forward_gamma);
+			for(j=0; j<n; j++){
+				for(c=0; c<comp; c++){
+					line[j*comp+c] = line[n*comp+c];
+					line[(n+width+j)*comp+c] = line[(n+width-1)*comp+c];
+				}
+			}
+			funcs->convolve_row(scratch->ring_buffer + (next_row % s) * row_len, line, row_len, comp, kernel, s);
+			next_row++;
+		}
+
+		// Rows above and below the image repeat the border rows
+		for(i=0; i<s; i++)
+			rows[i] = scratch->ring_buffer + (CLAMP(y+i-n, 0, height-1) % s) * row_len;
+
+		dst = packed ? out : job->dst + job->dst_stride * y;
+		if (job->temporal){
+			float *history = job->temporal + (gsize)y*row_len;
+			smoothing_temporal_column(history, rows, row_len, kernel, s, job->alpha, job->temporal_init);
+			smoothing_delinearise(dst, history, row_len, job->depth, job->inverse_gamma, job->out_limit);
+		}
+		else if (job->depth == 2)
+			funcs->convolve_column_u16((guint16 *)dst, rows, row_len, kernel, s, job->inverse_gamma, job->out_limit);
+		else
+			funcs->convolve_column(dst, rows, row_len, kernel, s, job->inverse_gamma, job->out_limit);
+		if (packed)
+			smoothing_unpack_row(job->dst + job->dst_stride * y, out, width, smoothing_pixel_bytes(job), job->pstride);
+	}
+}
+
+/* Fixed point version of smoothing_separable(), the ring holds 14 bit linear intensities */
+void
+smoothing_separable_fixed (const SmoothingJob *job, SmoothingStripe *stripe)
+{
+	SmoothingScratch *scratch = &stripe->scratch;
+	const SmoothingFuncs *funcs = job->funcs;
+	const gint16 *kernel = job->kernel1d_q;
+	guint16 *line = (guint16 *)scratch->line_buffer;
+	guint16 *ring = (guint16 *)scratch->ring_buffer;
+	const guint16 *rows[2*MAX_KERNELSIZE+1];
+	gint n = job->kernelsize;
+	gint s = 2*n+1;
+	gint width = job->width;
+	gint height = job->height;
+	gint comp = job->comp;
+	gint row_len = width*comp;
+	gint next_row = MAX(0, stripe->y0-n);
+	gboolean packed = smoothing_job_is_packed(job);
+	guint8 *out = scratch->pack_buffer + (gsize)s*row_len;
+	gint y, i, j, c;
+
+	g_return_if_fail(job->depth == 1);
+
+	for(y=stripe->y0; y<stripe->y1; y++){
+
+		while(next_row <= MIN(y+n, height-1)){
+			funcs->linearise16(line + n*comp, smoothing_src_row_packed(job, stripe, next_row, 0), row_len, job->forward_gamma16);
+			for(j=0; j<n; j++){
+				for(c=0; c<comp; c++){
+					line[j*comp+c] = line[n*comp+c];
+					line[(n+width+j)*comp+c] = line[(n+width-1)*comp+c];
+				}
+			}
+			funcs->convolve_row16(ring + (next_row % s) * row_len, line, row_len, comp, kernel, s);
+			next_row++;
+		}
+
+		for(i=0; i<s; i++)
+			rows[i] = ring + (CLAMP(y+i-n, 0, height-1) % s) * row_len;
+
+		funcs->convolve_column16(packed ? out : job->dst + job->dst_stride * y, rows, row_len, kernel, s,
+				job->inverse_gamma, job->fixed_shift, job->out_limit);
+		if (packed)
+			smoothing_unpack_row(job->dst + job->dst_stride * y, out, width, smoothing_pixel_bytes(job), job->pstride);
+	}
+}
+
+/* Coefficients of the Young - van Vliet recursive Gaussian, with the Triggs - Sdika matrix for the right hand boundary.
+ * sigma is the element's sigma, the kernel is e^(-r^2/sigma^2) so its standard deviation is sigma/sqrt(2).
+ * The approximation is only good for standard deviations of 0.5 and above, smaller ones are clamped.
+ */
+void
+smoothing_iir_coefficients (SmoothingIir *iir, double sigma)
+{
+	double sd = MAX(sigma / G_SQRT2, 0.5);
+	double q, q2, q3, b0, a1, a2, a3, scale;
+
+	if (sd >= 2.5)
+		q = 0.98711*sd - 0.96330;
+	else
+		q = 3.97156 - 4.14554*sqrt(1.0 - 0.26891*sd);
+	q2 = q*q;
+	q3 = q2*q;
+
+	b0 = 1.57825 + 2.44413*q + 1.4281*q2 + 0.422205*q3;
+	a1 = (2.44413*q + 2.85619*q2 + 1.26661*q3) / b0;
+	a2 = -(1.4281*q2 + 1.26661*q3) / b0;
+	a3 = 0.422205*q3 / b0;
+
+	iir->a1 = a1;
+	iir->a2 = a2;
+	iir->a3 = a3;
+	iir->b = 1.0 - (a1+a2+a3);   // so a flat area is unchanged
+
+	scale = 1.0 / ((1.0+a1-a2+a3) * (1.0-a1-a2-a3) * (1.0+a2+(a1-a3)*a3));
+	iir->m[0][0] = scale * (-a3*a1 + 1.0 - a3*a3 - a2);
+	iir->m[0][1] = scale * (a3+a1) * (a2+a3*a1);
+	iir->m[0][2] = scale * a3 * (a1+a3*a2);
+	iir->m[1][0] = scale * (a1+a3*a2);
+	iir->m[1][1] = -scale * (a2-1.0) * (a2+a3*a1);
+	iir->m[1][2] = -scale * a3 * (a3*a1 + a3*a3 + a2 - 1.0);
+	iir->m[2][0] = scale * (a3*a1 + a2 + a1*a1 - a2*a2);
+	iir->m[2][1] = scale * (a1*a2 + a3*a2*a2 - a1*a3*a3 - a3*a3*a3 - a3*a2 + a3);
+	iir->m[2][2] = scale * a3 * (a1+a3*a2);
+}
+
+// The backward pass outputs at positions len-1, len and len+1 (v[0..2]) from the last three forward pass
+// outputs w[0..2] (last first) and the last input value, as if the line carried on at that value for ever
+static inline void
+smoothing_iir_right_state (float *v, const float *w, float last, const SmoothingIir *iir)
+{
+	gint i;
+
+	for(i=0; i<3; i++)
+		v[i] = iir->b * (iir->m[i][0]*(w[0]-last) + iir->m[i][1]*(w[1]-last) + iir->m[i][2]*(w[2]-last)) + last;
+}
+
+/* Forward then backward recursive filter along one line of len values, in place, step values apart.
+ * Beyond the ends the line is taken to carry on at its end values. On the left the steady state output
+ * for a constant input is that input, so the first output equals the first input.
+ */
+static void
+smoothing_iir_line (float *line, gint len, gint step, const SmoothingIir *iir)
+{
+	float b = iir->b, a1 = iir->a1, a2 = iir->a2, a3 = iir->a3;
+	float last = line[(len-1)*step];
+	float w[3], v[3];
+	float p1, p2, p3;
+	gint x;
+
+	// Keep the three previous outputs in registers, they start at the steady state
+	p1 = p2 = p3 = line[0];
+	for(x=0; x<len; x++){
+		float out = b*line[x*step] + a1*p1 + a2*p2 + a3*p3;
+		line[x*step] = out;
+		p3 = p2; p2 = p1; p1 = out;
+	}
+
+	w[0] = p1; w[1] = p2; w[2] = p3;   // on short lines these include the steady state before the start
+	smoothing_iir_right_state(v, w, last, iir);
+
+	line[(len-1)*step] = v[0];
+	p1 = v[0]; p2 = v[1]; p3 = v[2];
+	for(x=len-2; x>=0; x--){
+		float out = b*line[x*step] + a1*p1 + a2*p2 + a3*p3;
+		line[x*step] = out;
+		p3 = p2; p2 = p1; p1 = out;
+	}
+}
+
+// The horizontal pass of smoothing_downscale(), dst[x] = sum over j of kernel[j]*src[x*factor+j] for each channel
+static void
+smoothing_downscale_row (float *dst, const float *src, gint count, gint comp, gint factor, const float *kernel, gint taps)
+{
+	gint x, c, j;
+
+	for(x=0; x<count; x++){
+		const float *in = src + x*factor*comp;
+		for(c=0; c<comp; c++){
+			float acc = 0.0f;
+			for(j=0; j<taps; j++)
+				acc += kernel[j] * in[j*comp+c];
+			dst[x*comp+c] = acc;
+		}
+	}
+}
+
+/* Downscaling implementation
+ * Smoothes and decimates by factor in one pass, only calculating the output pixels. As in smoothing_separable()
+ * each input row is linearised and filtered horizontally into a ring, but only at the output pixels, and the
+ * ring is only combined vertically for output rows. The kernel is centred on the middle of the factor*factor
+ * input pixels under each output pixel, so even factors have an even number of taps. Input rows between the
+ * reach of two output rows are never read. The edges are extended by repeating the border pixels.
+ * src and dst are always different buffers, stripes are bands of output rows.
+ */
+void
+smoothing_downscale (const SmoothingJob *job, SmoothingStripe *stripe)
+{
+	SmoothingScratch *scratch = &stripe->scratch;
+	const SmoothingFuncs *funcs = job->funcs;
+	const float *kernel = job->kernel_down;
+	float *line = scratch->line_buffer;
+	const float *rows[SMOOTHING_MAX_TAPS];
+	gint taps = job->down_taps;
+	gint factor = job->factor;
+	gint pad = job->kernelsize + factor;   // pixels either side of the row, more than any tap reaches
+	gint offset = (factor - taps)/2;       // from the first input pixel under an output pixel to its first tap
+	gint width = job->width;
+	gint height = job->height;
+	gint comp = job->comp;
+	gint row_len = width*comp;
+	gint out_len = job->out_width*comp;
+	gint next_row = 0;
+	gboolean packed = smoothing_job_is_packed(job);
+	guint8 *out = scratch->pack_buffer + (gsize)row_len*job->depth;
+	guint8 *dst;
+	gint y, i, j, c;
+
+	g_return_if_fail(job->src != job->dst);
+
+	for(y=stripe->y0; y<stripe->y1; y++){
+		gint top = y*factor + offset;
+
+		// Filter the input rows this output row reaches horizontally into the ring
+		next_row = MAX(next_row, CLAMP(top, 0, height-1));
+		while(next_row <= MIN(top+taps-1, height-1)){
+			const guint8 *src = smoothing_src_row_packed(job, stripe, next_row, 0);
+			if (job->depth == 2)
+				funcs->linearise_u16(line + pad*comp, (const guint16 *)src, row_len, job->forward_gamma);
+			else
+				funcs->linearise(line + pad*comp, src, row_len, job->forward_gamma);
+			for(j=0; j<pad; j++){
+				for(c=0; c<comp; c++){
+					line[j*comp+c] = line[pad*comp+c];
+					line[(pad+width+j)*comp+c] = line[(pad+width-1)*comp+c];
+				}
+			}
+			smoothing_downscale_row(scratch->ring_buffer + (next_row % taps) * out_len, line + (pad+offset)*comp,
+					job->out_width, comp, factor, kernel, taps);
+			next_row++;
+		}
+
+		for(i=0; i<taps; i++)
+			rows[i] = scratch->ring_buffer + (CLAMP(top+i, 0, height-1) % taps) * out_len;
+
+		dst = packed ? out : job->dst + job->dst_stride * y;
+		if (job->temporal){
+			float *history = job->temporal + (gsize)y*out_len;
+			smoothing_temporal_column(history, rows, out_len, kernel, taps, job->alpha, job->temporal_init);
+			smoothing_delinearise(dst, history, out_len, job->depth, job->inverse_gamma, job->out_limit);
+		}
+		else if (job->depth == 2)
+			funcs->convolve_column_u16((guint16 *)dst, rows, out_len, kernel, taps, job->inverse_gamma, job->out_limit);
+		else
+			funcs->convolve_column(dst, rows, out_len, kernel, taps, job->inverse_gamma, job->out_limit);
+		if (packed)
+			smoothing_unpack_row(job->dst + job->dst_stride * y, out, job->out_width, smoothing_pixel_bytes(job), job->pstride);
+	}
+}
+
+/* Recursive (IIR) implementation, first pass
+ * Linearises the stripe's rows into the shared iir_buffer and filters each one horizontally.
+ * Every input row is read here before smoothing_iir_columns() writes any output, so this is safe in-place.
+ */
+void
+smoothing_iir_rows (const SmoothingJob *job, SmoothingStripe *stripe)
+{
+	gint comp = job->comp;
+	gint row_len = job->width*comp;
+	gint y, c;
+
+	for(y=stripe->y0; y<stripe->y1; y++){
+		float *line = job->iir_buffer + (gsize)y*row_len;
+		const guint8 *src = smoothing_src_row_packed(job, stripe, y, 0);
+		if (job->depth == 2)
+			smoothing_linearise_u16_c(line, (const guint16 *)src, row_len, job->forward_gamma);
+		else
+			smoothing_linearise_c(line, src, row_len, job->forward_gamma);
+		for(c=0; c<comp; c++)
+			smoothing_iir_line(line + c, job->width, comp, job->iir);
+	}
+}
+
+#define SMOOTHING_IIR_CHUNK 64   // values of a row filtered down the columns together
+
+/* Recursive (IIR) implementation, second pass
+ * Filters the stripe's columns x0 to x1-1 of iir_buffer vertically and writes them out.
+ * The recursion runs down a chunk of each row at a time so the inner loops are over contiguous memory.
+ * The cost per pixel does not depend on sigma or kernelsize.
+ */
+void
+smoothing_iir_columns (const SmoothingJob *job, SmoothingStripe *stripe)
+{
+	const SmoothingIir *iir = job->iir;
+	float b = iir->b, a1 = iir->a1, a2 = iir->a2, a3 = iir->a3;
+	float last[SMOOTHING_IIR_CHUNK];
+	float after[2][SMOOTHING_IIR_CHUNK];   // backward pass outputs for the two rows below the image
+	float limit = job->out_limit;
+	gint comp = job->comp;
+	gint pstride = job->pstride;
+	gint row_len = job->width*comp;
+	gint height = job->height;
+	gboolean packed = smoothing_job_is_packed(job);
+	gint start, count, y, x, i;
+
+	for(start=stripe->x0; start<stripe->x1; start+=SMOOTHING_IIR_CHUNK){
+		float *col = job->iir_buffer + start;
+		float *bottom = col + (gsize)(height-1)*row_len;
+		count = MIN(SMOOTHING_IIR_CHUNK, stripe->x1-start);
+
+		memcpy(last, bottom, count*sizeof(float));
+
+		// Forward pass down the image, rows above the top repeat row 0 so row 0 is its own steady state
+		for(y=1; y<height; y++){
+			float *cur = col + (gsize)y*row_len;
+			const float *p1 = cur - row_len;
+			const float *p2 = col + (gsize)MAX(y-2, 0)*row_len;
+			const float *p3 = col + (gsize)MAX(y-3, 0)*row_len;
+			for(x=0; x<count; x++)
+				cur[x] = b*cur[x] + a1*p1[x] + a2*p2[x] + a3*p3[x];
+		}
+
+		for(x=0; x<count; x++){
+			float w[3], v[3];
+			for(i=0; i<3; i++)
+				w[i] = col[(gsize)MAX(height-1-i, 0)*row_len + x];
+			smoothing_iir_right_state(v, w, last[x], iir);
+			bottom[x] = v[0];
+			after[0][x] = v[1];
+			after[1][x] = v[2];
+		}
+
+		// Backward pass up the image, writing each row out as it is finished
+		for(y=height-1; y>=0; y--){
+			float *cur = col + (gsize)y*row_len;
+			const float *out = cur;
+			guint8 *dst = job->dst + job->dst_stride * y;
+			if (y < height-1){
+				const float *n1 = cur + row_len;
+				const float *n2 = y+2 < height ? cur + 2*row_len : after[y+2-height];
+				const float *n3 = y+3 < height ? cur + 3*row_len : after[y+3-height];
+				for(x=0; x<count; x++)
+					cur[x] = b*cur[x] + a1*n1[x] + a2*n2[x] + a3*n3[x];
+			}
+			// cur is still needed by the rows above, so the average goes to the history
+			if (job->temporal){
+				float *history = job->temporal + (gsize)y*row_len + start;
+				smoothing_temporal_blend(history, cur, count, job->alpha, job->temporal_init);
+				out = history;
+			}
+			if (job->depth == 2){
+				for(x=start; x<start+count; x++)
+					*(guint16 *)(dst + (x/comp)*pstride + (x%comp)*2) =
+							job->inverse_gamma[(unsigned int)CLAMP(out[x-start]+0.5f, 0.0f, limit)];
+			}
+			else if (packed){
+				for(x=start; x<start+count; x++)
+					dst[(x/comp)*pstride + x%comp] = job->inverse_gamma[(unsigned int)CLAMP(out[x-start]+0.5f, 0.0f, limit)];
+			}
+			else {
+				for(x=0; x<count; x++)
+					dst[start+x] = job->inverse_gamma[(unsigned int)CLAMP(out[x]+0.5f, 0.0f, limit)];
+			}
+		}
+	}
+}
+
+/* Range weights for the bilateral engines, e^(-d^2/sigma_range^2) for a summed difference d of 8 bit values,
+ * the same form as the spatial kernel
+ */
+void
+smoothing_range_weights (float *range_weight, double sigma_range)
+{
+	gint d;
+
+	for(d=0; d<SMOOTHING_RANGE_LUT_SIZE; d++)
+		range_weight[d] = exp(-(double)(d*d)/(sigma_range*sigma_range));
+}
+
+// Linearise input row y into a ring slot of the bilateral engines and reduce it to 8 bit levels for the range weights,
+// both padded by n pixels either side that repeat the border pixels
+static void
+smoothing_bilateral_input (const SmoothingJob *job, SmoothingStripe *stripe, gint y, float *line, guint8 *level)
+{
+	const SmoothingFuncs *funcs = job->funcs;
+	const guint8 *src = smoothing_src_row_packed(job, stripe, y, 0);
+	gint n = job->kernelsize;
+	gint comp = job->comp;
+	gint width = job->width;
+	gint row_len = width*comp;
+	gint x, j, c;
+
+	if (job->depth == 2){
+		const guint16 *src16 = (const guint16 *)src;
+		funcs->linearise_u16(line + n*comp, src16, row_len, job->forward_gamma);
+		for(x=0; x<row_len; x++)
+			level[n*comp+x] = (job->swapped ? GUINT16_SWAP_LE_BE(src16[x]) : src16[x]) >> 8;
+	}
+	else {
+		funcs->linearise(line + n*comp, src, row_len, job->forward_gamma);
+		memcpy(level + n*comp, src, row_len);
+	}
+	for(j=0; j<n; j++){
+		for(c=0; c<comp; c++){
+			line[j*comp+c] = line[n*comp+c];
+			line[(n+width+j)*comp+c] = line[(n+width-1)*comp+c];
+			level[j*comp+c] = level[n*comp+c];
+			level[(n+width+j)*comp+c] = level[(n+width-1)*comp+c];
+		}
+	}
+}
+
+/* width output pixels of bilateral smoothing over a rows*cols block of taps, into value in linear intensity.
+ * lines[i] and levels[i] are where tap (i,0) of the first output pixel is, tap (i,j) of pixel x is (x+j)*comp
+ * values on, and centre is the first output pixel's own levels.
+ * A block of pixels at a time, tap by tap, so the sums of neighbouring pixels do not wait for each other.
+ */
+#ifdef __GNUC__
+#define SMOOTHING_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define SMOOTHING_ALWAYS_INLINE inline
+#endif
+
+static SMOOTHING_ALWAYS_INLINE void
+smoothing_bilateral_block (float *value, const float **lines, const guint8 **levels, const guint8 *centre,
+		gint width, gint comp, gint rows, gint cols, const float *kernel, const float *range)
+{
+	float acc[256*SMOOTHING_BILATERAL_MAX_COMP];
+	float norm[256];   // at least the centre weight
+	gint start, x, i, j, c;
+
+	for(start=0; start<width; start+=256){
+		gint count = MIN(256, width-start);
+		const guint8 *mid = centre + start*comp;
+
+		for(x=0; x<count; x++){
+			norm[x] = 0.0f;
+			for(c=0; c<comp; c++)
+				acc[x*comp+c] = 0.0f;
+		}
+		for(i=0; i<rows; i++){
+			for(j=0; j<cols; j++){
+				const float *line = lines[i] + (start+j)*comp;
+				const guint8 *level = levels[i] + (start+j)*comp;
+				float k = kernel[i*cols+j];
+				for(x=0; x<count; x++){
+					gint d = 0;
+					float w;
+					for(c=0; c<comp; c++)
+						d += ABS(level[x*comp+c] - mid[x*comp+c]);
+					w = k * range[d];
+					norm[x] += w;
+					for(c=0; c<comp; c++)
+						acc[x*comp+c] += w * line[x*comp+c];
+				}
+			}
+		}
+		for(x=0; x<count; x++){
+			for(c=0; c<comp; c++)
+				value[(start+x)*comp+c] = acc[x*comp+c] / norm[x];
+		}
+	}
+}
+
+// smoothing_bilateral_block() with comp a constant, so the loops over the values of a pixel disappear
+static void
+smoothing_bilateral_rows (float *value, const float **lines, const guint8 **levels, const guint8 *centre,
+		gint width, gint comp, gint rows, gint cols, const float *kernel, const float *range)
+{
+	if (comp == 1)
+		smoothing_bilateral_block(value, lines, levels, centre, width, 1, rows, cols, kernel, range);
+	else if (comp == 2)
+		smoothing_bilateral_block(value, lines, levels, centre, width, 2, rows, cols, kernel, range);
+	else
+		smoothing_bilateral_block(value, lines, levels, centre, width, 3, rows, cols, kernel, range);
+}
+
+// Write output row y from its linear intensities, through the temporal average if there is one
+static void
+smoothing_bilateral_output (const SmoothingJob *job, SmoothingStripe *stripe, gint y, const float *value)
+{
+	gint s = 2*job->kernelsize+1;
+	gint row_len = job->width*job->comp;
+	gboolean packed = smoothing_job_is_packed(job);
+	guint8 *out = stripe->scratch.pack_buffer + (gsize)s*row_len*job->depth;
+	guint8 *dst = packed ? out : job->dst + job->dst_stride * y;
+
+	if (job->temporal){
+		float *history = job->temporal + (gsize)y*row_len;
+		smoothing_temporal_blend(history, value, row_len, job->alpha, job->temporal_init);
+		value = history;
+	}
+	smoothing_delinearise(dst, value, row_len, job->depth, job->inverse_gamma, job->out_limit);
+	if (packed)
+		smoothing_unpack_row(job->dst + job->dst_stride * y, out, job->width, smoothing_pixel_bytes(job), job->pstride);
+}
+
+/* Bilateral implementation
+ * Edge preserving smoothing: each tap's kernel weight is multiplied by a range weight for how different the
+ * neighbour's values are from the output pixel's, job->range_weight[sum over the pixel's values of the difference],
+ * and the weights are normalised for each output pixel. The differences are between input values as they are
+ * encoded, reduced to 8 bits, so an edge counts the same in the shadows as in the highlights, while the average
+ * itself is taken in linear intensity like the other engines. All the values of a pixel share its weights,
+ * so colour edges are kept whole. The image edges are extended by repeating the border pixels.
+ * s*s taps per pixel, rings of s linearised and s 8 bit input rows as for smoothing_direct(), safe in-place.
+ */
+void
+smoothing_bilateral (const SmoothingJob *job, SmoothingStripe *stripe)
+{
+	SmoothingScratch *scratch = &stripe->scratch;
+	const float *lines[2*MAX_KERNELSIZE+1];
+	const guint8 *levels[2*MAX_KERNELSIZE+1];
+	gint n = job->kernelsize;
+	gint s = 2*n+1;
+	gint width = job->width;
+	gint height = job->height;
+	gint comp = job->comp;
+	gint padded_len = (width+2*n)*comp;
+	float *value = scratch->line_buffer + padded_len;
+	gint next_row = MAX(0, stripe->y0-n);
+	gint y, i;
+
+	g_return_if_fail(comp <= SMOOTHING_BILATERAL_MAX_COMP);
+
+	for(y=stripe->y0; y<stripe->y1; y++){
+		for(; next_row<=MIN(y+n, height-1); next_row++){
+			gsize slot = (gsize)(next_row % s) * padded_len;
+			smoothing_bilateral_input(job, stripe, next_row, scratch->ring_buffer + slot, scratch->level_buffer + slot);
+		}
+
+		// Rows above and below the image repeat the border rows
+		for(i=0; i<s; i++){
+			gsize slot = (gsize)(CLAMP(y+i-n, 0, height-1) % s) * padded_len;
+			lines[i] = scratch->ring_buffer + slot;
+			levels[i] = scratch->level_buffer + slot;
+		}
+
+		smoothing_bilateral_rows(value, lines, levels, levels[n] + n*comp, width, comp, s, s,
+				job->kernel2d, job->range_weight);
+		smoothing_bilateral_output(job, stripe, y, value);
+	}
+}
+
+/* Separable approximation of smoothing_bilateral(), 2s taps per pixel rather than s*s.
+ * Each input row is smoothed horizontally into a ring as in smoothing_separable(), with range weights, and the
+ * rows of the ring are then combined vertically with range weights from the input levels of the same pixels,
+ * so the vertical pass keeps the edges of the input rather than of the horizontally smoothed rows.
+ * The result is not exactly the 2D bilateral filter, diagonal edges are kept a little less well.
+ */
+void
+smoothing_bilateral_separable (const SmoothingJob *job, SmoothingStripe *stripe)
+{
+	SmoothingScratch *scratch = &stripe->scratch;
+	const float *lines[2*MAX_KERNELSIZE+1];
+	const guint8 *levels[2*MAX_KERNELSIZE+1];
+	gint n = job->kernelsize;
+	gint s = 2*n+1;
+	gint width = job->width;
+	gint height = job->height;
+	gint comp = job->comp;
+	gint row_len = width*comp;
+	gint padded_len = (width+2*n)*comp;
+	float *line = scratch->line_buffer;
+	float *value = scratch->line_buffer + padded_len;
+	gint next_row = MAX(0, stripe->y0-n);
+	gint y, i;
+
+	g_return_if_fail(comp <= SMOOTHING_BILATERAL_MAX_COMP);
+
+	for(y=stripe->y0; y<stripe->y1; y++){
+		for(; next_row<=MIN(y+n, height-1); next_row++){
+			guint8 *level = scratch->level_buffer + (gsize)(next_row % s) * padded_len;
+			const guint8 *centre = level + n*comp;
+			const float *line_tap = line;
+			const guint8 *level_tap = level;
+
+			smoothing_bilateral_input(job, stripe, next_row, line, level);
+			smoothing_bilateral_rows(scratch->ring_buffer + (gsize)(next_row % s) * row_len, &line_tap, &level_tap, centre,
+					width, comp, 1, s, job->kernel1d, job->range_weight);
+		}
+
+		for(i=0; i<s; i++){
+			gint row = CLAMP(y+i-n, 0, height-1) % s;
+			lines[i] = scratch->ring_buffer + (gsize)row * row_len;
+			levels[i] = scratch->level_buffer + (gsize)row * padded_len + n*comp;
+		}
+
+		smoothing_bilateral_rows(value, lines, levels, levels[n], width, comp, s, 1,
+				job->kernel1d, job->range_weight);
+		smoothing_bilateral_output(job, stripe, y, value);
+	}
+}
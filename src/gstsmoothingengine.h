@@ -0,0 +1,259 @@
+/*
+ * Smoothing Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_SMOOTHINGENGINE_H__
+#define __GST_SMOOTHINGENGINE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define MAX_KERNELSIZE 16  // largest size index (n) accepted, the separable method keeps this cheap
+#define SMOOTHING_MAX_TAPS (2*MAX_KERNELSIZE+2)   // the longest 1D kernel, smoothing_downscale() with an even factor
+
+// The fixed point engines scale linear intensity and kernel weights to 14 bits, so a product fits in 28 bits
+// and a whole kernel (weights summing to SMOOTHING_FIXED_ONE) accumulates safely in an int32
+#define SMOOTHING_FIXED_BITS 14
+#define SMOOTHING_FIXED_ONE (1<<SMOOTHING_FIXED_BITS)
+
+// Up to this size index the direct engine can use luts of forward_gamma pre-multiplied by each distinct kernel weight,
+// a 5x5 Gaussian only has 6 distinct weights so these stay small
+#define SMOOTHING_WEIGHTED_MAX_KERNELSIZE 2
+#define SMOOTHING_WEIGHTED_LUT_SIZE 256   // one entry per 8 bit input value
+
+// The bilateral engines weight each neighbour by the summed difference of a pixel's values, reduced to 8 bits
+#define SMOOTHING_BILATERAL_MAX_COMP 3
+#define SMOOTHING_RANGE_LUT_SIZE (255*SMOOTHING_BILATERAL_MAX_COMP+1)
+
+// Kernel sizes (n) and steps with row functions generated for them in gstsmoothingengine-unrolled.c
+#define SMOOTHING_UNROLLED_MAX_KERNELSIZE 3
+#define SMOOTHING_UNROLLED_MAX_STEP 3
+
+// Row primitives the engines are built from. There is a plain C version of each,
+// smoothing_engine_init() picks SIMD versions at plugin load if the CPU has them.
+// Channels are never deinterleaved, every channel uses the same weights so a tap is just an offset of step values.
+typedef struct {
+	const gchar *name;
+
+	// dst[x] = forward_gamma[src[x]]
+	void (*linearise) (float *dst, const guint8 *src, gint len, const float *forward_gamma);
+
+	// dst[x] = sum over j of kernel[j]*src[x+j*step], the horizontal pass of the separable engine
+	void (*convolve_row) (float *dst, const float *src, gint len, gint step, const float *kernel, gint taps);
+
+	// dst[x] = inverse_gamma[sum over i of kernel[i]*rows[i][x]], the vertical pass of the separable engine
+	void (*convolve_column) (guint8 *dst, const float **rows, gint len, const float *kernel, gint taps,
+			const unsigned int *inverse_gamma, gint out_limit);
+
+	// One output row of the direct engine, rows[i] points at the first linear intensity under row i of the s*s kernel
+	// dst[x] = inverse_gamma[sum over i, j of kernel[i*s+j]*rows[i][x+j*step]]
+	void (*direct_row) (guint8 *dst, const float **rows, gint len, gint step, const float *kernel, gint s,
+			const unsigned int *inverse_gamma, gint out_limit);
+
+	// Fixed point versions of the above, with 14 bit linear intensity, Q14 weights and int32 accumulators.
+	// shift takes a 14 bit linear intensity down to an index into inverse_gamma.
+	void (*linearise16) (guint16 *dst, const guint8 *src, gint len, const guint16 *forward_gamma16);
+	void (*convolve_row16) (guint16 *dst, const guint16 *src, gint len, gint step, const gint16 *kernel, gint taps);
+	void (*convolve_column16) (guint8 *dst, const guint16 **rows, gint len, const gint16 *kernel, gint taps,
+			const unsigned int *inverse_gamma, gint shift, gint out_limit);
+	void (*direct_row16) (guint8 *dst, const guint16 **rows, gint len, gint step, const gint16 *kernel, gint s,
+			const unsigned int *inverse_gamma, gint shift, gint out_limit);
+
+	// Versions of linearise, convolve_column and direct_row for 16 bit values, byte order is taken care of by the luts
+	void (*linearise_u16) (float *dst, const guint16 *src, gint len, const float *forward_gamma);
+	void (*convolve_column_u16) (guint16 *dst, const float **rows, gint len, const float *kernel, gint taps,
+			const unsigned int *inverse_gamma, gint out_limit);
+	void (*direct_row_u16) (guint16 *dst, const float **rows, gint len, gint step, const float *kernel, gint s,
+			const unsigned int *inverse_gamma, gint out_limit);
+} SmoothingFuncs;
+
+// One output row of smoothing_direct_weighted(), luts[k] is the weighted forward gamma lut for tap k of the s*s kernel
+typedef void (*SmoothingWeightedRowFunc) (guint8 *dst, const guint8 **rows, gint len, gint step, const float **luts, gint s,
+		const unsigned int *inverse_gamma, gint out_limit);
+
+// A recursive Gaussian, out[x] = b*in[x] + a1*out[x-1] + a2*out[x-2] + a3*out[x-3] run forwards then backwards.
+// m gives the backward pass the state it would have had if the line carried on at its last input value.
+typedef struct {
+	float b, a1, a2, a3;
+	float m[3][3];
+} SmoothingIir;
+
+typedef struct _SmoothingJob SmoothingJob;
+typedef struct _SmoothingStripe SmoothingStripe;
+
+typedef void (*SmoothingEngineFunc) (const SmoothingJob *job, SmoothingStripe *stripe);
+
+// Everything an engine needs to smooth one plane of a frame, src and dst may point at the same memory for in-place.
+// A plane is comp interleaved values per pixel (3 for RGB, 1 for Y, 2 for the UV of NV12), each smoothed on its own.
+struct _SmoothingJob {
+	const guint8 *src;            // first value of the plane's first pixel
+	guint8 *dst;
+	gint src_stride, dst_stride;  // bytes to next line
+	gint width, height;           // plane size in pixels
+	gint comp;                    // values per pixel
+	gint depth;                   // bytes per value, 1 or 2, the fixed point and weighted engines only handle 1
+	gint pstride;                 // bytes to next pixel, more than comp if other components are interleaved (YUY2)
+
+	gint kernelsize;              // the size index (n), kernel is 2n+1
+	const float *kernel2d;        // (2n+1)*(2n+1) weights, sum to 1
+	const float *kernel1d;        // 2n+1 weights, sum to 1
+	const gint16 *kernel2d_q;     // the same kernels quantised for the fixed point engines, sum to SMOOTHING_FIXED_ONE
+	const gint16 *kernel1d_q;
+
+	const float *forward_gamma;         // input value -> linear intensity, one entry for every possible value
+	const unsigned int *inverse_gamma;  // linear intensity -> output value
+	gint out_limit;                     // largest valid index into inverse_gamma
+	const guint16 *forward_gamma16;     // 8 bit input value -> 14 bit linear intensity, for the fixed point engines
+	gint fixed_shift;                   // 14 bit linear intensity >> fixed_shift indexes inverse_gamma
+	const float *weighted_gamma;        // forward_gamma multiplied by each distinct kernel2d weight, SMOOTHING_WEIGHTED_LUT_SIZE entries each
+	const guint8 *weight_index;         // which weighted_gamma lut each of the s*s taps uses
+	float *iir_buffer;                  // width*comp*height linear intensities shared by all stripes, for the iir engine
+	const SmoothingIir *iir;            // the recursive Gaussian for the iir engine
+	const float *range_weight;          // weight by summed difference, SMOOTHING_RANGE_LUT_SIZE entries, for the bilateral engines
+	gboolean swapped;                   // 16 bit values are in the opposite byte order to the host
+	float *temporal;                    // NULL, or width*comp*height linear intensities averaged over earlier frames
+	float alpha;                        // weight of this frame in temporal, temporal[x] += alpha*(smoothed[x]-temporal[x])
+	gboolean temporal_init;             // temporal does not hold an earlier frame yet, start it from this one
+
+	gint factor;                  // 1, or the output plane is this many times smaller each way, for smoothing_downscale()
+	gint out_width, out_height;   // the output plane size in pixels, dst_stride is the output's
+	const float *kernel_down;     // down_taps weights centred on the middle of the factor*factor input pixels of an output pixel
+	gint down_taps;
+
+	const SmoothingFuncs *funcs;
+	SmoothingEngineFunc engine;   // one of the smoothing_direct*, smoothing_separable* or smoothing_iir_* engines
+	SmoothingEngineFunc engine2;  // NULL, or a second pass run on every stripe once engine has finished them all
+};
+
+// Row buffers used by the engines, they only ever grow so one set serves every plane of a frame.
+// The fixed point engine uses them as guint16.
+typedef struct {
+	float *line_buffer;   // One linearised input row, padded by n pixels either side
+	float *ring_buffer;   // The last 2n+1 input rows in linear intensity, horizontally filtered for the separable engines
+	guint8 *pack_buffer;  // Rows of a plane whose values are not contiguous, packed to comp values per pixel
+	guint8 *level_buffer; // The last 2n+1 input rows reduced to 8 bits, padded like line_buffer, for the bilateral engines
+	gsize line_size, ring_size, pack_size, level_size;
+} SmoothingScratch;
+
+// A band of output rows that can be smoothed independently of the rest of the frame.
+// In-place, the neighbouring bands overwrite the n input rows either side of this one,
+// so those are saved to the halo before any band starts.
+struct _SmoothingStripe {
+	gint y0, y1;         // output rows y0 to y1-1, of the output plane for smoothing_downscale()
+	gint x0, x1;         // values (not pixels) x0 to x1-1 of every row, for engines that work down columns
+	guint8 *halo;        // NULL, or input rows y0-n..y0-1 followed by y1..y1+n-1, laid out as in the plane
+	gint halo_stride;
+	gsize halo_size;
+	SmoothingScratch scratch;
+};
+
+void smoothing_engine_init (void);
+const SmoothingFuncs *smoothing_get_funcs (gboolean simd);
+const SmoothingFuncs *smoothing_get_funcs_unrolled (const SmoothingFuncs *funcs, gint kernelsize, gint step);
+
+gboolean smoothing_scratch_ensure (SmoothingScratch *scratch, const SmoothingJob *job);
+void smoothing_scratch_free (SmoothingScratch *scratch);
+
+gboolean smoothing_stripe_save_halo (const SmoothingJob *job, SmoothingStripe *stripe);
+void smoothing_stripe_free (SmoothingStripe *stripe);
+
+void smoothing_copy_pixels (guint8 *dst, const guint8 *src, gint count, gint bytes, gint pstride);
+
+void smoothing_direct (const SmoothingJob *job, SmoothingStripe *stripe);
+void smoothing_separable (const SmoothingJob *job, SmoothingStripe *stripe);
+void smoothing_direct_fixed (const SmoothingJob *job, SmoothingStripe *stripe);
+void smoothing_separable_fixed (const SmoothingJob *job, SmoothingStripe *stripe);
+void smoothing_direct_weighted (const SmoothingJob *job, SmoothingStripe *stripe);
+void smoothing_iir_rows (const SmoothingJob *job, SmoothingStripe *stripe);
+void smoothing_iir_columns (const SmoothingJob *job, SmoothingStripe *stripe);
+void smoothing_downscale (const SmoothingJob *job, SmoothingStripe *stripe);
+void smoothing_bilateral (const SmoothingJob *job, SmoothingStripe *stripe);
+void smoothing_bilateral_separable (const SmoothingJob *job, SmoothingStripe *stripe);
+
+void smoothing_temporal_column (float *history, const float **rows, gint len, const float *kernel, gint taps,
+		float alpha, gboolean init);
+void smoothing_temporal_direct_row (float *history, const float **rows, gint len, gint step, const float *kernel, gint s,
+		float alpha, gboolean init);
+void smoothing_temporal_blend (float *history, const float *value, gint len, float alpha, gboolean init);
+void smoothing_delinearise (guint8 *dst, const float *src, gint len, gint depth, const unsigned int *inverse_gamma,
+		gint out_limit);
+
+void smoothing_quantise_kernel (gint16 *dst, const float *kernel, gint len);
+void smoothing_iir_coefficients (SmoothingIir *iir, double sigma);
+void smoothing_range_weights (float *range_weight, double sigma_range);
+gint smoothing_weighted_gamma_build (float *weighted_gamma, guint8 *weight_index, const float *kernel, gint taps,
+		const float *forward_gamma);
+
+// The plain C row primitives
+void smoothing_linearise_c (float *dst, const guint8 *src, gint len, const float *forward_gamma);
+void smoothing_convolve_row_c (float *dst, const float *src, gint len, gint step, const float *kernel, gint taps);
+void smoothing_convolve_column_c (guint8 *dst, const float **rows, gint len, const float *kernel, gint taps,
+		const unsigned int *inverse_gamma, gint out_limit);
+void smoothing_direct_row_c (guint8 *dst, const float **rows, gint len, gint step, const float *kernel, gint s,
+		const unsigned int *inverse_gamma, gint out_limit);
+void smoothing_linearise16_c (guint16 *dst, const guint8 *src, gint len, const guint16 *forward_gamma16);
+void smoothing_convolve_row16_c (guint16 *dst, const guint16 *src, gint len, gint step, const gint16 *kernel, gint taps);
+void smoothing_convolve_column16_c (guint8 *dst, const guint16 **rows, gint len, const gint16 *kernel, gint taps,
+		const unsigned int *inverse_gamma, gint shift, gint out_limit);
+void smoothing_direct_row16_c (guint8 *dst, const guint16 **rows, gint len, gint step, const gint16 *kernel, gint s,
+		const unsigned int *inverse_gamma, gint shift, gint out_limit);
+void smoothing_linearise_u16_c (float *dst, const guint16 *src, gint len, const float *forward_gamma);
+void smoothing_convolve_column_u16_c (guint16 *dst, const float **rows, gint len, const float *kernel, gint taps,
+		const unsigned int *inverse_gamma, gint out_limit);
+void smoothing_direct_row_u16_c (guint16 *dst, const float **rows, gint len, gint step, const float *kernel, gint s,
+		const unsigned int *inverse_gamma, gint out_limit);
+
+// The C row primitives with the taps unrolled, for kernel size n and step at [n-1][step-1]
+extern const SmoothingFuncs smoothing_funcs_unrolled[SMOOTHING_UNROLLED_MAX_KERNELSIZE][SMOOTHING_UNROLLED_MAX_STEP];
+extern const SmoothingWeightedRowFunc smoothing_weighted_rows_unrolled[SMOOTHING_WEIGHTED_MAX_KERNELSIZE][SMOOTHING_UNROLLED_MAX_STEP];
+
+#ifdef HAVE_SSE41
+extern const SmoothingFuncs smoothing_funcs_sse41;
+#endif
+#ifdef HAVE_AVX2
+extern const SmoothingFuncs smoothing_funcs_avx2;
+#endif
+
+G_END_DECLS
+
+#endif /* __GST_SMOOTHINGENGINE_H__ */
@@ -59,9 +59,14 @@
 #include <config.h>
 #endif
 
+// GstTracerRecord is still declared only for code that asks for the unstable API, it has not changed since 1.8
+#define GST_USE_UNSTABLE_API
+
 #include <gst/gst.h>
 #include <gst/video/video.h>
+#include <gst/video/gstvideofilter.h>
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -81,11 +86,118 @@ enum
 {
 	PROP_0,
 	PROP_KERNELSIZE,
-	PROP_SIGMA
+	PROP_SIGMA,
+	PROP_METHOD,
+	PROP_SIGMA_RANGE,
+	PROP_IN_PLACE,
+	PROP_SIMD,
+	PROP_N_THREADS,
+	PROP_POOL,
+	PROP_FIXED_POINT,
+	PROP_CHROMA,
+	PROP_GAMMA,
+	PROP_LUT_PRECISION,
+	PROP_ROI,
+	PROP_ROI_META,
+	PROP_ALPHA,
+	PROP_SKIP_STATIC,
+	PROP_DOWNSCALE_FACTOR,
+	PROP_ASYNC_DEPTH,
+	PROP_ADAPTIVE,
+	PROP_QUALITY,
+	PROP_STATS,
+	PROP_STATS_INTERVAL,
+	PROP_FRAMES,
+	PROP_MEAN_TIME,
+	PROP_MAX_TIME,
+	PROP_P99_TIME,
+	PROP_MPIXELS_PER_SECOND,
+	PROP_ENGINE
 };
 
 #define DEFAULT_PROP_KERNELSIZE 1       // The size index (n) of the kernel, kernel will be square 2n+1 in size
 #define DEFAULT_PROP_SIGMA      1.5     // The sigma used for Gaussian kernel, e^(-r^2/sigma^2) where r is distance from central pixel
+#define DEFAULT_PROP_METHOD     GST_SMOOTHINGFILTER_METHOD_SEPARABLE
+#define DEFAULT_PROP_SIGMA_RANGE 20.0   // The range sigma of the bilateral method, e^(-d^2/sigma_range^2) for a difference of d levels
+#define DEFAULT_PROP_IN_PLACE   FALSE   // Out-of-place by default so shared input buffers are never copied
+#define DEFAULT_PROP_SIMD       TRUE
+#define DEFAULT_PROP_N_THREADS  0       // One thread per core
+#define DEFAULT_PROP_POOL       GST_SMOOTHINGFILTER_POOL_PRIVATE
+#define DEFAULT_PROP_FIXED_POINT FALSE
+#define DEFAULT_PROP_CHROMA     FALSE   // Luma only, most of the noise and all of the detail the eye sees is in the luma
+#define DEFAULT_PROP_GAMMA      GAMMA
+#define DEFAULT_PROP_LUT_PRECISION LUT_PRECISION
+#define DEFAULT_PROP_ROI_META   FALSE   // buffers with ROI metas are still smoothed all over, unless asked
+#define DEFAULT_PROP_ALPHA      1.0     // no temporal averaging
+#define DEFAULT_PROP_SKIP_STATIC FALSE
+#define DEFAULT_PROP_DOWNSCALE_FACTOR 1
+#define DEFAULT_PROP_ASYNC_DEPTH 0      // smooth and push in the streaming thread
+#define DEFAULT_PROP_ADAPTIVE   FALSE
+#define DEFAULT_PROP_STATS      FALSE
+#define DEFAULT_PROP_STATS_INTERVAL 0   // ms, no messages
+
+#if GST_CHECK_VERSION(1,8,0)
+// Logged for every timed frame, so tracer tools can follow the element without the stats messages
+static GstTracerRecord *frame_record = NULL;
+#endif
+
+#define MIN_STRIPE_HEIGHT 16   // Do not split frames into bands smaller than this, or 2s if that is bigger
+
+#define GST_TYPE_SMOOTHINGFILTER_METHOD (gst_smoothingfilter_method_get_type())
+static GType
+gst_smoothingfilter_method_get_type (void)
+{
+	static GType method_type = 0;
+	static const GEnumValue methods[] = {
+		{GST_SMOOTHINGFILTER_METHOD_DIRECT, "Direct 2D convolution, s*s taps", "direct"},
+		{GST_SMOOTHINGFILTER_METHOD_SEPARABLE, "Separable horizontal then vertical convolution, 2s taps", "separable"},
+		{GST_SMOOTHINGFILTER_METHOD_IIR, "Recursive Gaussian, cost does not depend on sigma, kernelsize is ignored", "iir"},
+		{GST_SMOOTHINGFILTER_METHOD_BILATERAL, "Edge preserving bilateral filter, neighbours are also weighted by how close their values are", "bilateral"},
+		{0, NULL, NULL},
+	};
+
+	if (!method_type) {
+		method_type = g_enum_register_static ("GstSmoothingFilterMethod", methods);
+	}
+	return method_type;
+}
+
+#define GST_TYPE_SMOOTHINGFILTER_POOL_MODE (gst_smoothingfilter_pool_mode_get_type())
+static GType
+gst_smoothingfilter_pool_mode_get_type (void)
+{
+	static GType pool_mode_type = 0;
+	static const GEnumValue pool_modes[] = {
+		{GST_SMOOTHINGFILTER_POOL_PRIVATE, "Threads of this element's own", "private"},
+		{GST_SMOOTHINGFILTER_POOL_SHARED, "One worker per core shared by every element in the process", "shared"},
+		{0, NULL, NULL},
+	};
+
+	if (!pool_mode_type) {
+		pool_mode_type = g_enum_register_static ("GstSmoothingFilterPoolMode", pool_modes);
+	}
+	return pool_mode_type;
+}
+
+// In GstSmoothingFilterQuality order, the nicks name the quality in the smoothingfilter-qos messages
+static const GEnumValue qualities[] = {
+	{GST_SMOOTHINGFILTER_QUALITY_FULL, "The kernel asked for", "full"},
+	{GST_SMOOTHINGFILTER_QUALITY_3X3, "A 3x3 kernel with the same sigma", "3x3"},
+	{GST_SMOOTHINGFILTER_QUALITY_OFF, "Passthrough", "off"},
+	{0, NULL, NULL},
+};
+
+#define GST_TYPE_SMOOTHINGFILTER_QUALITY (gst_smoothingfilter_quality_get_type())
+static GType
+gst_smoothingfilter_quality_get_type (void)
+{
+	static GType quality_type = 0;
+
+	if (!quality_type) {
+		quality_type = g_enum_register_static ("GstSmoothingFilterQuality", qualities);
+	}
+	return quality_type;
+}
 
 /* the capabilities of the inputs and outputs.
  *
@@ -95,51 +207,51 @@ static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
 		GST_PAD_SINK,
 		GST_PAD_ALWAYS,
 		GST_STATIC_CAPS (GST_VIDEO_CAPS_MAKE
-				("{ BGR, RGB }"))
+				("{ BGR, RGB, I420, NV12, YUY2, GRAY8, GRAY16_LE, GRAY16_BE }"))
 );
 
 static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
 		GST_PAD_SRC,
 		GST_PAD_ALWAYS,
 		GST_STATIC_CAPS (GST_VIDEO_CAPS_MAKE
-				("{ BGR, RGB }"))
+				("{ BGR, RGB, I420, NV12, YUY2, GRAY8, GRAY16_LE, GRAY16_BE }"))
 );
 
 #define gst_smoothingfilter_parent_class parent_class
-G_DEFINE_TYPE (Gstsmoothingfilter, gst_smoothingfilter, GST_TYPE_ELEMENT);
+G_DEFINE_TYPE (Gstsmoothingfilter, gst_smoothingfilter, GST_TYPE_VIDEO_FILTER);
 
 static void gst_smoothingfilter_set_property (GObject * object, guint prop_id,
 		const GValue * value, GParamSpec * pspec);
 static void gst_smoothingfilter_get_property (GObject * object, guint prop_id,
 		GValue * value, GParamSpec * pspec);
+static void gst_smoothingfilter_finalize (GObject * object);
+
+static void gst_smoothingfilter_update_kernel (Gstsmoothingfilter *filter);
+static void gst_smoothingfilter_update_passthrough (Gstsmoothingfilter *filter);
+static void gst_smoothingfilter_update_in_place (Gstsmoothingfilter *filter);
+static void gst_smoothingfilter_stats_reset (Gstsmoothingfilter *filter);
+static void gst_smoothingfilter_get_stats_property (Gstsmoothingfilter *filter, guint prop_id, GValue *value);
+static void gst_smoothingfilter_kernel_unref (GstSmoothingFilterKernel *kernel);
+static gboolean gst_smoothingfilter_stop (GstBaseTransform * trans);
+static gboolean gst_smoothingfilter_src_event (GstBaseTransform * trans, GstEvent * event);
+static gboolean gst_smoothingfilter_sink_event (GstBaseTransform * trans, GstEvent * event);
+static gboolean gst_smoothingfilter_query (GstBaseTransform * trans, GstPadDirection direction, GstQuery * query);
+static void gst_smoothingfilter_before_transform (GstBaseTransform * trans, GstBuffer * buffer);
+static GstFlowReturn gst_smoothingfilter_generate_output (GstBaseTransform * trans, GstBuffer ** outbuf);
+static gboolean gst_smoothingfilter_src_activate_mode (GstPad * pad, GstObject * parent, GstPadMode mode,
+		gboolean active);
+static GstCaps *gst_smoothingfilter_transform_caps (GstBaseTransform * trans, GstPadDirection direction,
+		GstCaps * caps, GstCaps * filter_caps);
+static gboolean gst_smoothingfilter_propose_allocation (GstBaseTransform * trans,
+		GstQuery * decide_query, GstQuery * query);
+static gboolean gst_smoothingfilter_decide_allocation (GstBaseTransform * trans, GstQuery * query);
+static gboolean gst_smoothingfilter_set_info (GstVideoFilter * vfilter, GstCaps * incaps,
+		GstVideoInfo * in_info, GstCaps * outcaps, GstVideoInfo * out_info);
+static GstFlowReturn gst_smoothingfilter_transform_frame (GstVideoFilter * vfilter,
+		GstVideoFrame * in_frame, GstVideoFrame * out_frame);
+static GstFlowReturn gst_smoothingfilter_transform_frame_ip (GstVideoFilter * vfilter,
+		GstVideoFrame * frame);
 
-static gboolean gst_smoothingfilter_sink_event (GstPad * pad, GstObject * parent, GstEvent * event);
-static GstFlowReturn gst_smoothingfilter_chain (GstPad * pad, GstObject * parent, GstBuffer * buf);
-
-
-void
-create_gamma_lut(Gstsmoothingfilter *filter)
-{
-	unsigned int i;
-	double invgamma = 1.0/GAMMA;
-
-	filter->forward_gamma = g_new(double, IN_RANGE);
-	filter->inverse_gamma = g_new(unsigned int, OUT_RANGE);
-
-//	GST_DEBUG_OBJECT (filter, "create_gamma_lut NOW !!!!!!!!!");
-
-	for (i=0;i<IN_RANGE;i++){
-		filter->forward_gamma[i] = (double)((double)OUT_RANGE * pow(((double)i/(double)FACTOR) + OFFSET, (double)GAMMA));
-//		filter->forward_gamma[i] = (double)((double)OUT_RANGE * pow(((double)i/(double)IN_RANGE), (double)GAMMA));
-//		GST_DEBUG_OBJECT (filter, "forward_gamma: %d - %.2f", i, filter->forward_gamma[i]);
-	}
-
-    // NB Not applying the output offset, OFFSET, here since not adding a linear portion to the gamma curve (see flycapsrc LUT))!!! TODO: Is this OK?
-	for (i=0;i<OUT_RANGE;i++){
-		filter->inverse_gamma[i] = (unsigned int)(IN_RANGE * pow(((double)i/OUT_RANGE), invgamma));
-//		GST_DEBUG_OBJECT (filter, "inverse_gamma: %d - %d", i, filter->inverse_gamma[i]);
-	}
-}
 
 /* GObject vmethod implementations */
 
@@ -149,24 +261,146 @@ gst_smoothingfilter_class_init (GstsmoothingfilterClass * klass)
 {
 	GObjectClass *gobject_class;
 	GstElementClass *gstelement_class;
+	GstBaseTransformClass *trans_class;
+	GstVideoFilterClass *vfilter_class;
 
 	gobject_class = (GObjectClass *) klass;
 	gstelement_class = (GstElementClass *) klass;
+	trans_class = (GstBaseTransformClass *) klass;
+	vfilter_class = (GstVideoFilterClass *) klass;
 
 	gobject_class->set_property = gst_smoothingfilter_set_property;
 	gobject_class->get_property = gst_smoothingfilter_get_property;
+	gobject_class->finalize = gst_smoothingfilter_finalize;
 
 	// properties
 	g_object_class_install_property (gobject_class, PROP_KERNELSIZE,
-			g_param_spec_int("kernelsize", "Kernel Size", "The size index (n) of the kernel, kernel will be square 2n+1 in size.", 0, 2, DEFAULT_PROP_KERNELSIZE,
+			g_param_spec_int("kernelsize", "Kernel Size", "The size index (n) of the kernel, kernel will be square 2n+1 in size, 0 passes the buffers through untouched.", 0, MAX_KERNELSIZE, DEFAULT_PROP_KERNELSIZE,
 					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
 	g_object_class_install_property (gobject_class, PROP_SIGMA,
 			g_param_spec_float("sigma", "Gaussian Sigma", "The sigma used for Gaussian kernel, e^(r^2/sigma^2) where r is distance from central pixel.", 0.1, 100.0, DEFAULT_PROP_SIGMA,
 					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_METHOD,
+			g_param_spec_enum("method", "Method", "How the convolution is computed, separable is much faster for large kernels, iir for large sigma and bilateral keeps edges.",
+					GST_TYPE_SMOOTHINGFILTER_METHOD, DEFAULT_PROP_METHOD,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_SIGMA_RANGE,
+			g_param_spec_float("sigma-range", "Range Sigma", "For method=bilateral, neighbours d 8 bit levels away (summed over the values of a pixel) are weighted by e^(-d^2/sigma-range^2) as well as by distance. Smaller keeps more edges.", 1.0, 1000.0, DEFAULT_PROP_SIGMA_RANGE,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_IN_PLACE,
+			g_param_spec_boolean("in-place", "In Place", "Smooth the input buffer in-place instead of writing to a new output buffer. Saves a buffer but forces a copy of shared input buffers.",
+					DEFAULT_PROP_IN_PLACE,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+	g_object_class_install_property (gobject_class, PROP_SIMD,
+			g_param_spec_boolean("simd", "SIMD", "Use the SSE4.1 or AVX2 kernels if the CPU supports them, otherwise plain C.",
+					DEFAULT_PROP_SIMD,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_N_THREADS,
+			g_param_spec_int("n-threads", "Number of Threads", "Number of threads each frame is split over in horizontal bands, 0 for one per CPU core.", 0, 256, DEFAULT_PROP_N_THREADS,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_POOL,
+			g_param_spec_enum("pool", "Thread Pool", "Smooth on threads of this element's own, or queue the bands of each frame for workers shared with every other element in the process that has pool=shared, so many streams do not start a thread per core each. n-threads is still the number of bands.",
+					GST_TYPE_SMOOTHINGFILTER_POOL_MODE, DEFAULT_PROP_POOL,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_FIXED_POINT,
+			g_param_spec_boolean("fixed-point", "Fixed Point", "Use 16 bit integer luts and kernel weights with 32 bit accumulators instead of floating point. Output is within 1 level of the floating point result.",
+					DEFAULT_PROP_FIXED_POINT,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_CHROMA,
+			g_param_spec_boolean("chroma", "Chroma", "Smooth the chroma of YUV formats as well as the luma. RGB formats always have every channel smoothed.",
+					DEFAULT_PROP_CHROMA,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_GAMMA,
+			g_param_spec_double("gamma", "Gamma", "The gamma the input was encoded with, values are linearised with it before smoothing.",
+					0.1, 10.0, DEFAULT_PROP_GAMMA,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_LUT_PRECISION,
+			g_param_spec_int("lut-precision", "LUT Precision", "Bits of the lut that takes linear intensities back to 8 bit values, 18 preserves every level. 16 bit values get 8 bits more. Above 14 fixed-point is not used.",
+					8, 20, DEFAULT_PROP_LUT_PRECISION,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_ROI,
+			g_param_spec_string("roi", "Regions of Interest", "Only smooth these rectangles, x,y,width,height in pixels, separated by semicolons. Empty for the whole frame.",
+					NULL,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_ROI_META,
+			g_param_spec_boolean("roi-meta", "ROI Meta", "Only smooth the rectangles of each buffer's GstVideoRegionOfInterestMeta, and those of roi. Buffers without any are not smoothed.",
+					DEFAULT_PROP_ROI_META,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_ALPHA,
+			g_param_spec_float("alpha", "Temporal Alpha", "Below 1 the smoothed frames are averaged over time as well, in linear intensity, each new frame with this weight. Not applied to frames smoothed only in regions of interest.",
+					0.01, 1.0, DEFAULT_PROP_ALPHA,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_SKIP_STATIC,
+			g_param_spec_boolean("skip-static", "Skip Static", "Keep the last frame and only smooth the bands of rows that have changed since, with the rows the kernel reaches from them, copying the rest from the last output. For still scenes. Frames smoothed with method=iir, alpha < 1, downscale-factor > 1 or regions of interest are smoothed in full.",
+					DEFAULT_PROP_SKIP_STATIC,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_DOWNSCALE_FACTOR,
+			g_param_spec_int("downscale-factor", "Downscale Factor", "Output frames this many times smaller each way, rounded up. Only the output pixels are smoothed, so the kernel anti-aliases the downscale, a sigma of about the factor suits. Chroma is always smoothed when downscaling.",
+					1, 8, DEFAULT_PROP_DOWNSCALE_FACTOR,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_ASYNC_DEPTH,
+			g_param_spec_int("async-depth", "Async Depth", "Queue up to this many smoothed frames for a thread of the src pad to push, so the next frame is smoothed while downstream works on this one. Adds as many frame durations to the latency. 0 pushes each frame from the streaming thread.",
+					0, 32, DEFAULT_PROP_ASYNC_DEPTH,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+	g_object_class_install_property (gobject_class, PROP_ADAPTIVE,
+			g_param_spec_boolean("adaptive", "Adaptive", "Follow QoS events: when the pipeline is late drop to a 3x3 kernel, then to passthrough, and go back up when it catches up. Each change posts a smoothingfilter-qos element message.",
+					DEFAULT_PROP_ADAPTIVE,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_QUALITY,
+			g_param_spec_enum("quality", "Quality", "How much smoothing adaptive=true is doing at the moment.",
+					GST_TYPE_SMOOTHINGFILTER_QUALITY, GST_SMOOTHINGFILTER_QUALITY_FULL,
+					G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_STATS,
+			g_param_spec_boolean("stats", "Stats", "Time every frame for the read-only stats properties, the stats messages and the smoothingfilter-frame tracer record. Turning it on resets them.",
+					DEFAULT_PROP_STATS,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_STATS_INTERVAL,
+			g_param_spec_uint("stats-interval", "Stats Interval", "Milliseconds between smoothingfilter-stats element messages while stats is on, 0 for none.",
+					0, G_MAXUINT, DEFAULT_PROP_STATS_INTERVAL,
+					G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+	g_object_class_install_property (gobject_class, PROP_FRAMES,
+			g_param_spec_uint64("frames", "Frames", "Frames smoothed since stats was turned on or the element started.",
+					0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_MEAN_TIME,
+			g_param_spec_uint64("mean-time", "Mean Time", "Mean time spent smoothing a frame, in nanoseconds.",
+					0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_MAX_TIME,
+			g_param_spec_uint64("max-time", "Max Time", "Longest time spent smoothing a frame, in nanoseconds.",
+					0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_P99_TIME,
+			g_param_spec_uint64("p99-time", "P99 Time", "99th percentile of the time spent smoothing each of the last 1000 frames, in nanoseconds.",
+					0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_MPIXELS_PER_SECOND,
+			g_param_spec_double("mpixels-per-second", "Mpixels per Second", "Millions of pixels smoothed per second of smoothing time.",
+					0, G_MAXDOUBLE, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+	g_object_class_install_property (gobject_class, PROP_ENGINE,
+			g_param_spec_string("engine", "Engine", "The engine and row functions that smoothed the first plane of the last frame.",
+					NULL, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+#if GST_CHECK_VERSION(1,8,0)
+	frame_record = gst_tracer_record_new("smoothingfilter-frame.class",
+			"element", GST_TYPE_STRUCTURE, gst_structure_new("scope",
+					"type", G_TYPE_GTYPE, G_TYPE_STRING,
+					"related-to", GST_TYPE_TRACER_VALUE_SCOPE, GST_TRACER_VALUE_SCOPE_ELEMENT,
+					NULL),
+			"time", GST_TYPE_STRUCTURE, gst_structure_new("value",
+					"type", G_TYPE_GTYPE, G_TYPE_UINT64,
+					"description", G_TYPE_STRING, "time spent smoothing the frame in ns",
+					"min", G_TYPE_UINT64, G_GUINT64_CONSTANT(0),
+					"max", G_TYPE_UINT64, G_MAXUINT64,
+					NULL),
+			"pixels", GST_TYPE_STRUCTURE, gst_structure_new("value",
+					"type", G_TYPE_GTYPE, G_TYPE_UINT64,
+					"description", G_TYPE_STRING, "pixels in the frame",
+					"min", G_TYPE_UINT64, G_GUINT64_CONSTANT(0),
+					"max", G_TYPE_UINT64, G_MAXUINT64,
+					NULL),
+			NULL);
+#endif
 
 	gst_element_class_set_details_simple(gstelement_class,
 			"smoothingfilter",
-			"Filter",
+			"Filter/Effect/Video",
 			"Smoothes the image by applying some kind of low-pass spatial filter such as a Gaussian convolution kernel.",
 			"Paul R Barber <<paul.barber@oncology.ox.ac.uk>>");
 
@@ -174,36 +408,317 @@ gst_smoothingfilter_class_init (GstsmoothingfilterClass * klass)
 			gst_static_pad_template_get (&src_factory));
 	gst_element_class_add_pad_template (gstelement_class,
 			gst_static_pad_template_get (&sink_factory));
+
+	// nothing to do when passing through, so do not even map the buffer
+	trans_class->transform_ip_on_passthrough = FALSE;
+	trans_class->stop = GST_DEBUG_FUNCPTR (gst_smoothingfilter_stop);
+	trans_class->src_event = GST_DEBUG_FUNCPTR (gst_smoothingfilter_src_event);
+	trans_class->sink_event = GST_DEBUG_FUNCPTR (gst_smoothingfilter_sink_event);
+	trans_class->query = GST_DEBUG_FUNCPTR (gst_smoothingfilter_query);
+	trans_class->before_transform = GST_DEBUG_FUNCPTR (gst_smoothingfilter_before_transform);
+	// takes the smoothed buffer from the base class to queue it
+	trans_class->generate_output = GST_DEBUG_FUNCPTR (gst_smoothingfilter_generate_output);
+	trans_class->transform_caps = GST_DEBUG_FUNCPTR (gst_smoothingfilter_transform_caps);
+	trans_class->propose_allocation = GST_DEBUG_FUNCPTR (gst_smoothingfilter_propose_allocation);
+	trans_class->decide_allocation = GST_DEBUG_FUNCPTR (gst_smoothingfilter_decide_allocation);
+
+	vfilter_class->set_info = GST_DEBUG_FUNCPTR (gst_smoothingfilter_set_info);
+	vfilter_class->transform_frame = GST_DEBUG_FUNCPTR (gst_smoothingfilter_transform_frame);
+	vfilter_class->transform_frame_ip = GST_DEBUG_FUNCPTR (gst_smoothingfilter_transform_frame_ip);
 }
 
 /* initialize the new element
- * instantiate pads and add them to element
- * set pad calback functions
  * initialize instance structure
  */
+static GstPadActivateModeFunction parent_src_activate_mode;   // the base class's, the same for every instance
+
 static void
 gst_smoothingfilter_init (Gstsmoothingfilter * filter)
 {
-	filter->sinkpad = gst_pad_new_from_static_template (&sink_factory, "sink");
-	gst_pad_set_event_function (filter->sinkpad,
-			GST_DEBUG_FUNCPTR(gst_smoothingfilter_sink_event));
-	gst_pad_set_chain_function (filter->sinkpad,
-			GST_DEBUG_FUNCPTR(gst_smoothingfilter_chain));
-	GST_PAD_SET_PROXY_CAPS (filter->sinkpad);
-	gst_element_add_pad (GST_ELEMENT (filter), filter->sinkpad);
-
-	filter->srcpad = gst_pad_new_from_static_template (&src_factory, "src");
-	GST_PAD_SET_PROXY_CAPS (filter->srcpad);
-	gst_element_add_pad (GST_ELEMENT (filter), filter->srcpad);
+	GstPad *srcpad = GST_BASE_TRANSFORM_SRC_PAD (filter);
 
 	filter->kernelsize = DEFAULT_PROP_KERNELSIZE;
 	filter->sigma = DEFAULT_PROP_SIGMA;
+	filter->sigma_range = DEFAULT_PROP_SIGMA_RANGE;
+	filter->method = DEFAULT_PROP_METHOD;
+	filter->in_place = DEFAULT_PROP_IN_PLACE;
+	filter->simd = DEFAULT_PROP_SIMD;
+	filter->n_threads = DEFAULT_PROP_N_THREADS;
+	filter->pool_mode = DEFAULT_PROP_POOL;
+	filter->fixed_point = DEFAULT_PROP_FIXED_POINT;
+	filter->chroma = DEFAULT_PROP_CHROMA;
+	filter->gamma = DEFAULT_PROP_GAMMA;
+	filter->lut_precision = DEFAULT_PROP_LUT_PRECISION;
+	filter->lut16 = FALSE;
+	filter->lut16_swapped = FALSE;
+	filter->alpha = DEFAULT_PROP_ALPHA;
+	filter->downscale_factor = DEFAULT_PROP_DOWNSCALE_FACTOR;
+	filter->downscale = 1;
+	filter->temporal = NULL;
+	filter->temporal_size = 0;
+	filter->temporal_used = 0;
+	filter->temporal_valid = FALSE;
+	filter->async_depth = DEFAULT_PROP_ASYNC_DEPTH;
+	g_queue_init(&filter->async_queue);
+	filter->async_pending = 0;
+	filter->async_flow = GST_FLOW_OK;
+	filter->async_flushing = FALSE;
+	filter->async_running = FALSE;
+	g_mutex_init(&filter->async_lock);
+	g_cond_init(&filter->async_cond);
+	filter->skip_static = DEFAULT_PROP_SKIP_STATIC;
+	filter->static_input = NULL;
+	filter->static_output = NULL;
+	filter->static_size = 0;
+	filter->static_used = 0;
+	filter->static_valid = FALSE;
+	filter->adaptive = DEFAULT_PROP_ADAPTIVE;
+	filter->quality = GST_SMOOTHINGFILTER_QUALITY_FULL;
+	filter->quality_changed = GST_CLOCK_TIME_NONE;
+	filter->stats_enabled = DEFAULT_PROP_STATS;
+	filter->stats_interval = DEFAULT_PROP_STATS_INTERVAL;
+	gst_smoothingfilter_stats_reset(filter);
+
+	filter->kernel = NULL;
+	filter->kernel_3x3 = NULL;
+	g_queue_init(&filter->kernel_cache);
+	filter->iir_buffer = NULL;
+	filter->iir_buffer_size = 0;
+	filter->pool = NULL;
+	filter->stripes = NULL;
+	filter->n_stripes = 0;
+	filter->roi = g_array_new(FALSE, FALSE, sizeof(GstSmoothingFilterRect));
+	filter->roi_meta = DEFAULT_PROP_ROI_META;
+	filter->roi_buffer = NULL;
+	filter->roi_buffer_size = 0;
+
+	gst_smoothingfilter_update_kernel(filter);   // the luts come from the shared registry, usually already calculated
+
+	gst_smoothingfilter_update_in_place(filter);
+	gst_smoothingfilter_update_passthrough(filter);
+
+	// to stop the task when the pad is deactivated, before the base class waits for the pad's streaming to end
+	parent_src_activate_mode = GST_PAD_ACTIVATEMODEFUNC (srcpad);
+	gst_pad_set_activatemode_function(srcpad, GST_DEBUG_FUNCPTR (gst_smoothingfilter_src_activate_mode));
+}
+
+/* Frame stats */
+
+// Called with the object lock held, or before the element is used
+static void
+gst_smoothingfilter_stats_reset (Gstsmoothingfilter *filter)
+{
+	memset(&filter->stats, 0, sizeof(filter->stats));
+	filter->stats.last_message = gst_util_get_timestamp();
+}
+
+static gint
+gst_smoothingfilter_compare_time (gconstpointer a, gconstpointer b)
+{
+	GstClockTime ta = *(const GstClockTime *)a, tb = *(const GstClockTime *)b;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+// Nearest rank 99th percentile of the frames in the window
+static GstClockTime
+gst_smoothingfilter_stats_p99 (const GstSmoothingFilterStats *stats)
+{
+	GstClockTime sorted[SMOOTHING_STATS_WINDOW];
+	gint n = (gint)MIN(stats->frames, SMOOTHING_STATS_WINDOW);
+
+	if (n == 0)
+		return 0;
+
+	memcpy(sorted, stats->window, n*sizeof(GstClockTime));
+	qsort(sorted, n, sizeof(GstClockTime), gst_smoothingfilter_compare_time);
 
-	filter->smoothing_buffer = NULL;
+	return sorted[(99*n + 99)/100 - 1];
+}
+
+static GstClockTime
+gst_smoothingfilter_stats_mean (const GstSmoothingFilterStats *stats)
+{
+	return stats->frames ? stats->total_time / stats->frames : 0;
+}
+
+static gdouble
+gst_smoothingfilter_stats_mpixels (const GstSmoothingFilterStats *stats)
+{
+	return stats->total_time ? stats->pixels * 1000.0 / stats->total_time : 0.0;
+}
+
+// NULL before the first timed frame, free with g_free()
+static gchar *
+gst_smoothingfilter_stats_engine (const GstSmoothingFilterStats *stats)
+{
+	return stats->engine ? g_strdup_printf("%s (%s)", stats->engine, stats->funcs) : NULL;
+}
+
+static void
+gst_smoothingfilter_get_stats_property (Gstsmoothingfilter *filter, guint prop_id, GValue *value)
+{
+	GstSmoothingFilterStats *stats = g_new(GstSmoothingFilterStats, 1);
+
+	// Work on a copy, so the streaming thread is not held up while the window is sorted
+	GST_OBJECT_LOCK (filter);
+	*stats = filter->stats;
+	GST_OBJECT_UNLOCK (filter);
 
-	filter->valchanged = 1;
+	switch (prop_id) {
+	case PROP_FRAMES:
+		g_value_set_uint64(value, stats->frames);
+		break;
+	case PROP_MEAN_TIME:
+		g_value_set_uint64(value, gst_smoothingfilter_stats_mean(stats));
+		break;
+	case PROP_MAX_TIME:
+		g_value_set_uint64(value, stats->max_time);
+		break;
+	case PROP_P99_TIME:
+		g_value_set_uint64(value, gst_smoothingfilter_stats_p99(stats));
+		break;
+	case PROP_MPIXELS_PER_SECOND:
+		g_value_set_double(value, gst_smoothingfilter_stats_mpixels(stats));
+		break;
+	case PROP_ENGINE:
+		g_value_take_string(value, gst_smoothingfilter_stats_engine(stats));
+		break;
+	}
 
-	create_gamma_lut(filter);
+	g_free(stats);
+}
+
+/* Add a frame smoothed between start and end to the stats, and post a smoothingfilter-stats element message
+ * if it is time for one. engine and funcs are static strings.
+ */
+static void
+gst_smoothingfilter_stats_add_frame (Gstsmoothingfilter *filter, GstClockTime start, GstClockTime end,
+		guint64 pixels, const gchar *engine, const gchar *funcs)
+{
+	GstSmoothingFilterStats *stats = &filter->stats, *snapshot = NULL;
+	GstClockTime time = end - start;
+
+	GST_OBJECT_LOCK (filter);
+	stats->window[stats->frames % SMOOTHING_STATS_WINDOW] = time;
+	stats->frames++;
+	stats->pixels += pixels;
+	stats->total_time += time;
+	stats->max_time = MAX(stats->max_time, time);
+	stats->engine = engine;
+	stats->funcs = funcs;
+	if (filter->stats_interval > 0 && end - stats->last_message >= filter->stats_interval * GST_MSECOND){
+		stats->last_message = end;
+		snapshot = g_new(GstSmoothingFilterStats, 1);
+		*snapshot = *stats;
+	}
+	GST_OBJECT_UNLOCK (filter);
+
+#if GST_CHECK_VERSION(1,8,0)
+	gst_tracer_record_log(frame_record, GST_OBJECT_NAME (filter), (guint64)time, pixels);
+#endif
+
+	if (snapshot){
+		gchar *name = gst_smoothingfilter_stats_engine(snapshot);
+		GstStructure *s = gst_structure_new("smoothingfilter-stats",
+				"frames", G_TYPE_UINT64, snapshot->frames,
+				"mean-time", G_TYPE_UINT64, gst_smoothingfilter_stats_mean(snapshot),
+				"max-time", G_TYPE_UINT64, snapshot->max_time,
+				"p99-time", G_TYPE_UINT64, gst_smoothingfilter_stats_p99(snapshot),
+				"mpixels-per-second", G_TYPE_DOUBLE, gst_smoothingfilter_stats_mpixels(snapshot),
+				"engine", G_TYPE_STRING, name,
+				NULL);
+
+		gst_element_post_message(GST_ELEMENT (filter), gst_message_new_element(GST_OBJECT (filter), s));
+		g_free(name);
+		g_free(snapshot);
+	}
+}
+
+/* Regions of interest */
+
+// Parse "x,y,width,height;..." into filter->roi, rectangles that do not parse are left out
+static void
+gst_smoothingfilter_set_roi (Gstsmoothingfilter *filter, const gchar *roi)
+{
+	GArray *rects = g_array_new(FALSE, FALSE, sizeof(GstSmoothingFilterRect)), *old;
+	gchar **parts = g_strsplit(roi ? roi : "", ";", -1);
+	gint i;
+
+	for(i=0; parts[i]; i++){
+		GstSmoothingFilterRect rect;
+
+		if (g_strstrip(parts[i])[0] == '\0')
+			continue;
+		if (sscanf(parts[i], "%d,%d,%d,%d", &rect.x, &rect.y, &rect.width, &rect.height) != 4 ||
+				rect.x < 0 || rect.y < 0 || rect.width <= 0 || rect.height <= 0){
+			GST_WARNING_OBJECT (filter, "Ignoring region of interest '%s', expected x,y,width,height", parts[i]);
+			continue;
+		}
+		g_array_append_val(rects, rect);
+	}
+	g_strfreev(parts);
+
+	GST_OBJECT_LOCK (filter);
+	old = filter->roi;
+	filter->roi = rects;
+	GST_OBJECT_UNLOCK (filter);
+
+	g_array_unref(old);
+}
+
+static gchar *
+gst_smoothingfilter_get_roi (Gstsmoothingfilter *filter)
+{
+	GString *roi = g_string_new(NULL);
+	guint i;
+
+	GST_OBJECT_LOCK (filter);
+	for(i=0; i<filter->roi->len; i++){
+		GstSmoothingFilterRect *rect = &g_array_index(filter->roi, GstSmoothingFilterRect, i);
+		g_string_append_printf(roi, "%s%d,%d,%d,%d", i ? ";" : "", rect->x, rect->y, rect->width, rect->height);
+	}
+	GST_OBJECT_UNLOCK (filter);
+
+	return g_string_free(roi, FALSE);
+}
+
+/* The rectangles to smooth in this buffer, from the roi property and, with roi-meta=true, its
+ * GstVideoRegionOfInterestMeta. NULL to smooth the whole frame, an empty array to smooth nothing.
+ */
+static GArray *
+gst_smoothingfilter_get_rects (Gstsmoothingfilter *filter, GstBuffer *buffer)
+{
+	GArray *rects = NULL;
+	gboolean roi_meta = filter->roi_meta;
+
+	GST_OBJECT_LOCK (filter);
+	if (filter->roi->len > 0 || roi_meta){
+		rects = g_array_sized_new(FALSE, FALSE, sizeof(GstSmoothingFilterRect), filter->roi->len);
+		g_array_append_vals(rects, filter->roi->data, filter->roi->len);
+	}
+	GST_OBJECT_UNLOCK (filter);
+
+	if (roi_meta){
+		gpointer state = NULL;
+		GstMeta *meta;
+
+		while ((meta = gst_buffer_iterate_meta(buffer, &state))){
+			GstVideoRegionOfInterestMeta *roi;
+			GstSmoothingFilterRect rect;
+
+			if (meta->info->api != GST_VIDEO_REGION_OF_INTEREST_META_API_TYPE)
+				continue;
+			roi = (GstVideoRegionOfInterestMeta *)meta;
+			rect.x = roi->x;
+			rect.y = roi->y;
+			rect.width = roi->w;
+			rect.height = roi->h;
+			g_array_append_val(rects, rect);
+		}
+	}
+
+	return rects;
 }
 
 static void
@@ -217,18 +732,122 @@ gst_smoothingfilter_set_property (GObject * object, guint prop_id,
 	case PROP_KERNELSIZE:
 		val = g_value_get_int(value);
 		if(filter->kernelsize != val){
+			GST_OBJECT_LOCK (filter);
 			filter->kernelsize = val;
-			filter->valchanged=1;
-			GST_DEBUG_OBJECT(filter, "valchanged");
+			GST_OBJECT_UNLOCK (filter);
+			gst_smoothingfilter_update_kernel(filter);
+			gst_smoothingfilter_update_passthrough(filter);
 		}
 		break;
 	case PROP_SIGMA:
 		val = g_value_get_float(value);
 		if(filter->sigma != val){
+			GST_OBJECT_LOCK (filter);
 			filter->sigma = val;
-			filter->valchanged=1;
+			GST_OBJECT_UNLOCK (filter);
+			gst_smoothingfilter_update_kernel(filter);
 		}
 		break;
+	case PROP_METHOD:
+		GST_OBJECT_LOCK (filter);
+		filter->method = g_value_get_enum(value);
+		GST_OBJECT_UNLOCK (filter);
+		gst_smoothingfilter_update_kernel(filter);   // for the 3x3 kernel
+		break;
+	case PROP_SIGMA_RANGE:
+		val = g_value_get_float(value);
+		if(filter->sigma_range != val){
+			GST_OBJECT_LOCK (filter);
+			filter->sigma_range = val;
+			GST_OBJECT_UNLOCK (filter);
+			gst_smoothingfilter_update_kernel(filter);
+		}
+		break;
+	case PROP_IN_PLACE:
+		filter->in_place = g_value_get_boolean(value);
+		gst_smoothingfilter_update_in_place(filter);
+		gst_base_transform_reconfigure_src (GST_BASE_TRANSFORM (filter));
+		break;
+	case PROP_SIMD:
+		filter->simd = g_value_get_boolean(value);
+		break;
+	case PROP_N_THREADS:
+		filter->n_threads = g_value_get_int(value);
+		break;
+	case PROP_POOL:
+		filter->pool_mode = g_value_get_enum(value);
+		break;
+	case PROP_FIXED_POINT:
+		filter->fixed_point = g_value_get_boolean(value);
+		break;
+	case PROP_CHROMA:
+		filter->chroma = g_value_get_boolean(value);
+		break;
+	case PROP_GAMMA:
+		GST_OBJECT_LOCK (filter);
+		filter->gamma = g_value_get_double(value);
+		filter->temporal_valid = FALSE;   // the average was linearised with the old curve
+		GST_OBJECT_UNLOCK (filter);
+		gst_smoothingfilter_update_kernel(filter);
+		break;
+	case PROP_LUT_PRECISION:
+		GST_OBJECT_LOCK (filter);
+		filter->lut_precision = g_value_get_int(value);
+		filter->temporal_valid = FALSE;   // the average is in units of the old luts
+		GST_OBJECT_UNLOCK (filter);
+		gst_smoothingfilter_update_kernel(filter);
+		break;
+	case PROP_ROI:
+		gst_smoothingfilter_set_roi(filter, g_value_get_string(value));
+		break;
+	case PROP_ROI_META:
+		filter->roi_meta = g_value_get_boolean(value);
+		break;
+	case PROP_ALPHA:
+		GST_OBJECT_LOCK (filter);
+		filter->alpha = g_value_get_float(value);
+		GST_OBJECT_UNLOCK (filter);
+		break;
+	case PROP_SKIP_STATIC:
+		filter->skip_static = g_value_get_boolean(value);
+		break;
+	case PROP_DOWNSCALE_FACTOR:
+		GST_OBJECT_LOCK (filter);
+		filter->downscale_factor = g_value_get_int(value);
+		GST_OBJECT_UNLOCK (filter);
+		gst_smoothingfilter_update_in_place(filter);
+		gst_smoothingfilter_update_passthrough(filter);
+		gst_base_transform_reconfigure_src (GST_BASE_TRANSFORM (filter));   // for the new output size
+		break;
+	case PROP_ASYNC_DEPTH:
+		// a frame waiting for room in the queue looks again, and with 0 the next one waits for the queue to empty
+		g_mutex_lock(&filter->async_lock);
+		filter->async_depth = g_value_get_int(value);
+		g_cond_broadcast(&filter->async_cond);
+		g_mutex_unlock(&filter->async_lock);
+		break;
+	case PROP_ADAPTIVE:
+		GST_OBJECT_LOCK (filter);
+		filter->adaptive = g_value_get_boolean(value);
+		filter->quality = GST_SMOOTHINGFILTER_QUALITY_FULL;
+		filter->quality_changed = GST_CLOCK_TIME_NONE;
+		GST_OBJECT_UNLOCK (filter);
+		gst_smoothingfilter_update_kernel(filter);   // for the 3x3 kernel
+		gst_smoothingfilter_update_passthrough(filter);
+		break;
+	case PROP_STATS:
+		if (g_value_get_boolean(value) && !filter->stats_enabled){
+			GST_OBJECT_LOCK (filter);
+			gst_smoothingfilter_stats_reset(filter);
+			GST_OBJECT_UNLOCK (filter);
+		}
+		filter->stats_enabled = g_value_get_boolean(value);
+		break;
+	case PROP_STATS_INTERVAL:
+		GST_OBJECT_LOCK (filter);
+		filter->stats_interval = g_value_get_uint(value);
+		GST_OBJECT_UNLOCK (filter);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -248,242 +867,1679 @@ gst_smoothingfilter_get_property (GObject * object, guint prop_id,
 	case PROP_SIGMA:
 		g_value_set_float(value, filter->sigma);
 		break;
+	case PROP_METHOD:
+		g_value_set_enum(value, filter->method);
+		break;
+	case PROP_SIGMA_RANGE:
+		g_value_set_float(value, filter->sigma_range);
+		break;
+	case PROP_IN_PLACE:
+		g_value_set_boolean(value, filter->in_place);
+		break;
+	case PROP_SIMD:
+		g_value_set_boolean(value, filter->simd);
+		break;
+	case PROP_N_THREADS:
+		g_value_set_int(value, filter->n_threads);
+		break;
+	case PROP_POOL:
+		g_value_set_enum(value, filter->pool_mode);
+		break;
+	case PROP_FIXED_POINT:
+		g_value_set_boolean(value, filter->fixed_point);
+		break;
+	case PROP_CHROMA:
+		g_value_set_boolean(value, filter->chroma);
+		break;
+	case PROP_GAMMA:
+		g_value_set_double(value, filter->gamma);
+		break;
+	case PROP_LUT_PRECISION:
+		g_value_set_int(value, filter->lut_precision);
+		break;
+	case PROP_ROI:
+		g_value_take_string(value, gst_smoothingfilter_get_roi(filter));
+		break;
+	case PROP_ROI_META:
+		g_value_set_boolean(value, filter->roi_meta);
+		break;
+	case PROP_ALPHA:
+		g_value_set_float(value, filter->alpha);
+		break;
+	case PROP_SKIP_STATIC:
+		g_value_set_boolean(value, filter->skip_static);
+		break;
+	case PROP_DOWNSCALE_FACTOR:
+		g_value_set_int(value, filter->downscale_factor);
+		break;
+	case PROP_ASYNC_DEPTH:
+		g_mutex_lock(&filter->async_lock);
+		g_value_set_int(value, filter->async_depth);
+		g_mutex_unlock(&filter->async_lock);
+		break;
+	case PROP_ADAPTIVE:
+		g_value_set_boolean(value, filter->adaptive);
+		break;
+	case PROP_QUALITY:
+		GST_OBJECT_LOCK (filter);
+		g_value_set_enum(value, filter->quality);
+		GST_OBJECT_UNLOCK (filter);
+		break;
+	case PROP_STATS:
+		g_value_set_boolean(value, filter->stats_enabled);
+		break;
+	case PROP_STATS_INTERVAL:
+		g_value_set_uint(value, filter->stats_interval);
+		break;
+	case PROP_FRAMES:
+	case PROP_MEAN_TIME:
+	case PROP_MAX_TIME:
+	case PROP_P99_TIME:
+	case PROP_MPIXELS_PER_SECOND:
+	case PROP_ENGINE:
+		gst_smoothingfilter_get_stats_property(filter, prop_id, value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
 	}
 }
 
-/* GstElement vmethod implementations */
+static void
+gst_smoothingfilter_free_stripes (Gstsmoothingfilter *filter)
+{
+	gint i;
+
+	for(i=0; i<filter->n_stripes; i++)
+		smoothing_stripe_free(&filter->stripes[i]);
+	g_free(filter->stripes);
+	filter->stripes = NULL;
+	filter->n_stripes = 0;
+}
+
+static void
+gst_smoothingfilter_finalize (GObject * object)
+{
+	Gstsmoothingfilter *filter = GST_SMOOTHINGFILTER (object);
+
+	gst_smoothingfilter_kernel_unref(filter->kernel);
+	gst_smoothingfilter_kernel_unref(filter->kernel_3x3);
+	while (!g_queue_is_empty(&filter->kernel_cache))
+		gst_smoothingfilter_kernel_unref(g_queue_pop_head(&filter->kernel_cache));
+	g_free(filter->iir_buffer);
+	gst_smoothingfilter_free_stripes(filter);
+	smoothing_pool_free(filter->pool);
+	g_array_unref(filter->roi);
+	g_free(filter->roi_buffer);
+	g_free(filter->temporal);
+	g_free(filter->static_input);
+	g_free(filter->static_output);
+	while (!g_queue_is_empty(&filter->async_queue))
+		gst_buffer_unref(g_queue_pop_head(&filter->async_queue));
+	g_mutex_clear(&filter->async_lock);
+	g_cond_clear(&filter->async_cond);
+
+	G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
+/* GstBaseTransform vmethod implementations */
 
-/* this function handles sink events */
 static gboolean
-gst_smoothingfilter_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
+gst_smoothingfilter_stop (GstBaseTransform * trans)
 {
-	gboolean ret;
-	Gstsmoothingfilter *filter;
-//	gchar *format;
+	Gstsmoothingfilter *filter = GST_SMOOTHINGFILTER (trans);
+
+	gst_smoothingfilter_free_stripes(filter);
+	smoothing_pool_free(filter->pool);
+	filter->pool = NULL;
+	g_free(filter->iir_buffer);
+	filter->iir_buffer = NULL;
+	filter->iir_buffer_size = 0;
+	g_free(filter->roi_buffer);
+	filter->roi_buffer = NULL;
+	filter->roi_buffer_size = 0;
+	g_free(filter->temporal);
+	filter->temporal = NULL;
+	filter->temporal_size = 0;
+	g_free(filter->static_input);
+	g_free(filter->static_output);
+	filter->static_input = NULL;
+	filter->static_output = NULL;
+	filter->static_size = 0;
+	filter->static_valid = FALSE;
+
+	GST_OBJECT_LOCK (filter);
+	filter->temporal_valid = FALSE;
+	gst_smoothingfilter_stats_reset(filter);
+	filter->quality = GST_SMOOTHINGFILTER_QUALITY_FULL;
+	filter->quality_changed = GST_CLOCK_TIME_NONE;
+	GST_OBJECT_UNLOCK (filter);
+	gst_smoothingfilter_update_passthrough(filter);
+
+	return TRUE;
+}
 
-	filter = GST_SMOOTHINGFILTER (parent);
+// Passthrough when there is no kernel, or QoS has turned the smoothing off, unless the frames are downscaled
+static void
+gst_smoothingfilter_update_passthrough (Gstsmoothingfilter *filter)
+{
+	gboolean passthrough;
 
-	switch (GST_EVENT_TYPE (event)) {
-	case GST_EVENT_CAPS:
-	{
-		GstCaps *caps;
-		GstStructure *structure;
+	GST_OBJECT_LOCK (filter);
+	passthrough = (filter->kernelsize == 0 || filter->quality == GST_SMOOTHINGFILTER_QUALITY_OFF) &&
+			filter->downscale_factor == 1;
+	if (passthrough)
+		filter->temporal_valid = FALSE;   // frames go by without being averaged
+	GST_OBJECT_UNLOCK (filter);
 
-		gst_event_parse_caps (event, &caps);
-		/* do something with the caps */
+	gst_base_transform_set_passthrough (GST_BASE_TRANSFORM (filter), passthrough);
+}
 
-		if(gst_caps_is_fixed (caps)){
+// A smaller frame can not be written over the input
+static void
+gst_smoothingfilter_update_in_place (Gstsmoothingfilter *filter)
+{
+	gboolean in_place;
 
-			structure = gst_caps_get_structure (caps, 0);
-			if (!gst_structure_get_int (structure, "width", &(filter->width)) ||
-					!gst_structure_get_int (structure, "height", &(filter->height))) {
-				GST_ERROR_OBJECT (filter, "No width/height available\n");
-			}
+	GST_OBJECT_LOCK (filter);
+	in_place = filter->in_place && filter->downscale_factor == 1;
+	GST_OBJECT_UNLOCK (filter);
 
-			filter->stride = filter->width * 3;  // TODO Not sure how to get this properly, but we have BGR or RGB data
+	gst_base_transform_set_in_place (GST_BASE_TRANSFORM (filter), in_place);
+}
 
-//			Currently it does not matter if the data is RGB or BGR, but this would tells us which
-//			format = gst_structure_get_string (structure, "format");
-//			if (!format) {
-//				GST_ERROR_OBJECT (filter, "No format available\n");
-//			}
-//			if (strcmp(format, "RGB")==0){
-//				filter->format_is_RGB = TRUE;
-//				GST_DEBUG_OBJECT (filter, "Format is RGB");
-//			}
+/* Step the quality down when the pipeline is late and back up when it has caught up.
+ * After a change the QoS events still describe earlier frames, so nothing changes again until
+ * SMOOTHING_QOS_HOLD of running time has gone by. The 3x3 step is skipped when the kernel is no bigger, or with iir.
+ */
+static void
+gst_smoothingfilter_adapt (Gstsmoothingfilter *filter, GstEvent *event)
+{
+	GstSmoothingFilterQuality old, quality;
+	GstQOSType type;
+	gdouble proportion;
+	GstClockTimeDiff diff;
+	GstClockTime timestamp;
+
+	gst_event_parse_qos(event, &type, &proportion, &diff, &timestamp);
+
+	GST_OBJECT_LOCK (filter);
+	old = quality = filter->quality;
+	if (GST_CLOCK_TIME_IS_VALID (filter->quality_changed) && GST_CLOCK_TIME_IS_VALID (timestamp) &&
+			timestamp >= filter->quality_changed && timestamp < filter->quality_changed + SMOOTHING_QOS_HOLD){
+		// wait for the last change to show
+	}
+	else if ((proportion > SMOOTHING_QOS_DOWN || diff > 0) && quality != GST_SMOOTHINGFILTER_QUALITY_OFF){
+		quality++;
+		if (quality == GST_SMOOTHINGFILTER_QUALITY_3X3 && filter->kernel_3x3 == NULL)
+			quality++;
+	}
+	else if (proportion < SMOOTHING_QOS_UP && diff <= 0 && quality != GST_SMOOTHINGFILTER_QUALITY_FULL){
+		quality--;
+		if (quality == GST_SMOOTHINGFILTER_QUALITY_3X3 && filter->kernel_3x3 == NULL)
+			quality--;
+	}
+	if (quality != old){
+		filter->quality = quality;
+		filter->quality_changed = timestamp;
+	}
+	GST_OBJECT_UNLOCK (filter);
+
+	if (quality != old){
+		GST_INFO_OBJECT (filter, "quality %s, QoS proportion %g jitter %" G_GINT64_FORMAT,
+				qualities[quality].value_nick, proportion, diff);
+		gst_smoothingfilter_update_passthrough(filter);
+		gst_element_post_message(GST_ELEMENT (filter), gst_message_new_element(GST_OBJECT (filter),
+				gst_structure_new("smoothingfilter-qos",
+						"quality", G_TYPE_STRING, qualities[quality].value_nick,
+						"proportion", G_TYPE_DOUBLE, proportion,
+						"jitter", G_TYPE_INT64, diff,
+						"timestamp", G_TYPE_UINT64, timestamp,
+						NULL)));
+	}
+}
 
-			GST_DEBUG_OBJECT (filter, "The video size of this set of capabilities is %dx%d, %d\n",
-					filter->width, filter->height, filter->stride);
-		}
-		else {
-			GST_ERROR_OBJECT (filter, "Caps not fixed.\n");
+static gboolean
+gst_smoothingfilter_src_event (GstBaseTransform * trans, GstEvent * event)
+{
+	Gstsmoothingfilter *filter = GST_SMOOTHINGFILTER (trans);
+
+	if (GST_EVENT_TYPE (event) == GST_EVENT_QOS && filter->adaptive)
+		gst_smoothingfilter_adapt(filter, event);
+
+	// the base class still uses the event to drop frames that are too late
+	return GST_BASE_TRANSFORM_CLASS (parent_class)->src_event (trans, event);
+}
+
+/* Pipelining, for async-depth > 0.
+ * The streaming thread smooths each frame and queues it rather than pushing it, and a task of the src pad
+ * pushes the queue downstream. So the next frame is smoothed while downstream works on this one, and
+ * a downstream element that takes a while now and then does not hold up the smoothing.
+ * Anything that has to stay in order with the frames, serialized events and queries and passthrough
+ * buffers, waits for the queue to empty first.
+ */
+
+// Drop the queued buffers, called with async_lock held
+static void
+gst_smoothingfilter_async_clear (Gstsmoothingfilter *filter)
+{
+	while (!g_queue_is_empty(&filter->async_queue)){
+		gst_buffer_unref(g_queue_pop_head(&filter->async_queue));
+		filter->async_pending--;
+	}
+	g_cond_broadcast(&filter->async_cond);
+}
+
+// The src pad task, pushes one buffer, pauses when flushing or downstream stops taking them
+static void
+gst_smoothingfilter_async_loop (gpointer data)
+{
+	Gstsmoothingfilter *filter = GST_SMOOTHINGFILTER (data);
+	GstPad *srcpad = GST_BASE_TRANSFORM_SRC_PAD (filter);
+	GstBuffer *buffer;
+	GstFlowReturn ret;
+
+	g_mutex_lock(&filter->async_lock);
+	while (g_queue_is_empty(&filter->async_queue) && !filter->async_flushing)
+		g_cond_wait(&filter->async_cond, &filter->async_lock);
+	if (filter->async_flushing){
+		filter->async_running = FALSE;
+		g_mutex_unlock(&filter->async_lock);
+		gst_pad_pause_task(srcpad);
+		return;
+	}
+	buffer = g_queue_pop_head(&filter->async_queue);
+	g_mutex_unlock(&filter->async_lock);
+
+	ret = gst_pad_push(srcpad, buffer);
+
+	g_mutex_lock(&filter->async_lock);
+	filter->async_pending--;
+	if (ret != GST_FLOW_OK){
+		// upstream gets ret for its next frame, and nothing more is pushed until a flush
+		GST_DEBUG_OBJECT (filter, "pausing the task, %s", gst_flow_get_name(ret));
+		filter->async_flow = ret;
+		filter->async_running = FALSE;
+		gst_smoothingfilter_async_clear(filter);
+	}
+	g_cond_broadcast(&filter->async_cond);
+	g_mutex_unlock(&filter->async_lock);
+
+	if (ret != GST_FLOW_OK)
+		gst_pad_pause_task(srcpad);
+}
+
+/* Queue a smoothed buffer for the task, waiting while async-depth buffers are ahead of it, and take it from *buffer
+ * so the base class does not push it too. Returns why it can not be queued if it can not.
+ * With async-depth 0 *buffer is left for the base class to push, once whatever was queued before it has gone.
+ */
+static GstFlowReturn
+gst_smoothingfilter_async_queue (Gstsmoothingfilter *filter, GstBuffer **buffer)
+{
+	GstFlowReturn ret;
+
+	g_mutex_lock(&filter->async_lock);
+	if (filter->async_depth == 0){
+		while (filter->async_pending > 0 && !filter->async_flushing)
+			g_cond_wait(&filter->async_cond, &filter->async_lock);
+		g_mutex_unlock(&filter->async_lock);
+		return GST_FLOW_OK;
+	}
+
+	// async-depth may go down while this waits, it ends up with 0 only once the queue is empty
+	while (filter->async_pending >= filter->async_depth && filter->async_depth > 0 &&
+			filter->async_flow == GST_FLOW_OK && !filter->async_flushing)
+		g_cond_wait(&filter->async_cond, &filter->async_lock);
+
+	ret = filter->async_flushing ? GST_FLOW_FLUSHING : filter->async_flow;
+	if (ret == GST_FLOW_OK && !filter->async_running){
+		GST_DEBUG_OBJECT (filter, "starting the task");
+		filter->async_running = gst_pad_start_task(GST_BASE_TRANSFORM_SRC_PAD (filter),
+				gst_smoothingfilter_async_loop, filter, NULL);
+		if (!filter->async_running){
+			GST_ERROR_OBJECT(filter, "could not start the src pad task.");
+			ret = GST_FLOW_ERROR;
 		}
+	}
+	if (ret == GST_FLOW_OK){
+		g_queue_push_tail(&filter->async_queue, *buffer);
+		filter->async_pending++;
+		g_cond_broadcast(&filter->async_cond);
+	}
+	else
+		gst_buffer_unref(*buffer);
+	*buffer = NULL;
+	g_mutex_unlock(&filter->async_lock);
 
-		/* and forward */
-		ret = gst_pad_event_default (pad, parent, event);
-		break;
+	return ret;
+}
+
+// Wait for the task to push everything queued, so what comes next goes after it
+static void
+gst_smoothingfilter_async_drain (Gstsmoothingfilter *filter)
+{
+	g_mutex_lock(&filter->async_lock);
+	while (filter->async_pending > 0 && !filter->async_flushing)
+		g_cond_wait(&filter->async_cond, &filter->async_lock);
+	g_mutex_unlock(&filter->async_lock);
+}
+
+// Start flushing, and wait for the task to pause
+static void
+gst_smoothingfilter_async_flush (Gstsmoothingfilter *filter, GstPad *srcpad, gboolean stop)
+{
+	g_mutex_lock(&filter->async_lock);
+	filter->async_flushing = TRUE;
+	gst_smoothingfilter_async_clear(filter);
+	g_mutex_unlock(&filter->async_lock);
+
+	if (stop)
+		gst_pad_stop_task(srcpad);
+	else
+		gst_pad_pause_task(srcpad);
+
+	g_mutex_lock(&filter->async_lock);
+	filter->async_running = FALSE;
+	g_mutex_unlock(&filter->async_lock);
+}
+
+// Called with the flushing over, or the pad active again
+static void
+gst_smoothingfilter_async_reset (Gstsmoothingfilter *filter)
+{
+	g_mutex_lock(&filter->async_lock);
+	filter->async_flushing = FALSE;
+	filter->async_flow = GST_FLOW_OK;
+	g_mutex_unlock(&filter->async_lock);
+}
+
+static gboolean
+gst_smoothingfilter_src_activate_mode (GstPad * pad, GstObject * parent, GstPadMode mode, gboolean active)
+{
+	Gstsmoothingfilter *filter = GST_SMOOTHINGFILTER (parent);
+
+	// the pad is already flushing, so the task is not held up by downstream
+	if (active)
+		gst_smoothingfilter_async_reset(filter);
+	else
+		gst_smoothingfilter_async_flush(filter, pad, TRUE);
+
+	return parent_src_activate_mode(pad, parent, mode, active);
+}
+
+/* The base class makes the output buffer and smooths into it, then this queues it and hands back none to push.
+ * Queued frames count as processed ones for the base class's QoS statistics, and do not leave it a DISCONT to set
+ * on the next buffer it pushes itself.
+ */
+static GstFlowReturn
+gst_smoothingfilter_generate_output (GstBaseTransform * trans, GstBuffer ** outbuf)
+{
+	Gstsmoothingfilter *filter = GST_SMOOTHINGFILTER (trans);
+	GstFlowReturn ret;
+
+	ret = GST_BASE_TRANSFORM_CLASS (parent_class)->generate_output (trans, outbuf);
+	if (ret != GST_FLOW_OK || *outbuf == NULL || gst_base_transform_is_passthrough(trans))
+		return ret;
+
+	return gst_smoothingfilter_async_queue(filter, outbuf);
+}
+
+// The base class pushes passthrough buffers itself, behind the queued ones
+static void
+gst_smoothingfilter_before_transform (GstBaseTransform * trans, GstBuffer * buffer)
+{
+	if (gst_base_transform_is_passthrough(trans))
+		gst_smoothingfilter_async_drain(GST_SMOOTHINGFILTER (trans));
+
+	if (GST_BASE_TRANSFORM_CLASS (parent_class)->before_transform)
+		GST_BASE_TRANSFORM_CLASS (parent_class)->before_transform (trans, buffer);
+}
+
+static gboolean
+gst_smoothingfilter_sink_event (GstBaseTransform * trans, GstEvent * event)
+{
+	Gstsmoothingfilter *filter = GST_SMOOTHINGFILTER (trans);
+	gboolean ret;
+
+	// Frames after a flush are not a continuation of the ones before
+	if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP){
+		GST_OBJECT_LOCK (filter);
+		filter->temporal_valid = FALSE;
+		GST_OBJECT_UNLOCK (filter);
 	}
-	case GST_EVENT_EOS:
 
-		/* and forward */
-		ret = gst_pad_event_default (pad, parent, event);
+	// frames may still be queued from before async-depth went to 0, so this is whatever it is now
+	switch (GST_EVENT_TYPE (event)){
+	case GST_EVENT_FLUSH_START:
+		// downstream flushes first, so a push the task is in returns
+		ret = GST_BASE_TRANSFORM_CLASS (parent_class)->sink_event (trans, event);
+		gst_smoothingfilter_async_flush(filter, GST_BASE_TRANSFORM_SRC_PAD (trans), FALSE);
+		return ret;
+	case GST_EVENT_FLUSH_STOP:
+		gst_smoothingfilter_async_reset(filter);
 		break;
 	default:
-		ret = gst_pad_event_default (pad, parent, event);
+		// EOS, caps, segments and the rest go after the frames before them
+		if (GST_EVENT_IS_SERIALIZED (event))
+			gst_smoothingfilter_async_drain(filter);
 		break;
 	}
+
+	return GST_BASE_TRANSFORM_CLASS (parent_class)->sink_event (trans, event);
+}
+
+static gboolean
+gst_smoothingfilter_query (GstBaseTransform * trans, GstPadDirection direction, GstQuery * query)
+{
+	Gstsmoothingfilter *filter = GST_SMOOTHINGFILTER (trans);
+	GstVideoInfo *info = &GST_VIDEO_FILTER (trans)->in_info;
+	GstClockTime min, max, latency;
+	gboolean live;
+	gint depth;
+
+	// an allocation or drain query from upstream is about the frames before it too
+	if (direction == GST_PAD_SINK && GST_QUERY_IS_SERIALIZED (query))
+		gst_smoothingfilter_async_drain(filter);
+
+	if (!GST_BASE_TRANSFORM_CLASS (parent_class)->query (trans, direction, query))
+		return FALSE;
+
+	// A frame can wait behind async-depth others, each pushed a frame duration apart when downstream keeps up
+	// with the stream, so that is added. Without a framerate there is no duration to add.
+	g_mutex_lock(&filter->async_lock);
+	depth = filter->async_depth;
+	g_mutex_unlock(&filter->async_lock);
+	if (direction == GST_PAD_SRC && GST_QUERY_TYPE (query) == GST_QUERY_LATENCY && depth > 0 &&
+			info->fps_n > 0 && info->fps_d > 0){
+		gst_query_parse_latency(query, &live, &min, &max);
+		latency = gst_util_uint64_scale_int(depth * GST_SECOND, info->fps_d, info->fps_n);
+		GST_DEBUG_OBJECT (filter, "adding %" GST_TIME_FORMAT " of latency", GST_TIME_ARGS (latency));
+		min += latency;
+		if (GST_CLOCK_TIME_IS_VALID (max))
+			max += latency;
+		gst_query_set_latency(query, live, min, max);
+	}
+
+	return TRUE;
+}
+
+// An int, or an int range if max is bigger than min
+static void
+gst_smoothingfilter_set_size (GValue *dest, gint min, gint max)
+{
+	if (max > min){
+		g_value_init(dest, GST_TYPE_INT_RANGE);
+		gst_value_set_int_range(dest, min, max);
+	}
+	else {
+		g_value_init(dest, G_TYPE_INT);
+		g_value_set_int(dest, min);
+	}
+}
+
+/* Scale a width or height, an int, an int range or a list of them, from the sink caps to the src caps
+ * or back. Downscaled sizes are rounded up, so going back gives the range of sizes that round to it.
+ * Returns FALSE if value is none of those.
+ */
+static gboolean
+gst_smoothingfilter_scale_size (GValue *dest, const GValue *value, gint factor, GstPadDirection direction)
+{
+	gint min, max;
+
+	if (GST_VALUE_HOLDS_LIST (value)){
+		guint i;
+		g_value_init(dest, GST_TYPE_LIST);
+		for(i=0; i<gst_value_list_get_size(value); i++){
+			GValue scaled = G_VALUE_INIT;
+			if (gst_smoothingfilter_scale_size(&scaled, gst_value_list_get_value(value, i), factor, direction)){
+				gst_value_list_append_value(dest, &scaled);
+				g_value_unset(&scaled);
+			}
+		}
+		return TRUE;
+	}
+
+	if (G_VALUE_HOLDS_INT (value))
+		min = max = g_value_get_int(value);
+	else if (GST_VALUE_HOLDS_INT_RANGE (value)){
+		min = gst_value_get_int_range_min(value);
+		max = gst_value_get_int_range_max(value);
+	}
+	else
+		return FALSE;
+
+	if (direction == GST_PAD_SINK)
+		gst_smoothingfilter_set_size(dest, min / factor + (min % factor != 0), max / factor + (max % factor != 0));
+	else
+		gst_smoothingfilter_set_size(dest, MAX(min - 1, 0) * factor + 1, max > G_MAXINT / factor ? G_MAXINT : max * factor);
+
+	return TRUE;
+}
+
+/* With downscale-factor above 1 the src caps have the sizes divided by it, everything else is the same */
+static GstCaps *
+gst_smoothingfilter_transform_caps (GstBaseTransform * trans, GstPadDirection direction,
+		GstCaps * caps, GstCaps * filter_caps)
+{
+	Gstsmoothingfilter *filter = GST_SMOOTHINGFILTER (trans);
+	static const gchar *sizes[] = { "width", "height" };
+	GstCaps *ret;
+	gint factor;
+	guint i, j;
+
+	GST_OBJECT_LOCK (filter);
+	factor = filter->downscale_factor;
+	GST_OBJECT_UNLOCK (filter);
+
+	ret = gst_caps_copy(caps);
+	for(i=0; factor > 1 && i<gst_caps_get_size(ret); i++){
+		GstStructure *structure = gst_caps_get_structure(ret, i);
+		for(j=0; j<G_N_ELEMENTS (sizes); j++){
+			const GValue *value = gst_structure_get_value(structure, sizes[j]);
+			GValue scaled = G_VALUE_INIT;
+			if (value && gst_smoothingfilter_scale_size(&scaled, value, factor, direction))
+				gst_structure_take_value(structure, sizes[j], &scaled);
+		}
+	}
+
+	if (filter_caps){
+		GstCaps *intersection = gst_caps_intersect_full(filter_caps, ret, GST_CAPS_INTERSECT_FIRST);
+		gst_caps_unref(ret);
+		ret = intersection;
+	}
+
+	GST_DEBUG_OBJECT (filter, "transformed %" GST_PTR_FORMAT " into %" GST_PTR_FORMAT, caps, ret);
+
 	return ret;
 }
 
-/* chain function
- * this function does the actual processing
+// Ask for every row of a pool's buffers to start on a SMOOTHING_ROW_ALIGN byte boundary
+static void
+gst_smoothingfilter_config_set_alignment (GstStructure *config)
+{
+	GstVideoAlignment align;
+	guint p;
+
+	gst_video_alignment_reset(&align);
+	for(p=0; p<GST_VIDEO_MAX_PLANES; p++)
+		align.stride_align[p] = SMOOTHING_ROW_ALIGN - 1;
+
+	gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+	gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_VIDEO_ALIGNMENT);
+	gst_buffer_pool_config_set_video_alignment(config, &align);
+}
+
+/* Upstream may give us buffers with any strides and plane offsets, as long as it describes them with a GstVideoMeta.
+ * If it wants a pool, offer one with aligned rows so a capture source can hand its buffers straight over.
  */
-static GstFlowReturn
-gst_smoothingfilter_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+static gboolean
+gst_smoothingfilter_propose_allocation (GstBaseTransform * trans, GstQuery * decide_query, GstQuery * query)
+{
+	GstBufferPool *pool;
+	GstStructure *config;
+	GstVideoInfo info;
+	GstCaps *caps;
+	gboolean need_pool;
+	guint size;
+
+	// Passing through, downstream decides
+	if (decide_query == NULL)
+		return GST_BASE_TRANSFORM_CLASS (parent_class)->propose_allocation (trans, decide_query, query);
+
+	gst_query_parse_allocation(query, &caps, &need_pool);
+	if (caps == NULL || !gst_video_info_from_caps(&info, caps))
+		return FALSE;
+
+	gst_query_add_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL);
+
+	if (need_pool){
+		pool = gst_video_buffer_pool_new();
+		config = gst_buffer_pool_get_config(pool);
+		gst_buffer_pool_config_set_params(config, caps, GST_VIDEO_INFO_SIZE (&info), 0, 0);
+		gst_smoothingfilter_config_set_alignment(config);
+		if (!gst_buffer_pool_set_config(pool, config)){
+			GST_WARNING_OBJECT (trans, "could not configure the pool to offer upstream");
+			gst_object_unref(pool);
+			return FALSE;
+		}
+
+		// the pool grows its buffers for the padding
+		config = gst_buffer_pool_get_config(pool);
+		gst_buffer_pool_config_get_params(config, NULL, &size, NULL, NULL);
+		gst_structure_free(config);
+
+		gst_query_add_allocation_pool(query, pool, size, 0, 0);
+		gst_object_unref(pool);
+	}
+
+	return TRUE;
+}
+
+/* Output buffers come from downstream's pool where there is one, ask it for aligned rows if it can do them */
+static gboolean
+gst_smoothingfilter_decide_allocation (GstBaseTransform * trans, GstQuery * query)
+{
+	GstBufferPool *pool = NULL;
+	GstStructure *config;
+	GstCaps *caps;
+	guint size, min, max;
+
+	if (gst_query_get_n_allocation_pools(query) > 0){
+		gst_query_parse_nth_allocation_pool(query, 0, &pool, &size, &min, &max);
+		if (pool && gst_buffer_pool_has_option(pool, GST_BUFFER_POOL_OPTION_VIDEO_ALIGNMENT) &&
+				gst_query_find_allocation_meta(query, GST_VIDEO_META_API_TYPE, NULL)){
+			config = gst_buffer_pool_get_config(pool);
+			gst_buffer_pool_config_get_params(config, &caps, NULL, NULL, NULL);
+			gst_buffer_pool_config_set_params(config, caps, size, min, max);
+			gst_smoothingfilter_config_set_alignment(config);
+			if (gst_buffer_pool_set_config(pool, config)){
+				config = gst_buffer_pool_get_config(pool);
+				gst_buffer_pool_config_get_params(config, NULL, &size, NULL, NULL);
+				gst_structure_free(config);
+				gst_query_set_nth_allocation_pool(query, 0, pool, size, min, max);
+			}
+			else
+				GST_DEBUG_OBJECT (trans, "downstream pool would not align its rows");
+		}
+		if (pool)
+			gst_object_unref(pool);
+	}
+
+	return GST_BASE_TRANSFORM_CLASS (parent_class)->decide_allocation (trans, query);
+}
+
+/* GstVideoFilter vmethod implementations */
+
+/* this function is called with the negotiated caps */
+static gboolean
+gst_smoothingfilter_set_info (GstVideoFilter * vfilter, GstCaps * incaps,
+		GstVideoInfo * in_info, GstCaps * outcaps, GstVideoInfo * out_info)
 {
-	Gstsmoothingfilter *filter;
-	GstMapInfo minfo;
+	Gstsmoothingfilter *filter = GST_SMOOTHINGFILTER (vfilter);
+
+	gint factor;
+
+	filter->width = GST_VIDEO_INFO_WIDTH (in_info);
+	filter->height = GST_VIDEO_INFO_HEIGHT (in_info);
+
+	GST_OBJECT_LOCK (filter);
+	filter->temporal_valid = FALSE;
+	factor = filter->downscale_factor;
+	GST_OBJECT_UNLOCK (filter);
+
+	// The caps may have been negotiated before downscale-factor last changed, the sizes say which factor they have
+	if (GST_VIDEO_INFO_WIDTH (out_info) == filter->width && GST_VIDEO_INFO_HEIGHT (out_info) == filter->height)
+		filter->downscale = 1;
+	else if (GST_VIDEO_INFO_WIDTH (out_info) == (filter->width + factor - 1) / factor &&
+			GST_VIDEO_INFO_HEIGHT (out_info) == (filter->height + factor - 1) / factor)
+		filter->downscale = factor;
+	else {
+		GST_ERROR_OBJECT (filter, "Can not downscale %dx%d to %dx%d", filter->width, filter->height,
+				GST_VIDEO_INFO_WIDTH (out_info), GST_VIDEO_INFO_HEIGHT (out_info));
+		return FALSE;
+	}
 
-	filter = GST_SMOOTHINGFILTER (parent);
+	if (GST_VIDEO_INFO_COMP_DEPTH (in_info, 0) > 8){
+		gboolean swapped = GST_VIDEO_FORMAT_INFO_IS_LE (in_info->finfo) != (G_BYTE_ORDER == G_LITTLE_ENDIAN);
+		if (!filter->lut16 || filter->lut16_swapped != swapped){
+			GST_OBJECT_LOCK (filter);
+			filter->lut16 = TRUE;
+			filter->lut16_swapped = swapped;
+			GST_OBJECT_UNLOCK (filter);
+			gst_smoothingfilter_update_kernel(filter);
+		}
+	}
 
-	double *forward_gamma = filter->forward_gamma;
-	unsigned int *inverse_gamma = filter->inverse_gamma;
+	// The layout of the planes, the line strides and the offsets come with each frame, from its GstVideoMeta if it has one
+	GST_DEBUG_OBJECT (filter, "The video size of this set of capabilities is %dx%d, %s",
+			filter->width, filter->height, GST_VIDEO_INFO_NAME (in_info));
 
-	unsigned int out_limit = OUT_RANGE - 1;
-	unsigned int in_limit = IN_RANGE - 1;
+	return TRUE;
+}
 
-	if (filter->kernelsize==0){
-//		GST_DEBUG_OBJECT (filter, "No smoothing to do, push source buffer.");
+/* Calculate a Gaussian kernel of size 2*kernelsize+1 and everything the engines derive from it.
+ * Called from set_property, never from the streaming thread.
+ */
+static GstSmoothingFilterKernel *
+gst_smoothingfilter_kernel_new (Gstsmoothingfilter *filter, gint kernelsize, gfloat sigma, gfloat sigma_range,
+		SmoothingLut *gamma, SmoothingLut *identity, SmoothingLut *gamma16)
+{
+	GstSmoothingFilterKernel *kernel;
+	gint i, j;
+	gint s = 2*kernelsize+1;
+	double sum;
+
+	kernel = g_new0(GstSmoothingFilterKernel, 1);
+	kernel->ref_count = 1;
+	kernel->kernelsize = kernelsize;
+	kernel->sigma = sigma;
+	kernel->sigma_range = sigma_range;
+	kernel->gamma = smoothing_lut_ref(gamma);
+	kernel->identity = smoothing_lut_ref(identity);
+	kernel->gamma16 = gamma16 ? smoothing_lut_ref(gamma16) : NULL;
+	kernel->kernel2d = g_new(float, s*s);
+	kernel->kernel1d = g_new(float, s);
+	kernel->kernel1d_even = g_new(float, s+1);
+	kernel->kernel2d_q = g_new(gint16, s*s);
+	kernel->kernel1d_q = g_new(gint16, s);
+
+	// calculate kernel values according to 2d Gaussian curve
+	sum=0;
+	for(i=0; i<s; i++){
+		for(j=0; j<s; j++){
+			gint ii = i-kernelsize;
+			gint jj = j-kernelsize;
+			double f = exp(-(ii*ii+jj*jj)/(sigma*sigma));
+			kernel->kernel2d[i*s+j] = f;
+			sum += f;
+		}
+	}
+	// We do not want the brightness to change so normalise the kernel to sum to 1
+	for(i=0; i<s*s; i++)
+		kernel->kernel2d[i] /= sum;
+
+	// The 2D kernel is the outer product of this 1D kernel with itself
+	sum=0;
+	for(i=0; i<s; i++){
+		gint ii = i-kernelsize;
+		kernel->kernel1d[i] = exp(-(ii*ii)/(sigma*sigma));
+		sum += kernel->kernel1d[i];
 	}
-	else{
+	for(i=0; i<s; i++)
+		kernel->kernel1d[i] /= sum;
+
+	// The same Gaussian sampled half way between pixels, for the middle of an even number of them
+	sum=0;
+	for(i=0; i<s+1; i++){
+		double ii = i-kernelsize-0.5;
+		kernel->kernel1d_even[i] = exp(-(ii*ii)/(sigma*sigma));
+		sum += kernel->kernel1d_even[i];
+	}
+	for(i=0; i<s+1; i++)
+		kernel->kernel1d_even[i] /= sum;
+
+	smoothing_quantise_kernel(kernel->kernel2d_q, kernel->kernel2d, s*s);
+	smoothing_quantise_kernel(kernel->kernel1d_q, kernel->kernel1d, s);
+
+	// Small kernels get the weights folded into the forward gamma lut, for the direct method without SIMD
+	if (kernelsize <= SMOOTHING_WEIGHTED_MAX_KERNELSIZE){
+		gint n_weights;
+		kernel->weighted_gamma = g_new(float, s*s*SMOOTHING_WEIGHTED_LUT_SIZE);
+		kernel->weight_index = g_new(guint8, s*s);
+		n_weights = smoothing_weighted_gamma_build(kernel->weighted_gamma, kernel->weight_index,
+				kernel->kernel2d, s*s, kernel->gamma->forward);
+		GST_DEBUG_OBJECT(filter, "%d weighted gamma luts", n_weights);
+	}
+
+	smoothing_iir_coefficients(&kernel->iir, sigma);
+
+	kernel->range_weight = g_new(float, SMOOTHING_RANGE_LUT_SIZE);
+	smoothing_range_weights(kernel->range_weight, sigma_range);
 
-		// Access the buffer - READ AND WRITE
-		gst_buffer_map (buf, &minfo, GST_MAP_READWRITE);
+	GST_DEBUG_OBJECT(filter, "Smoothing kernel calculated: kernelsize %d sigma %f, centre weight %f",
+			kernelsize, sigma, kernel->kernel2d[kernelsize*s+kernelsize]);
 
-		bgr_pixel *ptr=NULL;
-		gint x, y, i, j;
-		gint s = 2*filter->kernelsize+1;
-		gint start_y = 0;
-		gint stop_y  = filter->height;
-		gint start_x = 0;
-		gint stop_x  = filter->width;
+	return kernel;
+}
+
+static GstSmoothingFilterKernel *
+gst_smoothingfilter_kernel_ref (GstSmoothingFilterKernel *kernel)
+{
+	g_atomic_int_inc(&kernel->ref_count);
+	return kernel;
+}
+
+static void
+gst_smoothingfilter_kernel_unref (GstSmoothingFilterKernel *kernel)
+{
+	if (kernel == NULL || !g_atomic_int_dec_and_test(&kernel->ref_count))
+		return;
+
+	g_free(kernel->kernel2d);
+	g_free(kernel->kernel1d);
+	g_free(kernel->kernel1d_even);
+	g_free(kernel->kernel2d_q);
+	g_free(kernel->kernel1d_q);
+	g_free(kernel->weighted_gamma);
+	g_free(kernel->weight_index);
+	g_free(kernel->range_weight);
+	smoothing_lut_unref(kernel->gamma);
+	smoothing_lut_unref(kernel->identity);
+	smoothing_lut_unref(kernel->gamma16);
+	g_free(kernel);
+}
 
-		guint8 *img_ptr = minfo.data;
-		gint pitch = filter->stride / 3;  // want the number of pixels to next line
+/* A kernel from the cache, moved to the front, or a new one added to it. Called without the object lock,
+ * new kernels are calculated outside it.
+ */
+static GstSmoothingFilterKernel *
+gst_smoothingfilter_find_kernel (Gstsmoothingfilter *filter, gint kernelsize, gfloat sigma, gfloat sigma_range,
+		SmoothingLut *gamma, SmoothingLut *identity, SmoothingLut *gamma16)
+{
+	GstSmoothingFilterKernel *kernel = NULL;
+	GList *l;
+
+	GST_OBJECT_LOCK (filter);
+	for(l=filter->kernel_cache.head; l; l=l->next){
+		GstSmoothingFilterKernel *cached = l->data;
+		if (cached->kernelsize == kernelsize && cached->sigma == sigma && cached->sigma_range == sigma_range &&
+				cached->gamma == gamma && cached->identity == identity && cached->gamma16 == gamma16){
+			kernel = gst_smoothingfilter_kernel_ref(cached);
+			// most recently used first
+			g_queue_unlink(&filter->kernel_cache, l);
+			g_queue_push_head_link(&filter->kernel_cache, l);
+			break;
+		}
+	}
+	GST_OBJECT_UNLOCK (filter);
 
-//		GST_DEBUG_OBJECT(filter, "filter->valchanged = %d", filter->valchanged);
-		// If a parameter has changed, recalculate and store the kernel
-		if (filter->valchanged){
-			GST_DEBUG_OBJECT(filter, "malloc kernel");
+	if (kernel == NULL){
+		kernel = gst_smoothingfilter_kernel_new(filter, kernelsize, sigma, sigma_range, gamma, identity, gamma16);
+
+		GST_OBJECT_LOCK (filter);
+		g_queue_push_head(&filter->kernel_cache, gst_smoothingfilter_kernel_ref(kernel));
+		while (g_queue_get_length(&filter->kernel_cache) > SMOOTHING_KERNEL_CACHE_SIZE)
+			gst_smoothingfilter_kernel_unref(g_queue_pop_tail(&filter->kernel_cache));
+		GST_OBJECT_UNLOCK (filter);
+	}
+
+	return kernel;
+}
 
-			g_free(filter->smoothing_buffer);   // no need to check for NULL
-			filter->smoothing_buffer = (float *)g_malloc(s*s*sizeof(float));
+/* Make the kernel for the current kernelsize, sigma, sigma-range, gamma and lut precision the one the streaming thread uses.
+ * Recently used kernels are kept, so moving a slider back and forth does not recalculate them.
+ * The luts and kernel are built without holding the object lock, the streaming thread only takes the lock to
+ * ref filter->kernel, so it never waits for a calculation and never sees a half built kernel.
+ * With adaptive=true the 3x3 kernel QoS can fall back to is made at the same time, unless the method is iir.
+ */
+static void
+gst_smoothingfilter_update_kernel (Gstsmoothingfilter *filter)
+{
+	GstSmoothingFilterKernel *kernel, *kernel_3x3 = NULL, *old, *old_3x3;
+	SmoothingLut *gamma, *identity, *gamma16 = NULL;
+	gint kernelsize, precision;
+	gboolean adaptive, lut16, lut16_swapped, iir;
+	gfloat sigma, sigma_range;
+	gdouble gamma_value;
+
+	GST_OBJECT_LOCK (filter);
+	kernelsize = filter->kernelsize;
+	sigma = filter->sigma;
+	sigma_range = filter->sigma_range;
+	precision = filter->lut_precision;
+	adaptive = filter->adaptive;
+	iir = filter->method == GST_SMOOTHINGFILTER_METHOD_IIR;
+	gamma_value = filter->gamma;
+	lut16 = filter->lut16;
+	lut16_swapped = filter->lut16_swapped;
+	GST_OBJECT_UNLOCK (filter);
+
+	// the luts can take a while to calculate too, the 16 bit inverse has up to 2^LUT_PRECISION16_MAX entries
+	gamma = smoothing_lut_get(gamma_value, OFFSET, 8, precision, FALSE);
+	identity = smoothing_lut_get(1.0, 0.0, 8, precision, FALSE);
+	if (lut16)
+		gamma16 = smoothing_lut_get(gamma_value, OFFSET, 16, MIN(precision+8, LUT_PRECISION16_MAX), lut16_swapped);
+
+	kernel = gst_smoothingfilter_find_kernel(filter, kernelsize, sigma, sigma_range, gamma, identity, gamma16);
+	// iir costs the same whatever the kernelsize, so QoS goes straight to passthrough
+	if (adaptive && kernelsize > 1 && !iir)
+		kernel_3x3 = gst_smoothingfilter_find_kernel(filter, 1, sigma, sigma_range, gamma, identity, gamma16);
+
+	GST_OBJECT_LOCK (filter);
+	old = filter->kernel;
+	old_3x3 = filter->kernel_3x3;
+	filter->kernel = kernel;
+	filter->kernel_3x3 = kernel_3x3;
+	GST_OBJECT_UNLOCK (filter);
+
+	gst_smoothingfilter_kernel_unref(old);
+	gst_smoothingfilter_kernel_unref(old_3x3);
+	smoothing_lut_unref(gamma);
+	smoothing_lut_unref(identity);
+	smoothing_lut_unref(gamma16);
+}
+
+
+// For the engine stat
+static const gchar *
+gst_smoothingfilter_engine_name (SmoothingEngineFunc engine)
+{
+	if (engine == smoothing_direct)
+		return "direct";
+	if (engine == smoothing_direct_fixed)
+		return "direct-fixed";
+	if (engine == smoothing_direct_weighted)
+		return "direct-weighted";
+	if (engine == smoothing_separable)
+		return "separable";
+	if (engine == smoothing_separable_fixed)
+		return "separable-fixed";
+	if (engine == smoothing_iir_rows)
+		return "iir";
+	if (engine == smoothing_downscale)
+		return "downscale";
+	if (engine == smoothing_bilateral)
+		return "bilateral";
+	if (engine == smoothing_bilateral_separable)
+		return "bilateral-separable";
+	return "unknown";
+}
+
+static void
+gst_smoothingfilter_run_stripe (gpointer task, gpointer user_data)
+{
+	const SmoothingJob *job = (const SmoothingJob *)user_data;
+
+	job->engine(job, (SmoothingStripe *)task);
+}
+
+/* Split the plane into bands, at most one per thread, and get each band's buffers ready.
+ * Returns the number of bands, 0 if a buffer could not be allocated.
+ */
+static gint
+gst_smoothingfilter_prepare_stripes (Gstsmoothingfilter *filter, const SmoothingJob *job)
+{
+	gint n_threads = filter->n_threads > 0 ? filter->n_threads : (gint)g_get_num_processors();
+	gboolean shared = filter->pool_mode == GST_SMOOTHINGFILTER_POOL_SHARED;
+	gint height = job->factor > 1 ? job->out_height : job->height;   // the rows the engine writes
+	gint min_height = MAX(MIN_STRIPE_HEIGHT, 2*(2*job->kernelsize+1));
+	gint n_stripes = CLAMP(height / min_height, 1, n_threads);
+	gint row_len = job->width*job->comp;
+	gint i;
+
+	if (filter->pool && smoothing_pool_is_shared(filter->pool) != shared){
+		smoothing_pool_free(filter->pool);
+		filter->pool = NULL;
+	}
+	if (shared){
+		if (!filter->pool){
+			filter->pool = smoothing_pool_get_shared();
+			GST_DEBUG_OBJECT(filter, "Using the shared pool of %d threads", smoothing_pool_get_n_threads(filter->pool));
+		}
+	}
+	else if (!filter->pool || smoothing_pool_get_n_threads(filter->pool) != n_threads){
+		GST_DEBUG_OBJECT(filter, "Starting %d threads", n_threads);
+		smoothing_pool_free(filter->pool);
+		filter->pool = smoothing_pool_new(n_threads);
+	}
+
+	if (filter->n_stripes != n_threads){
+		gst_smoothingfilter_free_stripes(filter);
+		filter->stripes = g_new0(SmoothingStripe, n_threads);
+		filter->n_stripes = n_threads;
+	}
+
+	for(i=0; i<n_stripes; i++){
+		SmoothingStripe *stripe = &filter->stripes[i];
+
+		stripe->y0 = height * i / n_stripes;
+		stripe->y1 = height * (i+1) / n_stripes;
+		// Column bands start on a 64 byte boundary of floats so neighbouring bands do not share cache lines
+		stripe->x0 = (row_len * i / n_stripes) & ~15;
+		stripe->x1 = i == n_stripes-1 ? row_len : (row_len * (i+1) / n_stripes) & ~15;
+
+		if (!smoothing_scratch_ensure(&stripe->scratch, job))
+			return 0;
+
+		// In-place the neighbouring bands overwrite the rows around this one,
+		// the iir engine reads every input row before it writes any
+		if (job->src == job->dst && n_stripes > 1 && job->engine != smoothing_iir_rows){
+			if (!smoothing_stripe_save_halo(job, stripe))
+				return 0;
+		}
+		else if (stripe->halo){
+			g_free(stripe->halo);
+			stripe->halo = NULL;
+			stripe->halo_size = 0;
+		}
+	}
+
+	return n_stripes;
+}
 
-			if(!filter->smoothing_buffer){
-				GST_ERROR_OBJECT(filter, "malloc kernel failed.");
-				return gst_pad_push (filter->srcpad, buf);
+/* Work out which components of the format are smoothed and how they are grouped into planes for the engines.
+ * Components that share a plane and fill every pixel of it between them (RGB, the UV of NV12) are smoothed together.
+ * The chroma of YUV formats is only smoothed if chroma is set.
+ * Sets a bit in *copy for each plane of the frame that has components left as they are.
+ * Returns the number of planes to smooth.
+ */
+static gint
+gst_smoothingfilter_get_planes (Gstsmoothingfilter *filter, const GstVideoInfo *info, gboolean chroma,
+		GstSmoothingFilterPlane *planes, guint *copy)
+{
+	const GstVideoFormatInfo *finfo = info->finfo;
+	gboolean yuv = GST_VIDEO_FORMAT_INFO_IS_YUV (finfo);
+	gint n_planes = 0;
+	guint p;
+	gint c;
+
+	*copy = 0;
+
+	for(p=0; p<GST_VIDEO_INFO_N_PLANES (info); p++){
+		gint comps[GST_VIDEO_MAX_COMPONENTS];
+		gint n_comps = 0, n_in_plane = 0, first = -1, depth = 1;
+		gboolean adjacent = TRUE;
+
+		for(c=0; c<(gint)GST_VIDEO_FORMAT_INFO_N_COMPONENTS (finfo); c++){
+			if (GST_VIDEO_FORMAT_INFO_PLANE (finfo, c) != p)
+				continue;
+			n_in_plane++;
+			if (yuv && c > 0 && !chroma)
+				continue;   // the luma is component 0 of every YUV format
+			comps[n_comps++] = c;
+			if (GST_VIDEO_FORMAT_INFO_DEPTH (finfo, c) > 8)
+				depth = 2;
+			if (first < 0 || GST_VIDEO_FORMAT_INFO_POFFSET (finfo, c) < GST_VIDEO_FORMAT_INFO_POFFSET (finfo, first))
+				first = c;
+		}
+
+		if (n_comps < n_in_plane)
+			*copy |= 1 << p;
+		if (n_comps == 0)
+			continue;
+
+		for(c=0; c<n_comps; c++){
+			if (GST_VIDEO_FORMAT_INFO_PSTRIDE (finfo, comps[c]) != n_comps*depth ||
+					GST_VIDEO_FORMAT_INFO_POFFSET (finfo, comps[c]) - GST_VIDEO_FORMAT_INFO_POFFSET (finfo, first) >= n_comps*depth)
+				adjacent = FALSE;
+		}
+
+		if (adjacent){
+			planes[n_planes].component = first;
+			planes[n_planes].comp = n_comps;
+			planes[n_planes].linear_light = !yuv || first == 0;
+			planes[n_planes].depth = depth;
+			n_planes++;
+		}
+		else {
+			// Interleaved with components that are not smoothed, or with different subsampling (YUY2)
+			for(c=0; c<n_comps; c++){
+				planes[n_planes].component = comps[c];
+				planes[n_planes].comp = 1;
+				planes[n_planes].linear_light = !yuv || comps[c] == 0;
+				planes[n_planes].depth = depth;
+				n_planes++;
 			}
+		}
+	}
+
+	return n_planes;
+}
 
-			GST_DEBUG_OBJECT(filter, "Smoothing kernel calculations: kernelsize %d sigma %f", filter->kernelsize, filter->sigma);
-
-			// calculate kernel values according to 2d Gaussian curve
-			double sum=0;
-			for(i=0; i<s; i++){
-				for(j=0; j<s; j++){
-					gint ii = i-filter->kernelsize;
-					gint jj = j-filter->kernelsize;
-					double f = exp(-(ii*ii+jj*jj)/(filter->sigma*filter->sigma));
-					filter->smoothing_buffer[i*s+j] = f;
-					sum += f;
-				}
+/* Smooth one plane */
+static gboolean
+gst_smoothingfilter_run_job (Gstsmoothingfilter *filter, SmoothingJob *job)
+{
+	gint n_stripes;
+
+	if (job->engine == smoothing_iir_rows){
+		gsize size = (gsize)job->width*job->comp*job->height*sizeof(float);
+		if (filter->iir_buffer_size < size){
+			g_free(filter->iir_buffer);
+			filter->iir_buffer = (float *)g_malloc(size);
+			filter->iir_buffer_size = filter->iir_buffer ? size : 0;
+			if (!filter->iir_buffer){
+				GST_ERROR_OBJECT(filter, "malloc iir buffer failed.");
+				return FALSE;
 			}
-			// We do not want the brightness to change so normalise the kernel to sum to 1
-			for(i=0; i<s; i++){
-				for(j=0; j<s; j++){
-					filter->smoothing_buffer[i*s+j] /= sum;
-					GST_DEBUG_OBJECT(filter, "Smoothing kernel %d %d: %f", i, j, filter->smoothing_buffer[i*s+j]);
-				}
+		}
+		job->iir_buffer = filter->iir_buffer;
+	}
+
+	n_stripes = gst_smoothingfilter_prepare_stripes(filter, job);
+	if (!n_stripes){
+		GST_ERROR_OBJECT(filter, "malloc scratch failed.");
+		return FALSE;
+	}
+
+	smoothing_pool_run(filter->pool, gst_smoothingfilter_run_stripe, filter->stripes, sizeof(SmoothingStripe),
+			n_stripes, job);
+	if (job->engine2){
+		job->engine = job->engine2;
+		smoothing_pool_run(filter->pool, gst_smoothingfilter_run_stripe, filter->stripes, sizeof(SmoothingStripe),
+				n_stripes, job);
+	}
+
+	return TRUE;
+}
+
+// Where one rectangle of a plane is smoothed from and to
+typedef struct {
+	gint x0, y0, x1, y1;     // the rectangle, in pixels of the plane
+	gint hx0, hy0, hx1, hy1; // with the halo, the part of the plane that is smoothed
+	gsize offset;            // of the smoothed halo rectangle in roi_buffer
+	gint stride;
+} GstSmoothingFilterRectJob;
+
+/* Smooth only the rectangles of a plane. Each one is smoothed with a halo of the pixels around it
+ * into roi_buffer, and only copied to the output once all of them are done, so in-place one rectangle
+ * never sees another's smoothed pixels. The rest of the plane is left as it is. component gives the
+ * subsampling of the plane, halo is the kernel's reach in pixels.
+ */
+static gboolean
+gst_smoothingfilter_run_rects (Gstsmoothingfilter *filter, const SmoothingJob *plane, GArray *rects,
+		const GstVideoFormatInfo *finfo, gint component, gint halo)
+{
+	gint w_sub = GST_VIDEO_FORMAT_INFO_W_SUB (finfo, component);
+	gint h_sub = GST_VIDEO_FORMAT_INFO_H_SUB (finfo, component);
+	gint bytes = plane->comp*plane->depth;
+	GstSmoothingFilterRectJob *jobs = g_new(GstSmoothingFilterRectJob, rects->len ? rects->len : 1);
+	gboolean ok = TRUE;
+	gsize size = 0;
+	guint r;
+	gint y;
+
+	for(r=0; r<rects->len; r++){
+		const GstSmoothingFilterRect *rect = &g_array_index(rects, GstSmoothingFilterRect, r);
+		GstSmoothingFilterRectJob *rj = &jobs[r];
+
+		rj->x0 = CLAMP(rect->x >> w_sub, 0, plane->width);
+		rj->y0 = CLAMP(rect->y >> h_sub, 0, plane->height);
+		rj->x1 = CLAMP(-((-(rect->x + rect->width)) >> w_sub), rj->x0, plane->width);   // rounded up
+		rj->y1 = CLAMP(-((-(rect->y + rect->height)) >> h_sub), rj->y0, plane->height);
+		rj->hx0 = MAX(rj->x0 - halo, 0);
+		rj->hy0 = MAX(rj->y0 - halo, 0);
+		rj->hx1 = MIN(rj->x1 + halo, plane->width);
+		rj->hy1 = MIN(rj->y1 + halo, plane->height);
+		rj->stride = GST_ROUND_UP_N((rj->hx1 - rj->hx0) * plane->pstride, SMOOTHING_ROW_ALIGN);
+		rj->offset = size;
+		if (rj->x1 > rj->x0 && rj->y1 > rj->y0)
+			size += (gsize)rj->stride * (rj->hy1 - rj->hy0);
+	}
+
+	if (filter->roi_buffer_size < size){
+		g_free(filter->roi_buffer);
+		filter->roi_buffer = (guint8 *)g_malloc(size);
+		filter->roi_buffer_size = filter->roi_buffer ? size : 0;
+		if (!filter->roi_buffer){
+			GST_ERROR_OBJECT(filter, "malloc roi buffer failed.");
+			g_free(jobs);
+			return FALSE;
+		}
+	}
+
+	for(r=0; r<rects->len && ok; r++){
+		GstSmoothingFilterRectJob *rj = &jobs[r];
+		SmoothingJob job = *plane;
+
+		if (rj->x1 <= rj->x0 || rj->y1 <= rj->y0)
+			continue;
+		job.src = plane->src + (gsize)rj->hy0*plane->src_stride + rj->hx0*plane->pstride;
+		job.dst = filter->roi_buffer + rj->offset;
+		job.dst_stride = rj->stride;
+		job.width = rj->hx1 - rj->hx0;
+		job.height = rj->hy1 - rj->hy0;
+		ok = gst_smoothingfilter_run_job(filter, &job);
+	}
+
+	for(r=0; r<rects->len && ok; r++){
+		GstSmoothingFilterRectJob *rj = &jobs[r];
+
+		if (rj->x1 <= rj->x0 || rj->y1 <= rj->y0)
+			continue;
+		for(y=rj->y0; y<rj->y1; y++)
+			smoothing_copy_pixels(plane->dst + (gsize)y*plane->dst_stride + rj->x0*plane->pstride,
+					filter->roi_buffer + rj->offset + (gsize)(y - rj->hy0)*rj->stride + (rj->x0 - rj->hx0)*plane->pstride,
+					rj->x1 - rj->x0, bytes, plane->pstride);
+	}
+
+	g_free(jobs);
+
+	return ok;
+}
+
+/* Get the running average ready for a frame's planes, laid out one after another.
+ * *init is set if it does not hold the earlier frames, so this frame has to start it.
+ */
+static gboolean
+gst_smoothingfilter_ensure_temporal (Gstsmoothingfilter *filter, const GstVideoFrame *frame,
+		const GstSmoothingFilterPlane *planes, gint n_planes, gboolean *init)
+{
+	gsize used = 0;
+	gint i;
+
+	for(i=0; i<n_planes; i++){
+		gint c = planes[i].component;
+		used += (gsize)GST_VIDEO_FRAME_COMP_WIDTH (frame, c) * planes[i].comp * GST_VIDEO_FRAME_COMP_HEIGHT (frame, c);
+	}
+
+	if (filter->temporal_size < used*sizeof(float)){
+		g_free(filter->temporal);
+		filter->temporal = (float *)g_malloc(used*sizeof(float));
+		filter->temporal_size = filter->temporal ? used*sizeof(float) : 0;
+		if (!filter->temporal){
+			GST_ERROR_OBJECT(filter, "malloc temporal buffer failed.");
+			return FALSE;
+		}
+	}
+
+	GST_OBJECT_LOCK (filter);
+	*init = !filter->temporal_valid || filter->temporal_used != used;
+	GST_OBJECT_UNLOCK (filter);
+	filter->temporal_used = used;
+
+	return TRUE;
+}
+
+// The bytes of each row of plane p that hold pixels, the plane's rows and their vertical subsampling
+static void
+gst_smoothingfilter_plane_rows (const GstVideoFrame *frame, guint p, gsize *row_bytes, gint *rows, gint *h_sub)
+{
+	const GstVideoFormatInfo *finfo = frame->info.finfo;
+	gint c;
+
+	*row_bytes = 0;
+	*rows = 0;
+	*h_sub = 0;
+	for(c=0; c<(gint)GST_VIDEO_FORMAT_INFO_N_COMPONENTS (finfo); c++){
+		gsize bytes;
+
+		if (GST_VIDEO_FORMAT_INFO_PLANE (finfo, c) != p)
+			continue;
+		bytes = GST_VIDEO_FORMAT_INFO_POFFSET (finfo, c) +
+				(gsize)(GST_VIDEO_FRAME_COMP_WIDTH (frame, c) - 1) * GST_VIDEO_FORMAT_INFO_PSTRIDE (finfo, c) +
+				(GST_VIDEO_FORMAT_INFO_DEPTH (finfo, c) > 8 ? 2 : 1);
+		*row_bytes = MAX(*row_bytes, bytes);
+		*rows = GST_VIDEO_FRAME_COMP_HEIGHT (frame, c);
+		*h_sub = GST_VIDEO_FORMAT_INFO_H_SUB (finfo, c);
+	}
+}
+
+/* For skip-static, compare the frame with the last one row by row and keep its changed rows for the next.
+ * *rects is set to the bands of frame rows that changed, widened by the rows the kernel reaches, as full width
+ * rectangles for gst_smoothingfilter_run_rects(). An empty array if nothing changed, NULL if the whole frame
+ * has to be smoothed, because there is no last frame to go on or most of it changed.
+ * The output of every frame has to be kept with gst_smoothingfilter_static_keep() after.
+ */
+static gboolean
+gst_smoothingfilter_static_rects (Gstsmoothingfilter *filter, const GstVideoFrame *src,
+		const GstSmoothingFilterKernel *kernel, GArray **rects)
+{
+	GstSmoothingFilterStaticKey key;
+	gint width = GST_VIDEO_FRAME_WIDTH (src);
+	gint height = GST_VIDEO_FRAME_HEIGHT (src);
+	gint n_bands = (height + SMOOTHING_STATIC_BAND - 1) / SMOOTHING_STATIC_BAND;
+	gboolean *changed;
+	gsize used = 0, offset = 0, row_bytes;
+	gint rows, h_sub, max_sub = 0, halo, n_rows = 0;
+	guint p, r;
+	gint y, b;
+
+	*rects = NULL;
+
+	memset(&key, 0, sizeof(key));   // compared with memcmp
+	key.format = GST_VIDEO_FRAME_FORMAT (src);
+	key.width = width;
+	key.height = height;
+	key.kernelsize = kernel->kernelsize;
+	key.sigma = kernel->sigma;
+	key.sigma_range = kernel->sigma_range;
+	key.gamma = kernel->gamma->gamma;
+	key.lut_bits = kernel->gamma->out_bits;
+	key.method = filter->method;
+	key.fixed_point = filter->fixed_point;
+	key.simd = filter->simd;
+	key.chroma = filter->chroma;
+
+	for(p=0; p<GST_VIDEO_FRAME_N_PLANES (src); p++){
+		gst_smoothingfilter_plane_rows(src, p, &row_bytes, &rows, &h_sub);
+		used += row_bytes * rows;
+		max_sub = MAX(max_sub, h_sub);
+	}
+
+	if (filter->static_size < used){
+		g_free(filter->static_input);
+		g_free(filter->static_output);
+		filter->static_input = (guint8 *)g_malloc(used);
+		filter->static_output = (guint8 *)g_malloc(used);
+		filter->static_size = filter->static_input && filter->static_output ? used : 0;
+		filter->static_valid = FALSE;
+		if (!filter->static_size){
+			GST_ERROR_OBJECT(filter, "malloc static buffers failed.");
+			return FALSE;
+		}
+	}
+
+	// Start again from this frame
+	if (!filter->static_valid || filter->static_used != used || memcmp(&key, &filter->static_key, sizeof(key)) != 0){
+		for(p=0; p<GST_VIDEO_FRAME_N_PLANES (src); p++){
+			gst_smoothingfilter_plane_rows(src, p, &row_bytes, &rows, &h_sub);
+			for(y=0; y<rows; y++)
+				memcpy(filter->static_input + offset + y*row_bytes,
+						(const guint8 *)GST_VIDEO_FRAME_PLANE_DATA (src, p) + (gsize)y*GST_VIDEO_FRAME_PLANE_STRIDE (src, p), row_bytes);
+			offset += row_bytes * rows;
+		}
+		filter->static_key = key;
+		filter->static_used = used;
+		filter->static_valid = FALSE;   // until the output is kept
+		return TRUE;
+	}
+
+	changed = g_new0(gboolean, n_bands);
+	for(p=0; p<GST_VIDEO_FRAME_N_PLANES (src); p++){
+		gst_smoothingfilter_plane_rows(src, p, &row_bytes, &rows, &h_sub);
+		for(y=0; y<rows; y++){
+			const guint8 *row = (const guint8 *)GST_VIDEO_FRAME_PLANE_DATA (src, p) + (gsize)y*GST_VIDEO_FRAME_PLANE_STRIDE (src, p);
+			guint8 *last = filter->static_input + offset + y*row_bytes;
+
+			if (memcmp(row, last, row_bytes) == 0)
+				continue;
+			memcpy(last, row, row_bytes);
+			for(b=(y << h_sub)/SMOOTHING_STATIC_BAND; b<=(MIN((y+1) << h_sub, height) - 1)/SMOOTHING_STATIC_BAND; b++)
+				changed[b] = TRUE;
+		}
+		offset += row_bytes * rows;
+	}
+
+	// A changed row changes the output of the rows the kernel reaches from it, in the most subsampled plane too
+	halo = kernel->kernelsize << max_sub;
+	*rects = g_array_new(FALSE, FALSE, sizeof(GstSmoothingFilterRect));
+	for(b=0; b<n_bands; b++){
+		GstSmoothingFilterRect rect;
+		gint y0, y1;
+
+		if (!changed[b])
+			continue;
+		y0 = MAX(b*SMOOTHING_STATIC_BAND - halo, 0);
+		y1 = MIN((b+1)*SMOOTHING_STATIC_BAND + halo, height);
+		if ((*rects)->len > 0){
+			GstSmoothingFilterRect *last = &g_array_index(*rects, GstSmoothingFilterRect, (*rects)->len - 1);
+			if (last->y + last->height >= y0){
+				last->height = y1 - last->y;
+				continue;
 			}
-			filter->valchanged=0;
-		}
-
-		// Perform the convolution on the image, in-place so always apply kernel down and to the right
-//		GST_DEBUG_OBJECT(filter, "Perform the convolution");
-		if (filter->kernelsize==1){  // fast 3x3 implementation
-			bgr_pixel *ptr2=NULL, *ptr3=NULL, *ptr4=NULL;
-			gint valr, valg, valb;
-			stop_y  = filter->height-s;
-			stop_x  = filter->width-s;
-			for(y=start_y; y<stop_y; y++){
-				ptr = (bgr_pixel *)img_ptr + pitch * y + start_x; // ptr to start of line
-				for(x=start_x; x<stop_x; x++){
-					valb = valg = valr = 0;
-
-					ptr2 = ptr;
-					ptr3 = ptr2+pitch;
-					ptr4 = ptr3+pitch;
-					valb += forward_gamma[CLAMP((ptr2)->b, 0, in_limit)] * filter->smoothing_buffer[0];
-					valg += forward_gamma[CLAMP((ptr2)->g, 0, in_limit)] * filter->smoothing_buffer[0];
-					valr += forward_gamma[CLAMP((ptr2)->r, 0, in_limit)] * filter->smoothing_buffer[0];
-
-					valb += forward_gamma[CLAMP((ptr3)->b, 0, in_limit)] * filter->smoothing_buffer[3];
-					valg += forward_gamma[CLAMP((ptr3)->g, 0, in_limit)] * filter->smoothing_buffer[3];
-					valr += forward_gamma[CLAMP((ptr3)->r, 0, in_limit)] * filter->smoothing_buffer[3];
-
-					valb += forward_gamma[CLAMP((ptr4)->b, 0, in_limit)] * filter->smoothing_buffer[6];
-					valg += forward_gamma[CLAMP((ptr4)->g, 0, in_limit)] * filter->smoothing_buffer[6];
-					valr += forward_gamma[CLAMP((ptr4)->r, 0, in_limit)] * filter->smoothing_buffer[6];
-
-					ptr2++;
-					ptr3 = ptr2+pitch;
-					ptr4 = ptr3+pitch;
-					valb += forward_gamma[CLAMP((ptr2)->b, 0, in_limit)] * filter->smoothing_buffer[1];
-					valg += forward_gamma[CLAMP((ptr2)->g, 0, in_limit)] * filter->smoothing_buffer[1];
-					valr += forward_gamma[CLAMP((ptr2)->r, 0, in_limit)] * filter->smoothing_buffer[1];
-
-					valb += forward_gamma[CLAMP((ptr3)->b, 0, in_limit)] * filter->smoothing_buffer[4];
-					valg += forward_gamma[CLAMP((ptr3)->g, 0, in_limit)] * filter->smoothing_buffer[4];
-					valr += forward_gamma[CLAMP((ptr3)->r, 0, in_limit)] * filter->smoothing_buffer[4];
-
-					valb += forward_gamma[CLAMP((ptr4)->b, 0, in_limit)] * filter->smoothing_buffer[7];
-					valg += forward_gamma[CLAMP((ptr4)->g, 0, in_limit)] * filter->smoothing_buffer[7];
-					valr += forward_gamma[CLAMP((ptr4)->r, 0, in_limit)] * filter->smoothing_buffer[7];
-
-					ptr2++;
-					ptr3 = ptr2+pitch;
-					ptr4 = ptr3+pitch;
-					valb += forward_gamma[CLAMP((ptr2)->b, 0, in_limit)] * filter->smoothing_buffer[2];
-					valg += forward_gamma[CLAMP((ptr2)->g, 0, in_limit)] * filter->smoothing_buffer[2];
-					valr += forward_gamma[CLAMP((ptr2)->r, 0, in_limit)] * filter->smoothing_buffer[2];
-
-					valb += forward_gamma[CLAMP((ptr3)->b, 0, in_limit)] * filter->smoothing_buffer[5];
-					valg += forward_gamma[CLAMP((ptr3)->g, 0, in_limit)] * filter->smoothing_buffer[5];
-					valr += forward_gamma[CLAMP((ptr3)->r, 0, in_limit)] * filter->smoothing_buffer[5];
-
-					valb += forward_gamma[CLAMP((ptr4)->b, 0, in_limit)] * filter->smoothing_buffer[8];
-					valg += forward_gamma[CLAMP((ptr4)->g, 0, in_limit)] * filter->smoothing_buffer[8];
-					valr += forward_gamma[CLAMP((ptr4)->r, 0, in_limit)] * filter->smoothing_buffer[8];
-
-					ptr->b = inverse_gamma[(unsigned int)CLAMP(valb, 0, out_limit)];
-					ptr->g = inverse_gamma[(unsigned int)CLAMP(valg, 0, out_limit)];
-					ptr->r = inverse_gamma[(unsigned int)CLAMP(valr, 0, out_limit)];
-
-					ptr++;  // next pixel, 3 bytes on
-				}
+		}
+		rect.x = 0;
+		rect.y = y0;
+		rect.width = width;
+		rect.height = y1 - y0;
+		g_array_append_val(*rects, rect);
+	}
+	g_free(changed);
+
+	for(r=0; r<(*rects)->len; r++)
+		n_rows += g_array_index(*rects, GstSmoothingFilterRect, r).height;
+	GST_LOG_OBJECT(filter, "%d of %d rows changed", n_rows, height);
+	if (n_rows > height * SMOOTHING_STATIC_MAX_CHANGED){
+		g_array_unref(*rects);
+		*rects = NULL;
+	}
+
+	return TRUE;
+}
+
+/* Fill the rows of dst outside the rectangles from the last output. Out-of-place the rows inside them
+ * are copied from src, the components that are smoothed are then written over them.
+ */
+static void
+gst_smoothingfilter_static_fill (Gstsmoothingfilter *filter, const GstVideoFrame *src, GstVideoFrame *dst,
+		GArray *rects)
+{
+	gsize offset = 0, row_bytes;
+	gint rows, h_sub;
+	guint p, r;
+	gint y;
+
+	for(p=0; p<GST_VIDEO_FRAME_N_PLANES (dst); p++){
+		gst_smoothingfilter_plane_rows(dst, p, &row_bytes, &rows, &h_sub);
+		r = 0;
+		for(y=0; y<rows; y++){
+			guint8 *row = (guint8 *)GST_VIDEO_FRAME_PLANE_DATA (dst, p) + (gsize)y*GST_VIDEO_FRAME_PLANE_STRIDE (dst, p);
+			const GstSmoothingFilterRect *rect;
+
+			// the rectangles are in order, in plane rows as gst_smoothingfilter_run_rects() has them
+			while (r < rects->len){
+				rect = &g_array_index(rects, GstSmoothingFilterRect, r);
+				if (-((-(rect->y + rect->height)) >> h_sub) > y)
+					break;
+				r++;
+			}
+			if (r < rects->len && (rect->y >> h_sub) <= y){
+				if (src != dst)
+					memcpy(row, (const guint8 *)GST_VIDEO_FRAME_PLANE_DATA (src, p) + (gsize)y*GST_VIDEO_FRAME_PLANE_STRIDE (src, p), row_bytes);
 			}
+			else
+				memcpy(row, filter->static_output + offset + y*row_bytes, row_bytes);
+		}
+		offset += row_bytes * rows;
+	}
+}
+
+// Keep the rows of the output that were smoothed, all of them if rects is NULL, for the next frame
+static void
+gst_smoothingfilter_static_keep (Gstsmoothingfilter *filter, const GstVideoFrame *dst, GArray *rects)
+{
+	gsize offset = 0, row_bytes;
+	gint rows, h_sub;
+	guint p, r;
+	gint y, y0, y1;
+
+	for(p=0; p<GST_VIDEO_FRAME_N_PLANES (dst); p++){
+		gst_smoothingfilter_plane_rows(dst, p, &row_bytes, &rows, &h_sub);
+		for(r=0; r<(rects ? rects->len : 1); r++){
+			y0 = 0;
+			y1 = rows;
+			if (rects){
+				const GstSmoothingFilterRect *rect = &g_array_index(rects, GstSmoothingFilterRect, r);
+				y0 = rect->y >> h_sub;
+				y1 = MIN(-((-(rect->y + rect->height)) >> h_sub), rows);
+			}
+			for(y=y0; y<y1; y++)
+				memcpy(filter->static_output + offset + y*row_bytes,
+						(const guint8 *)GST_VIDEO_FRAME_PLANE_DATA (dst, p) + (gsize)y*GST_VIDEO_FRAME_PLANE_STRIDE (dst, p), row_bytes);
+		}
+		offset += row_bytes * rows;
+	}
+	filter->static_valid = TRUE;
+}
+
+/* this function does the actual processing, src and dst are the same frame when in-place */
+static GstFlowReturn
+gst_smoothingfilter_process (Gstsmoothingfilter *filter, GstVideoFrame *src, GstVideoFrame *dst)
+{
+	GstSmoothingFilterPlane planes[GST_VIDEO_MAX_COMPONENTS];
+	GstSmoothingFilterKernel *kernel;
+	const SmoothingLut *lut;
+	GstFlowReturn ret = GST_FLOW_OK;
+	SmoothingJob job;
+	GstClockTime start = filter->stats_enabled ? gst_util_get_timestamp() : GST_CLOCK_TIME_NONE;
+	const gchar *engine = NULL, *funcs = NULL;
+	GstSmoothingFilterQuality quality;
+	GArray *rects;
+	gfloat alpha;
+	gboolean temporal_init = FALSE;
+	gsize temporal_offset = 0;
+	gboolean skip_static = FALSE;
+	gint factor = filter->downscale;
+	guint copy, p;
+	gint n_planes, i;
+
+	// Hold on to the kernel for the whole frame, set_property may publish a new one at any time
+	GST_OBJECT_LOCK (filter);
+	quality = filter->quality;
+	if (quality == GST_SMOOTHINGFILTER_QUALITY_3X3 && filter->kernel_3x3)
+		kernel = gst_smoothingfilter_kernel_ref(filter->kernel_3x3);
+	else
+		kernel = gst_smoothingfilter_kernel_ref(filter->kernel);
+	alpha = filter->alpha;
+	GST_OBJECT_UNLOCK (filter);
+
+	// Downscaled frames always go through the engine, whatever the kernel
+	if ((kernel->kernelsize==0 || quality == GST_SMOOTHINGFILTER_QUALITY_OFF) && factor == 1){
+		// Only reached if a buffer arrives before the passthrough change has taken effect
+		if (src != dst)
+			gst_video_frame_copy(dst, src);
+		gst_smoothingfilter_kernel_unref(kernel);
+		GST_OBJECT_LOCK (filter);
+		filter->temporal_valid = FALSE;
+		GST_OBJECT_UNLOCK (filter);
+		return GST_FLOW_OK;
+	}
+
+	// Every component is decimated, and the whole of every frame, as what is not smoothed can not be copied
+	n_planes = gst_smoothingfilter_get_planes(filter, &src->info, filter->chroma || factor > 1, planes, &copy);
+	rects = factor == 1 ? gst_smoothingfilter_get_rects(filter, src->buffer) : NULL;
+
+	// Rectangles would overwrite each other's averages where their halos overlap, so their frames are not averaged
+	if (alpha < 1.0f && !rects){
+		if (!gst_smoothingfilter_ensure_temporal(filter, dst, planes, n_planes, &temporal_init)){
+			gst_smoothingfilter_kernel_unref(kernel);
+			return GST_FLOW_ERROR;
+		}
+	}
+	else
+		alpha = 1.0f;
+
+	// Averaged frames change every pixel, and the recursive filter reaches every row
+	if (filter->skip_static && factor == 1 && !rects && alpha == 1.0f && filter->method != GST_SMOOTHINGFILTER_METHOD_IIR){
+		if (!gst_smoothingfilter_static_rects(filter, src, kernel, &rects)){
+			gst_smoothingfilter_kernel_unref(kernel);
+			return GST_FLOW_ERROR;
+		}
+		skip_static = TRUE;
+	}
+
+	// Out-of-place, whatever is not smoothed still has to reach the output
+	if (src != dst && skip_static && rects)
+		gst_smoothingfilter_static_fill(filter, src, dst, rects);
+	else if (src != dst && rects)
+		gst_video_frame_copy(dst, src);
+	else if (src != dst){
+		for(p=0; p<GST_VIDEO_FRAME_N_PLANES (src); p++){
+			if (copy & (1 << p))
+				gst_video_frame_copy_plane(dst, src, p);
 		}
-		else {  // generic implementation
-			gint valr, valg, valb;
-			stop_y  = filter->height-s;
-			stop_x  = filter->width-s;
-			for(y=start_y; y<stop_y; y++){
-				ptr = (bgr_pixel *)img_ptr + pitch * y + start_x; // ptr to start of line
-				for(x=start_x; x<stop_x; x++){
-					valb = valg = valr = 0;
-					for(i=0; i<s; i++){
-						for(j=0; j<s; j++){
-							valb += forward_gamma[CLAMP((ptr+i*pitch+j)->b, 0, in_limit)] * filter->smoothing_buffer[i*s+j];
-							valg += forward_gamma[CLAMP((ptr+i*pitch+j)->g, 0, in_limit)] * filter->smoothing_buffer[i*s+j];
-							valr += forward_gamma[CLAMP((ptr+i*pitch+j)->r, 0, in_limit)] * filter->smoothing_buffer[i*s+j];
-						}
-					}
-
-					ptr->b = inverse_gamma[(unsigned int)CLAMP(valb, 0, out_limit)];
-					ptr->g = inverse_gamma[(unsigned int)CLAMP(valg, 0, out_limit)];
-					ptr->r = inverse_gamma[(unsigned int)CLAMP(valr, 0, out_limit)];
-
-					ptr++;  // next pixel, 3 bytes on
-				}
+	}
+
+	for(i=0; i<n_planes; i++){
+		gint c = planes[i].component;
+
+		job.src = GST_VIDEO_FRAME_COMP_DATA (src, c);
+		job.dst = GST_VIDEO_FRAME_COMP_DATA (dst, c);
+		job.src_stride = GST_VIDEO_FRAME_COMP_STRIDE (src, c);
+		job.dst_stride = GST_VIDEO_FRAME_COMP_STRIDE (dst, c);
+		job.width = GST_VIDEO_FRAME_COMP_WIDTH (src, c);
+		job.height = GST_VIDEO_FRAME_COMP_HEIGHT (src, c);
+		job.comp = planes[i].comp;
+		job.depth = planes[i].depth;
+		job.pstride = GST_VIDEO_FRAME_COMP_PSTRIDE (src, c);
+		job.kernelsize = kernel->kernelsize;
+		job.kernel2d = kernel->kernel2d;
+		job.kernel1d = kernel->kernel1d;
+		job.kernel2d_q = kernel->kernel2d_q;
+		job.kernel1d_q = kernel->kernel1d_q;
+		job.factor = factor;
+		job.out_width = GST_VIDEO_FRAME_COMP_WIDTH (dst, c);
+		job.out_height = GST_VIDEO_FRAME_COMP_HEIGHT (dst, c);
+		job.kernel_down = factor % 2 ? kernel->kernel1d : kernel->kernel1d_even;
+		job.down_taps = 2*kernel->kernelsize + 1 + (factor % 2 == 0);
+		if (job.depth == 2)
+			lut = kernel->gamma16;   // Only GRAY16, which is all luma
+		else if (planes[i].linear_light)
+			lut = kernel->gamma;
+		else
+			lut = kernel->identity;
+		if (lut == NULL){
+			GST_ERROR_OBJECT (filter, "no luts for %d bit values", 8*job.depth);
+			ret = GST_FLOW_ERROR;
+			break;
+		}
+		job.forward_gamma = lut->forward;
+		job.inverse_gamma = lut->inverse;
+		job.forward_gamma16 = lut->forward16;
+		job.fixed_shift = lut->fixed_shift;
+		job.out_limit = lut->out_limit;
+		job.weighted_gamma = kernel->weighted_gamma;
+		job.weight_index = kernel->weight_index;
+		job.iir_buffer = NULL;
+		job.iir = &kernel->iir;
+		job.range_weight = kernel->range_weight;
+		job.swapped = filter->lut16_swapped;
+		job.temporal = NULL;
+		job.alpha = alpha;
+		job.temporal_init = temporal_init;
+		if (alpha < 1.0f){
+			job.temporal = filter->temporal + temporal_offset;
+			temporal_offset += (gsize)job.out_width*job.comp*job.out_height;
+		}
+		job.engine2 = NULL;
+		job.funcs = smoothing_get_funcs(filter->simd);
+		// Only the float engines do temporal averaging
+		if (factor > 1)
+			job.engine = smoothing_downscale;   // separable, whatever the method, only at the output pixels
+		else if (filter->method == GST_SMOOTHINGFILTER_METHOD_IIR){
+			job.engine = smoothing_iir_rows;   // rows then columns, fixed-point does not apply
+			job.engine2 = smoothing_iir_columns;
+		}
+		else if (filter->method == GST_SMOOTHINGFILTER_METHOD_BILATERAL)   // float only, like iir
+			job.engine = job.kernelsize <= SMOOTHING_BILATERAL_MAX_DIRECT ? smoothing_bilateral : smoothing_bilateral_separable;
+		else if (filter->method == GST_SMOOTHINGFILTER_METHOD_SEPARABLE)
+			job.engine = filter->fixed_point && lut->forward16 && !job.temporal ? smoothing_separable_fixed : smoothing_separable;
+		else if (filter->fixed_point && lut->forward16 && !job.temporal)
+			job.engine = smoothing_direct_fixed;   // 14 bits of linear intensity is not enough for 16 bit values or precise luts
+		else if (kernel->weighted_gamma && planes[i].linear_light && job.depth == 1 && job.funcs == smoothing_get_funcs(FALSE) &&
+				!job.temporal)
+			job.engine = smoothing_direct_weighted;   // no SIMD, the weighted luts save all the multiplies
+		else
+			job.engine = smoothing_direct;
+		// the row functions with the taps unrolled for this kernel size and pixel layout, chosen once per plane
+		if (factor == 1)
+			job.funcs = smoothing_get_funcs_unrolled(job.funcs, job.kernelsize, job.comp);
+
+		if (i == 0 && GST_CLOCK_TIME_IS_VALID (start)){
+			engine = gst_smoothingfilter_engine_name(job.engine);
+			funcs = job.funcs->name;
+		}
+
+		if (rects){
+			// the recursive filter reaches well beyond kernelsize, 3 standard deviations is close enough
+			gint halo = job.engine == smoothing_iir_rows ? (gint)ceil(3.0*MAX(kernel->sigma/G_SQRT2, 0.5)) : job.kernelsize;
+
+			if (!gst_smoothingfilter_run_rects(filter, &job, rects, src->info.finfo, c, halo)){
+				ret = GST_FLOW_ERROR;
+				break;
 			}
 		}
+		else if (!gst_smoothingfilter_run_job(filter, &job)){
+			ret = GST_FLOW_ERROR;
+			break;
+		}
+	}
 
-		gst_buffer_unmap (buf, &minfo);
+	GST_OBJECT_LOCK (filter);
+	filter->temporal_valid = alpha < 1.0f && ret == GST_FLOW_OK;
+	GST_OBJECT_UNLOCK (filter);
+
+	if (skip_static && ret == GST_FLOW_OK){
+		if (src == dst && rects)
+			gst_smoothingfilter_static_fill(filter, src, dst, rects);   // only now the rectangles have read their halos
+		gst_smoothingfilter_static_keep(filter, dst, rects);
 	}
+	else if (skip_static)
+		filter->static_valid = FALSE;   // the input was kept but not the output
+
+	if (rects)
+		g_array_unref(rects);
+	gst_smoothingfilter_kernel_unref(kernel);
 
-	return gst_pad_push (filter->srcpad, buf);  // push out the buffer
+	if (GST_CLOCK_TIME_IS_VALID (start) && ret == GST_FLOW_OK && engine)
+		gst_smoothingfilter_stats_add_frame(filter, start, gst_util_get_timestamp(),
+				(guint64)GST_VIDEO_FRAME_WIDTH (src) * GST_VIDEO_FRAME_HEIGHT (src), engine, funcs);
+
+	return ret;
+}
+
+static GstFlowReturn
+gst_smoothingfilter_transform_frame (GstVideoFilter * vfilter,
+		GstVideoFrame * in_frame, GstVideoFrame * out_frame)
+{
+	return gst_smoothingfilter_process (GST_SMOOTHINGFILTER (vfilter), in_frame, out_frame);
+}
+
+static GstFlowReturn
+gst_smoothingfilter_transform_frame_ip (GstVideoFilter * vfilter, GstVideoFrame * frame)
+{
+	return gst_smoothingfilter_process (GST_SMOOTHINGFILTER (vfilter), frame, frame);
 }
 
 
@@ -501,6 +2557,9 @@ smoothingfilter_init (GstPlugin * smoothingfilter)
 	GST_DEBUG_CATEGORY_INIT (gst_smoothingfilter_debug, "smoothingfilter",
 			1, "Template smoothingfilter");
 
+	smoothing_engine_init ();
+	GST_INFO ("Using the %s row functions", smoothing_get_funcs (TRUE)->name);
+
 	return gst_element_register (smoothingfilter, "smoothingfilter", GST_RANK_NONE,
 			GST_TYPE_SMOOTHINGFILTER);
 }
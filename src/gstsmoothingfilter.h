@@ -47,6 +47,12 @@
 #define __GST_SMOOTHINGFILTER_H__
 
 #include <gst/gst.h>
+#include <gst/video/video.h>
+#include <gst/video/gstvideofilter.h>
+
+#include "gstsmoothingengine.h"
+#include "gstsmoothinglut.h"
+#include "gstsmoothingpool.h"
 
 G_BEGIN_DECLS
 
@@ -67,40 +73,180 @@ typedef struct _GstsmoothingfilterClass GstsmoothingfilterClass;
 
 // Calculate in linear intensity space, we expect the camera to have applied a 0.45 gamma
 // So linearise with a 2.22 gamma, bin and then re-gamma with 0.45
-// We create a gamma luts for speed, with integers
-// To apply the 2.22 gamma to the int input value i, use v=gamma[i]
-// To apply the 0.45 gamma to the int calculated value v, use i=inverse_gamma[v]
-#define GAMMA 2.22
+// We create a gamma luts for speed, with integers, shared by every instance (see gstsmoothinglut.h)
+// To apply the 2.22 gamma to the int input value i, use v=gamma->forward[i]
+// To apply the 0.45 gamma to the int calculated value v, use i=gamma->inverse[v]
+#define GAMMA 2.22     // the default, see the gamma property
 #define OFFSET 0.099   // from Rec. 709 standard
-#define FACTOR 283.02  // Factor to divide input by so that it's never >1 when 0.099 is added
-#define IN_RANGE 256
-#define OUT_RANGE 4096     // an higher bit lut for reverse lookup, 18 bit (262144) guarantees every level preserved, 12 (4096) may be ok
+#define LUT_PRECISION 12       // bits of the reverse lookup lut, 18 bit (262144) guarantees every level preserved, 12 (4096) may be ok
+#define LUT_PRECISION16_MAX 22 // 16 bit values get luts 8 bits more precise, up to this
+
+#define SMOOTHING_ROW_ALIGN 64   // bytes, the rows we ask pools for start on this boundary, enough for AVX2 loads
+
+typedef enum {
+	GST_SMOOTHINGFILTER_METHOD_DIRECT,      // s*s 2D convolution
+	GST_SMOOTHINGFILTER_METHOD_SEPARABLE,   // horizontal then vertical 1D convolution, 2s taps
+	GST_SMOOTHINGFILTER_METHOD_IIR,         // recursive Gaussian, cost independent of sigma, ignores kernelsize
+	GST_SMOOTHINGFILTER_METHOD_BILATERAL    // edge preserving, taps also weighted by how close their values are, see sigma-range
+} GstSmoothingFilterMethod;
+
+#define SMOOTHING_BILATERAL_MAX_DIRECT 1   // larger kernels get the separable approximation of the bilateral filter
+
+// How much of the smoothing is done, adaptive=true steps down through these when QoS events say the pipeline is late
+typedef enum {
+	GST_SMOOTHINGFILTER_QUALITY_FULL,   // the kernel asked for
+	GST_SMOOTHINGFILTER_QUALITY_3X3,    // kernelsize 1, skipped if that is what was asked for
+	GST_SMOOTHINGFILTER_QUALITY_OFF     // passthrough
+} GstSmoothingFilterQuality;
+
+// Which threads smooth the stripes of a frame
+typedef enum {
+	GST_SMOOTHINGFILTER_POOL_PRIVATE,   // the element's own n-threads threads
+	GST_SMOOTHINGFILTER_POOL_SHARED     // the workers every element in the process with pool=shared submits to
+} GstSmoothingFilterPoolMode;
+
+#define SMOOTHING_QOS_DOWN 1.05          // QoS proportion above which the quality is stepped down, as are late frames
+#define SMOOTHING_QOS_UP 0.75            // and below which it is stepped back up
+#define SMOOTHING_QOS_HOLD (GST_SECOND/2) // running time to wait after a change, for its effect to reach the QoS events
 
+// One set of interleaved values to smooth in a frame, all of RGB, the Y of I420 or the UV of NV12
 typedef struct {
-	guint8 b, g, r;
-} bgr_pixel;
+	gint component;        // the plane's first component in memory, as numbered by GstVideoFormatInfo
+	gint comp;             // components smoothed together, they are adjacent in every pixel
+	gboolean linear_light; // TRUE for RGB and luma, which are smoothed through the gamma luts, chroma is not
+	gint depth;            // bytes per value, 2 for GRAY16
+} GstSmoothingFilterPlane;
+
+// A rectangle to smooth, in pixels of the full size plane
+typedef struct {
+	gint x, y, width, height;
+} GstSmoothingFilterRect;
+
+#define SMOOTHING_STATIC_BAND 16        // frame rows compared as one for skip-static, the changed ones are smoothed in bands this high
+#define SMOOTHING_STATIC_MAX_CHANGED 0.75   // with more of the rows than this to smooth, the whole frame is smoothed
+
+// What the output of a frame depends on besides its input, while it is the same the last frame's output can be reused
+typedef struct {
+	GstVideoFormat format;
+	gint width, height;
+	gint kernelsize;
+	gfloat sigma;
+	gfloat sigma_range;
+	gdouble gamma;
+	gint lut_bits;
+	GstSmoothingFilterMethod method;
+	gboolean fixed_point, simd, chroma;
+} GstSmoothingFilterStaticKey;
+
+#define SMOOTHING_KERNEL_CACHE_SIZE 8   // kernels kept for reuse when kernelsize, sigma or the luts go back to an earlier value
+
+// A kernel, the luts it is used with and everything derived from them. Built by set_property and only read
+// by the streaming thread, which holds a reference for the frame it is working on.
+typedef struct {
+	gint ref_count;
+	gint kernelsize;
+	gfloat sigma;
+	gfloat sigma_range;
+	SmoothingLut *gamma;    // for 8 bit RGB and luma
+	SmoothingLut *identity; // for 8 bit chroma, the same precision as gamma
+	SmoothingLut *gamma16;  // for 16 bit values, NULL until a 16 bit format is negotiated
+	float *kernel2d;        // (2n+1)*(2n+1) weights, sum to 1
+	float *kernel1d;        // The 1D kernel (2n+1) used by the separable method
+	float *kernel1d_even;   // 2n+2 weights centred between the middle two, for downscaling by even factors
+	gint16 *kernel2d_q;     // The kernels quantised for fixed point
+	gint16 *kernel1d_q;
+	float *weighted_gamma;  // gamma->forward times each distinct weight of a small kernel, NULL for big kernels
+	guint8 *weight_index;   // the weighted_gamma lut used by each tap
+	SmoothingIir iir;       // The recursive Gaussian for the iir method
+	float *range_weight;    // SMOOTHING_RANGE_LUT_SIZE weights for the bilateral method, by summed difference of 8 bit values
+} GstSmoothingFilterKernel;
+
+#define SMOOTHING_STATS_WINDOW 1000   // most recent frames the p99 time is taken over
+
+// Frame timings, only gathered when the stats property is set. Written by the streaming thread under the object lock.
+typedef struct {
+	guint64 frames;          // frames smoothed since the element started or stats was turned on
+	guint64 pixels;
+	GstClockTime total_time; // time spent smoothing those frames
+	GstClockTime max_time;
+	GstClockTime window[SMOOTHING_STATS_WINDOW];   // the latest frame times, frame i is at i % SMOOTHING_STATS_WINDOW
+	const gchar *engine;     // the engine and row functions of the last frame's first plane
+	const gchar *funcs;
+	GstClockTime last_message; // when the last stats message was posted
+} GstSmoothingFilterStats;
 
 struct _Gstsmoothingfilter
 {
-  GstElement element;
-
-  GstPad *sinkpad, *srcpad;
+  GstVideoFilter videofilter;
 
   gint kernelsize;
   gfloat sigma;
+  gfloat sigma_range;  // in 8 bit levels, how different a neighbour can be and still be averaged by the bilateral method
+  GstSmoothingFilterMethod method;
+  gboolean in_place;   // smooth the input buffer itself rather than writing to a new output buffer
+  gboolean simd;       // use the SIMD row functions if the CPU has them
+  gboolean fixed_point; // use the integer engines
+  gboolean chroma;     // smooth the chroma of YUV formats as well as the luma
 
-  float *smoothing_buffer;   // Memory to store the kernel
+  GstSmoothingFilterKernel *kernel; // The kernel for the current kernelsize and sigma, swapped under the object lock
+  GstSmoothingFilterKernel *kernel_3x3; // kernelsize 1 with the same sigma and luts, when adaptive and kernelsize > 1
+  GQueue kernel_cache;        // Recently used kernels, most recent first
+  float *iir_buffer;          // A whole plane in linear intensity, for the iir method
+  gsize iir_buffer_size;
+  gint n_threads;             // worker threads to split each frame over, 0 for one per core
+  GstSmoothingFilterPoolMode pool_mode;
+  SmoothingPool *pool;        // private, or a reference to the shared pool
+  SmoothingStripe *stripes;   // the bands of a plane, each with its own row buffers
+  gint n_stripes;             // stripes allocated, one per thread
   gint width, height; // image size
-  gint stride;    // bytes to next line
-  gint valchanged; // flag for something has changed and the kernel should be recalculated
+  gint downscale_factor; // the property, the src caps are this many times smaller each way
+  gint downscale;        // the factor the current caps were negotiated with
+
+  GArray *roi;          // GstSmoothingFilterRect from the roi property, empty for the whole frame, swapped under the object lock
+  gboolean roi_meta;    // only smooth the rectangles of each buffer's GstVideoRegionOfInterestMeta, as well as roi
+  guint8 *roi_buffer;   // the rectangles of a plane, smoothed, before they are copied to the output
+  gsize roi_buffer_size;
+
+  gdouble gamma;       // the gamma the input was encoded with
+  gint lut_precision;  // bits of the inverse luts for 8 bit values
+  gboolean lut16;      // a 16 bit format is negotiated, so the kernel needs 16 bit luts too
+  gboolean lut16_swapped; // in the opposite byte order to the host (GRAY16_BE on x86)
+
+  gfloat alpha;         // weight of each new frame in the temporal average, 1 for no temporal averaging
+  float *temporal;      // the running average of every smoothed plane, in linear intensity, for alpha < 1
+  gsize temporal_size;
+  gsize temporal_used;  // values of temporal the last frame used, a different layout starts it again
+  gboolean temporal_valid; // temporal holds the earlier frames, cleared by caps changes, flushes and passthrough
+
+  gboolean skip_static; // only smooth the rows that changed since the last frame, and the rows they reach
+  guint8 *static_input; // the last frame smoothed in full or by rows, every plane's rows packed one after another
+  guint8 *static_output;
+  gsize static_size;    // of each of them
+  gsize static_used;
+  GstSmoothingFilterStaticKey static_key; // what static_output was smoothed with
+  gboolean static_valid; // static_output is the smoothed static_input, only used by the streaming thread
+
+  gboolean adaptive;    // follow QoS events, see GstSmoothingFilterQuality
+  GstSmoothingFilterQuality quality;
+  GstClockTime quality_changed; // running time of the QoS event that last changed the quality
+
+  gint async_depth;     // frames smoothed ahead of the src pad task that pushes them, 0 to push from the streaming thread, under async_lock
+  GQueue async_queue;   // smoothed buffers waiting for the task, under async_lock like the rest
+  gint async_pending;   // buffers queued or being pushed
+  GstFlowReturn async_flow; // what the last push returned, handed upstream in place of the next frame's if not OK
+  gboolean async_flushing;
+  gboolean async_running;   // the task has been started since it last paused
+  GMutex async_lock;
+  GCond async_cond;     // a buffer was queued or pushed, or flushing started
 
-  double *forward_gamma;
-  unsigned int *inverse_gamma;
+  gboolean stats_enabled; // time every frame, off costs one branch per frame
+  guint stats_interval;   // ms between stats element messages, 0 for none
+  GstSmoothingFilterStats stats;
 };
 
 struct _GstsmoothingfilterClass 
 {
-  GstElementClass parent_class;
+  GstVideoFilterClass parent_class;
 };
 
 GType gst_smoothingfilter_get_type (void);
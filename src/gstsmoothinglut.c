@@ -0,0 +1,202 @@
+/*
+ * Smoothing Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A process-wide registry of the gamma luts used by the smoothingfilter element.
+ * Each distinct curve and precision is calculated once and shared by every instance that uses it,
+ * it is freed when the last one lets go.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+
+#include "gstsmoothinglut.h"
+#include "gstsmoothingengine.h"
+
+static GMutex smoothing_lut_lock;
+static GList *smoothing_luts = NULL;
+
+static SmoothingLut *
+smoothing_lut_new (gdouble gamma, gdouble offset, gint in_bits, gint out_bits, gboolean swapped)
+{
+	SmoothingLut *lut = g_new0(SmoothingLut, 1);
+	guint in_range = 1u << in_bits;
+	guint out_range = 1u << out_bits;
+	double factor = (in_range-1) / (1.0-offset);   // so the brightest input is never >1 when the offset is added
+	double invgamma = 1.0/gamma;
+	gboolean linear = gamma == 1.0 && offset == 0.0;
+	guint i;
+
+	lut->ref_count = 1;
+	lut->gamma = gamma;
+	lut->offset = offset;
+	lut->in_bits = in_bits;
+	lut->out_bits = out_bits;
+	lut->swapped = swapped;
+	lut->out_limit = out_range - 1;
+
+	lut->forward = g_new(float, in_range);
+	for (i=0;i<in_range;i++){
+		guint index = swapped ? GUINT16_SWAP_LE_BE((guint16)i) : i;
+		if (linear)
+			lut->forward[index] = (float)i * out_range / in_range;
+		else
+			lut->forward[index] = (float)((double)out_range * pow(((double)i/factor) + offset, gamma));
+	}
+
+	// The fixed point engines work in 14 bits, fixed_shift gets them back to an index into inverse
+	if (in_bits == 8 && out_bits <= SMOOTHING_FIXED_BITS){
+		lut->forward16 = g_new0(guint16, in_range+1);
+		for (i=0;i<in_range;i++){
+			if (linear)
+				lut->forward16[i] = i * SMOOTHING_FIXED_ONE / in_range;
+			else
+				lut->forward16[i] = (guint16)MIN(SMOOTHING_FIXED_ONE * pow(((double)i/factor) + offset, gamma) + 0.5, 65535);
+		}
+		lut->fixed_shift = SMOOTHING_FIXED_BITS - out_bits;
+	}
+
+	// NB Not applying the output offset here since not adding a linear portion to the gamma curve (see flycapsrc LUT)
+	lut->inverse = g_new(unsigned int, out_range);
+	for (i=0;i<out_range;i++){
+		guint value;
+		if (linear)
+			value = MIN(((guint64)i*in_range + out_range/2) / out_range, in_range-1);
+		else
+			value = (guint)MIN(in_range * pow(((double)i/out_range), invgamma), in_range-1);
+		lut->inverse[i] = swapped ? GUINT16_SWAP_LE_BE((guint16)value) : value;
+	}
+
+	return lut;
+}
+
+// Free a lut nothing refers to any more
+static void
+smoothing_lut_free (SmoothingLut *lut)
+{
+	g_free(lut->forward);
+	g_free(lut->forward16);
+	g_free(lut->inverse);
+	g_free(lut);
+}
+
+// A ref to the cached lut with these parameters, or NULL, called with smoothing_lut_lock held
+static SmoothingLut *
+smoothing_lut_find (gdouble gamma, gdouble offset, gint in_bits, gint out_bits, gboolean swapped)
+{
+	GList *l;
+
+	for(l=smoothing_luts; l; l=l->next){
+		SmoothingLut *cached = l->data;
+		if (cached->gamma == gamma && cached->offset == offset && cached->in_bits == in_bits &&
+				cached->out_bits == out_bits && cached->swapped == swapped){
+			cached->ref_count++;
+			return cached;
+		}
+	}
+	return NULL;
+}
+
+SmoothingLut *
+smoothing_lut_get (gdouble gamma, gdouble offset, gint in_bits, gint out_bits, gboolean swapped)
+{
+	SmoothingLut *lut, *built;
+
+	g_return_val_if_fail(in_bits == 8 || in_bits == 16, NULL);
+
+	swapped = swapped && in_bits == 16;
+
+	g_mutex_lock(&smoothing_lut_lock);
+	lut = smoothing_lut_find(gamma, offset, in_bits, out_bits, swapped);
+	g_mutex_unlock(&smoothing_lut_lock);
+	if (lut)
+		return lut;
+
+	// Calculated without the lock, so other instances can get the luts they need meanwhile.
+	// If one built the same lut first, that one is shared and this copy dropped.
+	built = smoothing_lut_new(gamma, offset, in_bits, out_bits, swapped);
+
+	g_mutex_lock(&smoothing_lut_lock);
+	lut = smoothing_lut_find(gamma, offset, in_bits, out_bits, swapped);
+	if (lut == NULL){
+		lut = built;
+		built = NULL;
+		smoothing_luts = g_list_prepend(smoothing_luts, lut);
+	}
+	g_mutex_unlock(&smoothing_lut_lock);
+
+	if (built)
+		smoothing_lut_free(built);
+
+	return lut;
+}
+
+SmoothingLut *
+smoothing_lut_ref (SmoothingLut *lut)
+{
+	g_mutex_lock(&smoothing_lut_lock);
+	lut->ref_count++;
+	g_mutex_unlock(&smoothing_lut_lock);
+
+	return lut;
+}
+
+void
+smoothing_lut_unref (SmoothingLut *lut)
+{
+	gboolean last;
+
+	if (!lut)
+		return;
+
+	g_mutex_lock(&smoothing_lut_lock);
+	last = --lut->ref_count == 0;
+	if (last)
+		smoothing_luts = g_list_remove(smoothing_luts, lut);
+	g_mutex_unlock(&smoothing_lut_lock);
+
+	if (last)
+		smoothing_lut_free(lut);
+}
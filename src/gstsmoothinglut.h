@@ -0,0 +1,79 @@
+/*
+ * Smoothing Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_SMOOTHINGLUT_H__
+#define __GST_SMOOTHINGLUT_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+// The forward lut takes an input value to a linear intensity between 0 and out_range,
+// out[v] = out_range * (v/factor + offset)^gamma where factor makes the brightest input 1.
+// The inverse lut takes a linear intensity, rounded to an integer, back to an output value.
+// A gamma of 1 with no offset just scales, for values that are not light intensity (chroma).
+typedef struct {
+	gint ref_count;   // only changed under the registry lock
+
+	gdouble gamma;
+	gdouble offset;
+	gint in_bits;     // 8 or 16
+	gint out_bits;    // precision of the inverse lut
+	gboolean swapped; // 16 bit values in the other byte order to the host, both luts work on the raw values
+
+	float *forward;           // 1 << in_bits entries
+	guint16 *forward16;       // 14 bit linear intensity for the fixed point engines, with a spare entry for the AVX2 gather.
+	                          // NULL unless in_bits is 8 and out_bits is at most 14
+	gint fixed_shift;         // takes a 14 bit linear intensity down to an index into inverse
+	unsigned int *inverse;    // 1 << out_bits entries
+	gint out_limit;           // the last index into inverse
+} SmoothingLut;
+
+// Luts are shared by every element in the process, smoothing_lut_get() only calculates one if no one has it yet
+SmoothingLut *smoothing_lut_get (gdouble gamma, gdouble offset, gint in_bits, gint out_bits, gboolean swapped);
+SmoothingLut *smoothing_lut_ref (SmoothingLut *lut);
+void smoothing_lut_unref (SmoothingLut *lut);
+
+G_END_DECLS
+
+#endif /* __GST_SMOOTHINGLUT_H__ */
@@ -0,0 +1,315 @@
+/*
+ * Smoothing Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* A small worker pool for the smoothingfilter element.
+ * The threads are created once and kept, so handing a frame out in stripes costs a few wakeups rather than thread creation.
+ * The calling thread works on the tasks too, and every thread keeps taking the next task until there are none left.
+ *
+ * There is also one pool shared by every element in the process that asks for it, with a worker per core.
+ * Each element has at most one batch (a plane of one frame) queued in it at a time, and the workers take one task
+ * at a time from each queued batch in turn, so every stream gets a share of the cores however many there are.
+ * The calling thread only works on its own batch.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "gstsmoothingpool.h"
+
+struct _SmoothingPool {
+	GThreadPool *threads;
+	gint n_threads;   // including the calling thread
+
+	// The shared pool only
+	gboolean shared;
+	gint ref_count;   // under smoothing_pool_shared_lock
+	GThread **workers;
+	GMutex lock;
+	GCond work;       // there is a batch in the queue, or quit
+	GQueue batches;   // batches with tasks that may be left, the next task is taken from the head
+	gboolean quit;
+};
+
+static GMutex smoothing_pool_shared_lock;
+static SmoothingPool *smoothing_pool_shared;
+
+// One call to smoothing_pool_run, lives on the caller's stack
+typedef struct {
+	SmoothingTaskFunc func;
+	guint8 *tasks;
+	gsize task_size;
+	gint n_tasks;
+	gpointer user_data;
+
+	gint next;          // next task to take, atomic
+	gint n_helpers;     // worker threads that were asked to help
+	gint n_finished;    // workers that have stopped touching this batch
+	gint n_active;      // shared pool workers running a task of this batch, under the pool's lock
+
+	GMutex lock;
+	GCond cond;
+} SmoothingBatch;
+
+static void
+smoothing_batch_work (SmoothingBatch *batch)
+{
+	gint i;
+
+	while ((i = g_atomic_int_add(&batch->next, 1)) < batch->n_tasks)
+		batch->func(batch->tasks + i*batch->task_size, batch->user_data);
+}
+
+static void
+smoothing_pool_worker (gpointer data, gpointer user_data)
+{
+	SmoothingBatch *batch = (SmoothingBatch *)data;
+
+	smoothing_batch_work(batch);
+
+	g_mutex_lock(&batch->lock);
+	batch->n_finished++;
+	g_cond_signal(&batch->cond);
+	g_mutex_unlock(&batch->lock);
+}
+
+/* A worker of the shared pool. Takes the next task of the batch at the head of the queue and puts the batch
+ * back at the tail if it has more, so the next task comes from another batch.
+ */
+static gpointer
+smoothing_pool_shared_worker (gpointer data)
+{
+	SmoothingPool *pool = (SmoothingPool *)data;
+
+	g_mutex_lock(&pool->lock);
+	while (!pool->quit){
+		SmoothingBatch *batch = g_queue_pop_head(&pool->batches);
+		gint i;
+
+		if (batch == NULL){
+			g_cond_wait(&pool->work, &pool->lock);
+			continue;
+		}
+
+		i = g_atomic_int_add(&batch->next, 1);
+		if (i >= batch->n_tasks)
+			continue;   // the others are all taken, it stays off the queue
+		if (i+1 < batch->n_tasks)
+			g_queue_push_tail(&pool->batches, batch);
+		batch->n_active++;
+		g_mutex_unlock(&pool->lock);
+
+		batch->func(batch->tasks + i*batch->task_size, batch->user_data);
+
+		g_mutex_lock(&pool->lock);
+		if (--batch->n_active == 0)
+			g_cond_signal(&batch->cond);
+	}
+	g_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+SmoothingPool *
+smoothing_pool_new (gint n_threads)
+{
+	SmoothingPool *pool = g_new0(SmoothingPool, 1);
+
+	pool->n_threads = MAX(1, n_threads);
+	if (pool->n_threads > 1){
+		// exclusive threads stay alive between frames
+		pool->threads = g_thread_pool_new(smoothing_pool_worker, NULL, pool->n_threads-1, TRUE, NULL);
+		if (!pool->threads)
+			pool->n_threads = 1;
+	}
+
+	return pool;
+}
+
+/* The process wide pool, with a worker for every core but one, as the calling threads work too.
+ * Free it with smoothing_pool_free(), the workers stop when the last user has.
+ */
+SmoothingPool *
+smoothing_pool_get_shared (void)
+{
+	SmoothingPool *pool;
+	gint i;
+
+	g_mutex_lock(&smoothing_pool_shared_lock);
+	pool = smoothing_pool_shared;
+	if (pool)
+		pool->ref_count++;
+	else {
+		pool = g_new0(SmoothingPool, 1);
+		pool->shared = TRUE;
+		pool->ref_count = 1;
+		pool->n_threads = MAX(1, (gint)g_get_num_processors());
+		g_mutex_init(&pool->lock);
+		g_cond_init(&pool->work);
+		g_queue_init(&pool->batches);
+		pool->workers = g_new0(GThread *, pool->n_threads);
+		for(i=0; i<pool->n_threads-1; i++)
+			pool->workers[i] = g_thread_new("smoothing-pool", smoothing_pool_shared_worker, pool);
+		smoothing_pool_shared = pool;
+	}
+	g_mutex_unlock(&smoothing_pool_shared_lock);
+
+	return pool;
+}
+
+static void
+smoothing_pool_free_shared (SmoothingPool *pool)
+{
+	gint i;
+
+	g_mutex_lock(&smoothing_pool_shared_lock);
+	if (--pool->ref_count > 0){
+		g_mutex_unlock(&smoothing_pool_shared_lock);
+		return;
+	}
+	smoothing_pool_shared = NULL;
+	g_mutex_unlock(&smoothing_pool_shared_lock);
+
+	g_mutex_lock(&pool->lock);
+	pool->quit = TRUE;
+	g_cond_broadcast(&pool->work);
+	g_mutex_unlock(&pool->lock);
+	for(i=0; pool->workers[i]; i++)
+		g_thread_join(pool->workers[i]);
+
+	g_free(pool->workers);
+	g_mutex_clear(&pool->lock);
+	g_cond_clear(&pool->work);
+	g_free(pool);
+}
+
+void
+smoothing_pool_free (SmoothingPool *pool)
+{
+	if (!pool)
+		return;
+	if (pool->shared){
+		smoothing_pool_free_shared(pool);
+		return;
+	}
+	if (pool->threads)
+		g_thread_pool_free(pool->threads, FALSE, TRUE);
+	g_free(pool);
+}
+
+gint
+smoothing_pool_get_n_threads (SmoothingPool *pool)
+{
+	return pool->n_threads;
+}
+
+gboolean
+smoothing_pool_is_shared (SmoothingPool *pool)
+{
+	return pool->shared;
+}
+
+// Queue the batch for the shared workers, work on it and wait until they have all finished their tasks of it
+static void
+smoothing_pool_run_shared (SmoothingPool *pool, SmoothingBatch *batch)
+{
+	gint i;
+
+	g_mutex_lock(&pool->lock);
+	g_queue_push_tail(&pool->batches, batch);
+	for(i=0; i<MIN(batch->n_tasks, pool->n_threads)-1; i++)
+		g_cond_signal(&pool->work);
+	g_mutex_unlock(&pool->lock);
+
+	smoothing_batch_work(batch);
+
+	// every task has been taken, so once it is off the queue no worker can start another
+	g_mutex_lock(&pool->lock);
+	g_queue_remove(&pool->batches, batch);
+	while (batch->n_active > 0)
+		g_cond_wait(&batch->cond, &pool->lock);
+	g_mutex_unlock(&pool->lock);
+}
+
+/* Run func on each of the n_tasks tasks, which are task_size bytes apart in memory.
+ * Returns once all the tasks are done.
+ */
+void
+smoothing_pool_run (SmoothingPool *pool, SmoothingTaskFunc func, gpointer tasks, gsize task_size,
+		gint n_tasks, gpointer user_data)
+{
+	SmoothingBatch batch;
+	gint i;
+
+	batch.func = func;
+	batch.tasks = (guint8 *)tasks;
+	batch.task_size = task_size;
+	batch.n_tasks = n_tasks;
+	batch.user_data = user_data;
+	batch.next = 0;
+	batch.n_helpers = 0;
+	batch.n_finished = 0;
+	batch.n_active = 0;
+	g_mutex_init(&batch.lock);
+	g_cond_init(&batch.cond);
+
+	if (pool->shared)
+		smoothing_pool_run_shared(pool, &batch);
+	else if (pool->threads){
+		for(i=0; i<MIN(n_tasks, pool->n_threads)-1; i++){
+			if (g_thread_pool_push(pool->threads, &batch, NULL))
+				batch.n_helpers++;
+		}
+	}
+
+	smoothing_batch_work(&batch);
+
+	// the batch is on our stack, so wait for every helper to let go of it, not just for the tasks to finish
+	g_mutex_lock(&batch.lock);
+	while (batch.n_finished < batch.n_helpers)
+		g_cond_wait(&batch.cond, &batch.lock);
+	g_mutex_unlock(&batch.lock);
+
+	g_mutex_clear(&batch.lock);
+	g_cond_clear(&batch.cond);
+}
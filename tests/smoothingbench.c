@@ -0,0 +1,322 @@
+/*
+ * Smoothing Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Throughput benchmark for the smoothingfilter element.
+ * Synthetic frames are pushed through the element with GstHarness for every combination of
+ * resolution, format, method, kernelsize, sigma and thread count asked for, and one line of
+ * results is printed per combination, as CSV (default) or JSON.
+ *
+ * Built and run by 'make bench', which points GST_PLUGIN_PATH at the plugin in the build tree.
+ * Arguments for the run can be given with BENCH_ARGS, e.g.
+ *	$ make bench BENCH_ARGS="--resolutions=1920x1080 --formats=RGB --threads=1,2,4,8 --json"
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <gst/check/gstharness.h>
+
+typedef struct {
+	gint width, height;
+	GstVideoFormat format;
+	const gchar *method;
+	gint kernelsize;
+	gdouble sigma;
+	gint n_threads;
+} BenchConfig;
+
+typedef struct {
+	gint frames;
+	gdouble mpixels_per_s;   // luma pixels per second, in millions
+	gdouble ns_per_pixel;
+	gdouble latency_us[4];   // per frame push to pull, p50, p90, p99 and max
+} BenchResult;
+
+static gchar *resolutions = "640x480,1280x720,1920x1080,3840x2160";
+static gchar *formats = "RGB,I420,GRAY8,GRAY16_LE";
+static gchar *methods = "separable";
+static gchar *kernelsizes = "1,2,4";
+static gchar *sigmas = "1.0,3.0";
+static gchar *threads = "1,0";
+static gchar **properties = NULL;
+static gint n_frames = 30;
+static gint n_warmup = 5;
+static gboolean json = FALSE;
+
+static GOptionEntry entries[] = {
+	{"resolutions", 'r', 0, G_OPTION_ARG_STRING, &resolutions, "Comma separated frame sizes", "WxH,..."},
+	{"formats", 'f', 0, G_OPTION_ARG_STRING, &formats, "Comma separated video formats", "FORMAT,..."},
+	{"methods", 'm', 0, G_OPTION_ARG_STRING, &methods, "Comma separated smoothing methods", "METHOD,..."},
+	{"kernelsizes", 'k', 0, G_OPTION_ARG_STRING, &kernelsizes, "Comma separated kernel size indexes", "N,..."},
+	{"sigmas", 's', 0, G_OPTION_ARG_STRING, &sigmas, "Comma separated Gaussian sigmas", "SIGMA,..."},
+	{"threads", 't', 0, G_OPTION_ARG_STRING, &threads, "Comma separated n-threads values, 0 for one per core", "N,..."},
+	{"set", 'p', 0, G_OPTION_ARG_STRING_ARRAY, &properties, "Set another element property for every run, may be repeated", "PROPERTY=VALUE"},
+	{"frames", 'n', 0, G_OPTION_ARG_INT, &n_frames, "Frames timed per combination", "N"},
+	{"warmup", 'w', 0, G_OPTION_ARG_INT, &n_warmup, "Frames pushed before timing starts", "N"},
+	{"json", 'j', 0, G_OPTION_ARG_NONE, &json, "Print one JSON object per line instead of CSV", NULL},
+	{NULL}
+};
+
+static gint
+compare_clocktime (gconstpointer a, gconstpointer b)
+{
+	GstClockTime ta = *(const GstClockTime *) a, tb = *(const GstClockTime *) b;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+// nearest rank percentile of sorted latencies, in microseconds
+static gdouble
+percentile_us (const GstClockTime * sorted, gint n, gdouble p)
+{
+	gint i = (gint) (p / 100.0 * n + 0.999999) - 1;
+
+	return sorted[CLAMP (i, 0, n - 1)] / 1000.0;
+}
+
+// A frame of noise, the same every run so results are comparable
+static GstBuffer *
+make_frame (const GstVideoInfo * info)
+{
+	GstBuffer *buffer = gst_buffer_new_allocate (NULL, GST_VIDEO_INFO_SIZE (info), NULL);
+	GstMapInfo map;
+	guint32 seed = 12345;
+	gsize i;
+
+	gst_buffer_map (buffer, &map, GST_MAP_WRITE);
+	for (i = 0; i < map.size; i++) {
+		seed = seed * 1103515245 + 12345;
+		map.data[i] = seed >> 24;
+	}
+	gst_buffer_unmap (buffer, &map);
+
+	return buffer;
+}
+
+static gboolean
+run_config (const BenchConfig * config, BenchResult * result)
+{
+	GstHarness *h;
+	GstVideoInfo info;
+	GstCaps *caps;
+	GstBuffer *frame;
+	GstClockTime *latency, total = 0;
+	gchar **p;
+	gint i;
+
+	gst_video_info_init (&info);
+	gst_video_info_set_format (&info, config->format, config->width, config->height);
+	info.fps_n = 30;
+	info.fps_d = 1;
+
+	h = gst_harness_new ("smoothingfilter");
+	g_object_set (h->element, "kernelsize", config->kernelsize, "sigma", (gfloat) config->sigma,
+			"n-threads", config->n_threads, NULL);
+	gst_util_set_object_arg (G_OBJECT (h->element), "method", config->method);
+	for (p = properties; p && *p; p++) {
+		gchar **kv = g_strsplit (*p, "=", 2);
+
+		if (kv[0] && kv[1])
+			gst_util_set_object_arg (G_OBJECT (h->element), kv[0], kv[1]);
+		else
+			g_printerr ("ignoring --set %s, expected PROPERTY=VALUE\n", *p);
+		g_strfreev (kv);
+	}
+
+	// only the input caps, the output is whatever the element makes of them (downscale-factor)
+	caps = gst_video_info_to_caps (&info);
+	gst_harness_set_src_caps (h, caps);
+
+	frame = make_frame (&info);
+	latency = g_new (GstClockTime, n_frames);
+
+	for (i = -n_warmup; i < n_frames; i++) {
+		// a new writable buffer each time, like a real source, so in-place=true does not copy
+		GstBuffer *in = gst_buffer_copy_deep (frame), *out;
+		GstClockTime start, end;
+
+		GST_BUFFER_PTS (in) = (i + n_warmup) * GST_SECOND / 30;
+		GST_BUFFER_DURATION (in) = GST_SECOND / 30;
+
+		start = gst_util_get_timestamp ();
+		if (gst_harness_push (h, in) != GST_FLOW_OK) {
+			g_printerr ("push failed for %dx%d %s\n", config->width, config->height,
+					gst_video_format_to_string (config->format));
+			break;
+		}
+		out = gst_harness_pull (h);
+		end = gst_util_get_timestamp ();
+		gst_buffer_unref (out);
+
+		if (i >= 0) {
+			latency[i] = end - start;
+			total += end - start;
+		}
+	}
+	result->frames = MAX (i, 0);
+
+	if (result->frames > 0) {
+		gdouble pixels = (gdouble) config->width * config->height * result->frames;
+
+		qsort (latency, result->frames, sizeof (GstClockTime), compare_clocktime);
+		result->mpixels_per_s = pixels / (total / 1e9) / 1e6;
+		result->ns_per_pixel = total / pixels;
+		result->latency_us[0] = percentile_us (latency, result->frames, 50);
+		result->latency_us[1] = percentile_us (latency, result->frames, 90);
+		result->latency_us[2] = percentile_us (latency, result->frames, 99);
+		result->latency_us[3] = latency[result->frames - 1] / 1000.0;
+	}
+
+	g_free (latency);
+	gst_buffer_unref (frame);
+	gst_harness_teardown (h);
+
+	return result->frames == n_frames;
+}
+
+static void
+print_result (const BenchConfig * config, const BenchResult * result, const gchar * extra)
+{
+	const gchar *format = gst_video_format_to_string (config->format);
+
+	if (json)
+		g_print ("{\"width\": %d, \"height\": %d, \"format\": \"%s\", \"method\": \"%s\", \"kernelsize\": %d, "
+				"\"sigma\": %g, \"n_threads\": %d, \"properties\": \"%s\", \"frames\": %d, "
+				"\"mpixels_per_s\": %.2f, \"ns_per_pixel\": %.3f, \"latency_p50_us\": %.1f, "
+				"\"latency_p90_us\": %.1f, \"latency_p99_us\": %.1f, \"latency_max_us\": %.1f}\n",
+				config->width, config->height, format, config->method, config->kernelsize,
+				config->sigma, config->n_threads, extra, result->frames, result->mpixels_per_s,
+				result->ns_per_pixel, result->latency_us[0], result->latency_us[1],
+				result->latency_us[2], result->latency_us[3]);
+	else
+		g_print ("%d,%d,%s,%s,%d,%g,%d,\"%s\",%d,%.2f,%.3f,%.1f,%.1f,%.1f,%.1f\n",
+				config->width, config->height, format, config->method, config->kernelsize,
+				config->sigma, config->n_threads, extra, result->frames, result->mpixels_per_s,
+				result->ns_per_pixel, result->latency_us[0], result->latency_us[1],
+				result->latency_us[2], result->latency_us[3]);
+}
+
+int
+main (int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	GstPluginFeature *feature;
+	gchar **res, **fmt, **met, **ks, **sg, **th, **r, **f, **m, **k, **s, **t;
+	gchar *extra;
+	gboolean ok = TRUE;
+
+	context = g_option_context_new ("- measure the throughput of the smoothingfilter element");
+	g_option_context_add_main_entries (context, entries, NULL);
+	g_option_context_add_group (context, gst_init_get_option_group ());
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("%s\n", error->message);
+		return 2;
+	}
+	g_option_context_free (context);
+
+	feature = gst_registry_lookup_feature (gst_registry_get (), "smoothingfilter");
+	if (!feature) {
+		g_printerr ("smoothingfilter not found, set GST_PLUGIN_PATH to the directory holding libsmoothingplugin.so\n");
+		return 2;
+	}
+	gst_object_unref (feature);
+
+	res = g_strsplit (resolutions, ",", -1);
+	fmt = g_strsplit (formats, ",", -1);
+	met = g_strsplit (methods, ",", -1);
+	ks = g_strsplit (kernelsizes, ",", -1);
+	sg = g_strsplit (sigmas, ",", -1);
+	th = g_strsplit (threads, ",", -1);
+	extra = properties ? g_strjoinv (" ", properties) : g_strdup ("");
+
+	if (!json)
+		g_print ("width,height,format,method,kernelsize,sigma,n_threads,properties,frames,"
+				"mpixels_per_s,ns_per_pixel,latency_p50_us,latency_p90_us,latency_p99_us,latency_max_us\n");
+
+	for (r = res; *r; r++)
+		for (f = fmt; *f; f++)
+			for (m = met; *m; m++)
+				for (k = ks; *k; k++)
+					for (s = sg; *s; s++)
+						for (t = th; *t; t++) {
+							BenchConfig config = { 0 };
+							BenchResult result = { 0 };
+
+							if (sscanf (*r, "%dx%d", &config.width, &config.height) != 2) {
+								g_printerr ("bad resolution %s\n", *r);
+								ok = FALSE;
+								continue;
+							}
+							config.format = gst_video_format_from_string (*f);
+							if (config.format == GST_VIDEO_FORMAT_UNKNOWN) {
+								g_printerr ("unknown format %s\n", *f);
+								ok = FALSE;
+								continue;
+							}
+							config.method = *m;
+							config.kernelsize = atoi (*k);
+							config.sigma = g_ascii_strtod (*s, NULL);
+							config.n_threads = atoi (*t);
+
+							ok &= run_config (&config, &result);
+							print_result (&config, &result, extra);
+						}
+
+	g_strfreev (res);
+	g_strfreev (fmt);
+	g_strfreev (met);
+	g_strfreev (ks);
+	g_strfreev (sg);
+	g_strfreev (th);
+	g_free (extra);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,1243 @@
+/*
+ * Smoothing Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Conformance tests for the smoothingfilter element, run by 'make check'.
+ * Every engine's output is compared with a slow double precision reference of the same smoothing:
+ * values are linearised with the exact gamma curve, convolved in double and taken back through the
+ * element's documented output lut. Each engine has its own error bound, in units of the linear lut.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+
+#include <gst/gst.h>
+#include <gst/base/gstbasetransform.h>
+#include <gst/video/video.h>
+#include <gst/check/gstcheck.h>
+#include <gst/check/gstharness.h>
+
+#define GAMMA 2.22
+#define OFFSET 0.099
+#define LUT_PRECISION 12
+
+// How an engine is selected and how close to the reference it has to be
+typedef struct {
+	const gchar *method;
+	gboolean fixed_point;
+	gdouble tolerance;       // in lut units at 12 bit precision, scaled for other precisions
+	gboolean whole_image;    // smooths up to the edges, repeating the border pixels, else pixels closer than n are untouched
+	gboolean full_gaussian;  // the Gaussian is not cut off at 2n+1 taps
+	gdouble min_sigma;       // the bound only holds from this sigma up
+} EngineSpec;
+
+static const EngineSpec engines[] = {
+	{"direct", FALSE, 0.25, FALSE, FALSE, 0.0},
+	{"direct", TRUE, 4.0, FALSE, FALSE, 0.0},
+	{"separable", FALSE, 0.25, TRUE, FALSE, 0.0},
+	{"separable", TRUE, 4.0, TRUE, FALSE, 0.0},
+	{"iir", FALSE, 82.0, TRUE, TRUE, 3.0},    // 2% of the range, the recursive approximation is poor for small sigma
+};
+
+#define ENGINE_DIRECT 0
+#define ENGINE_SEPARABLE 2
+#define ENGINE_IIR 4
+
+typedef struct {
+	GstVideoFormat format;
+	gint width, height;
+	const EngineSpec *engine;
+	gint kernelsize;
+	gdouble sigma;
+	gint n_threads;
+	gboolean in_place;
+	gboolean simd;
+	gboolean chroma;
+	gint padding;            // bytes added to every input row, carried in a GstVideoMeta
+} SmoothingParams;
+
+// The element's gamma luts, see gstsmoothinglut.c
+typedef struct {
+	gboolean linear;
+	gint in_bits, out_bits;
+} Curve;
+
+static gdouble
+curve_forward (const Curve * curve, guint v)
+{
+	gdouble in_range = 1 << curve->in_bits, out_range = 1 << curve->out_bits;
+	gdouble factor = (in_range - 1) / (1.0 - OFFSET);
+
+	if (curve->linear)
+		return v * out_range / in_range;
+	return out_range * pow (v / factor + OFFSET, GAMMA);
+}
+
+static guint
+curve_inverse (const Curve * curve, gdouble index)
+{
+	guint64 in_range = 1 << curve->in_bits, out_range = 1 << curve->out_bits;
+	guint64 i = (guint64) CLAMP (floor (index), 0, out_range - 1);
+
+	if (curve->linear)
+		return MIN ((i * in_range + out_range / 2) / out_range, in_range - 1);
+	return (guint) MIN (in_range * pow ((gdouble) i / out_range, 1.0 / GAMMA), in_range - 1);
+}
+
+static guint
+read_value (const GstVideoFrame * frame, gint comp, gint x, gint y)
+{
+	const guint8 *p = (const guint8 *) GST_VIDEO_FRAME_COMP_DATA (frame, comp) +
+			y * GST_VIDEO_FRAME_COMP_STRIDE (frame, comp) + x * GST_VIDEO_FRAME_COMP_PSTRIDE (frame, comp);
+
+	if (GST_VIDEO_FRAME_COMP_DEPTH (frame, comp) > 8)
+		return GST_VIDEO_FORMAT_INFO_IS_LE (frame->info.finfo) ? GST_READ_UINT16_LE (p) : GST_READ_UINT16_BE (p);
+	return *p;
+}
+
+static void
+write_value (GstVideoFrame * frame, gint comp, gint x, gint y, guint v)
+{
+	guint8 *p = (guint8 *) GST_VIDEO_FRAME_COMP_DATA (frame, comp) +
+			y * GST_VIDEO_FRAME_COMP_STRIDE (frame, comp) + x * GST_VIDEO_FRAME_COMP_PSTRIDE (frame, comp);
+
+	if (GST_VIDEO_FRAME_COMP_DEPTH (frame, comp) > 8) {
+		if (GST_VIDEO_FORMAT_INFO_IS_LE (frame->info.finfo))
+			GST_WRITE_UINT16_LE (p, v);
+		else
+			GST_WRITE_UINT16_BE (p, v);
+	} else
+		*p = v;
+}
+
+// A test frame with noise, flat areas and hard edges, with rows padded as asked
+static GstBuffer *
+make_input (const GstVideoInfo * info, gint padding, GRand * rand)
+{
+	GstVideoInfo padded = *info;
+	GstVideoFrame frame;
+	GstBuffer *buffer;
+	gsize offset = 0;
+	GstMapInfo map;
+	gint p, c, x, y;
+
+	for (p = 0; p < GST_VIDEO_INFO_N_PLANES (info); p++) {
+		padded.stride[p] = GST_VIDEO_INFO_PLANE_STRIDE (info, p) + padding;
+		padded.offset[p] = offset;
+		offset += (gsize) padded.stride[p] * GST_VIDEO_INFO_COMP_HEIGHT (info, p);   // component p is in plane p for every format here
+	}
+	padded.size = offset;
+
+	buffer = gst_buffer_new_allocate (NULL, padded.size, NULL);
+	gst_buffer_map (buffer, &map, GST_MAP_WRITE);
+	for (offset = 0; offset < map.size; offset++)
+		map.data[offset] = g_rand_int (rand);
+	gst_buffer_unmap (buffer, &map);
+	gst_buffer_add_video_meta_full (buffer, GST_VIDEO_FRAME_FLAG_NONE, GST_VIDEO_INFO_FORMAT (info),
+			GST_VIDEO_INFO_WIDTH (info), GST_VIDEO_INFO_HEIGHT (info), GST_VIDEO_INFO_N_PLANES (info),
+			padded.offset, padded.stride);
+
+	fail_unless (gst_video_frame_map (&frame, &padded, buffer, GST_MAP_WRITE));
+	for (c = 0; c < GST_VIDEO_FRAME_N_COMPONENTS (&frame); c++) {
+		gint max = (1 << GST_VIDEO_FRAME_COMP_DEPTH (&frame, c)) - 1;
+
+		for (y = 0; y < GST_VIDEO_FRAME_COMP_HEIGHT (&frame, c); y++)
+			for (x = 0; x < GST_VIDEO_FRAME_COMP_WIDTH (&frame, c); x++) {
+				if ((x + y) % 17 < 8)
+					continue;   // keep the noise
+				write_value (&frame, c, x, y, (x / 6 % 2) ? max * ((x / 12 + c) % 5) / 4 : 0);
+			}
+	}
+	gst_video_frame_unmap (&frame);
+
+	return buffer;
+}
+
+// One pass of the 1D kernel along rows (dx=1) or columns, repeating the border values
+static void
+convolve (gdouble * dst, const gdouble * src, gint width, gint height, const gdouble * kernel, gint n, gboolean rows)
+{
+	gint x, y, i;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++) {
+			gdouble acc = 0;
+
+			for (i = -n; i <= n; i++) {
+				gint xx = rows ? CLAMP (x + i, 0, width - 1) : x;
+				gint yy = rows ? y : CLAMP (y + i, 0, height - 1);
+
+				acc += kernel[i + n] * src[yy * width + xx];
+			}
+			dst[y * width + x] = acc;
+		}
+}
+
+// The reference smoothing of one component, in lut units
+static gdouble *
+reference (const SmoothingParams * params, const GstVideoFrame * in, gint comp, const Curve * curve)
+{
+	gint width = GST_VIDEO_FRAME_COMP_WIDTH (in, comp);
+	gint height = GST_VIDEO_FRAME_COMP_HEIGHT (in, comp);
+	gdouble *lin = g_new (gdouble, width * height), *tmp = g_new (gdouble, width * height);
+	gdouble *kernel, sum = 0;
+	gint n, x, y, i;
+
+	if (params->engine->full_gaussian) {
+		// the recursive filter approximates the Gaussian e^(-r^2/sigma^2) without cutting it off
+		gdouble sd = MAX (params->sigma / G_SQRT2, 0.5);
+
+		n = (gint) ceil (5 * sd);
+		kernel = g_new (gdouble, 2 * n + 1);
+		for (i = -n; i <= n; i++)
+			sum += kernel[i + n] = exp (-(i * i) / (2 * sd * sd));
+	} else {
+		n = params->kernelsize;
+		kernel = g_new (gdouble, 2 * n + 1);
+		for (i = -n; i <= n; i++)
+			sum += kernel[i + n] = exp (-(i * i) / (params->sigma * params->sigma));
+	}
+	for (i = 0; i < 2 * n + 1; i++)
+		kernel[i] /= sum;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			lin[y * width + x] = curve_forward (curve, read_value (in, comp, x, y));
+
+	// the 2D kernel is the product of two 1D ones, so this is the same as the direct convolution
+	convolve (tmp, lin, width, height, kernel, n, TRUE);
+	convolve (lin, tmp, width, height, kernel, n, FALSE);
+
+	g_free (tmp);
+	g_free (kernel);
+
+	return lin;
+}
+
+static void
+check_component (const SmoothingParams * params, const GstVideoFrame * in, const GstVideoFrame * out, gint comp)
+{
+	const GstVideoFormatInfo *finfo = in->info.finfo;
+	gint width = GST_VIDEO_FRAME_COMP_WIDTH (in, comp);
+	gint height = GST_VIDEO_FRAME_COMP_HEIGHT (in, comp);
+	gint n = params->kernelsize;
+	gboolean is_chroma = GST_VIDEO_FORMAT_INFO_IS_YUV (finfo) && comp > 0;
+	Curve curve;
+	gdouble *ref, tolerance;
+	gint x, y;
+
+	curve.linear = is_chroma;
+	curve.in_bits = GST_VIDEO_FRAME_COMP_DEPTH (in, comp);
+	curve.out_bits = curve.in_bits > 8 ? LUT_PRECISION + 8 : LUT_PRECISION;
+	tolerance = params->engine->tolerance * (1 << curve.out_bits) / (1 << LUT_PRECISION);
+
+	if (is_chroma && !params->chroma) {
+		for (y = 0; y < height; y++)
+			for (x = 0; x < width; x++)
+				fail_unless_equals_int (read_value (out, comp, x, y), read_value (in, comp, x, y));
+		return;
+	}
+
+	ref = reference (params, in, comp, &curve);
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++) {
+			guint v = read_value (out, comp, x, y);
+			gboolean edge = x < n || x >= width - n || y < n || y >= height - n;
+
+			if (!params->engine->whole_image && (edge || width < 2 * n + 1 || height < 2 * n + 1)) {
+				fail_unless (v == read_value (in, comp, x, y),
+						"%s component %d: pixel %d,%d within %d of the edge changed from %u to %u",
+						params->engine->method, comp, x, y, n, read_value (in, comp, x, y), v);
+			} else {
+				// the output may be anything the lut gives for an index within tolerance of the reference
+				gdouble r = ref[y * width + x] + 0.5;
+				guint lo = curve_inverse (&curve, r - tolerance), hi = curve_inverse (&curve, r + tolerance);
+
+				fail_unless (v >= lo && v <= hi,
+						"%s%s %s %dx%d kernelsize %d sigma %g component %d: pixel %d,%d is %u, expected %u to %u",
+						params->engine->method, params->engine->fixed_point ? " fixed-point" : "",
+						gst_video_format_to_string (params->format), params->width, params->height,
+						n, params->sigma, comp, x, y, v, lo, hi);
+			}
+		}
+	g_free (ref);
+}
+
+// format at width x height and 30 frames a second
+static void
+init_video_info (GstVideoInfo * info, GstVideoFormat format, gint width, gint height)
+{
+	gst_video_info_init (info);
+	gst_video_info_set_format (info, format, width, height);
+	info->fps_n = 30;
+	info->fps_d = 1;
+}
+
+/* A smoothingfilter harness with the properties set as by g_object_set(), then the caps of in_info on its sink pad
+ * and of out_info on its src pad, or in_info's there too if out_info is NULL
+ */
+static GstHarness *
+new_harness (const GstVideoInfo * in_info, const GstVideoInfo * out_info, const gchar * first_property, ...)
+{
+	GstHarness *h = gst_harness_new ("smoothingfilter");
+	va_list args;
+
+	va_start (args, first_property);
+	g_object_set_valist (G_OBJECT (h->element), first_property, args);
+	va_end (args);
+	gst_harness_set_caps (h, gst_video_info_to_caps (in_info), gst_video_info_to_caps (out_info ? out_info : in_info));
+
+	return h;
+}
+
+static void
+run_smoothing (const SmoothingParams * params)
+{
+	GstHarness *h;
+	GstVideoInfo info;
+	GstVideoFrame in_frame, out_frame;
+	GstBuffer *in, *out, *reference_copy;
+	GRand *rand = g_rand_new_with_seed (params->width * 31 + params->height);
+	gint c;
+
+	init_video_info (&info, params->format, params->width, params->height);
+	h = new_harness (&info, NULL, "kernelsize", params->kernelsize, "sigma", (gfloat) params->sigma,
+			"fixed-point", params->engine->fixed_point, "n-threads", params->n_threads,
+			"in-place", params->in_place, "simd", params->simd, "chroma", params->chroma,
+			"gamma", GAMMA, "lut-precision", LUT_PRECISION, NULL);
+	gst_util_set_object_arg (G_OBJECT (h->element), "method", params->engine->method);
+
+	in = make_input (&info, params->padding, rand);
+	reference_copy = gst_buffer_copy_deep (in);   // in-place smoothing overwrites the input
+	GST_BUFFER_PTS (in) = 0;
+	GST_BUFFER_DURATION (in) = GST_SECOND / 30;
+
+	fail_unless_equals_int (gst_harness_push (h, in), GST_FLOW_OK);
+	out = gst_harness_pull (h);
+	fail_unless (out != NULL);
+
+	fail_unless (gst_video_frame_map (&in_frame, &info, reference_copy, GST_MAP_READ));
+	fail_unless (gst_video_frame_map (&out_frame, &info, out, GST_MAP_READ));
+	for (c = 0; c < GST_VIDEO_FRAME_N_COMPONENTS (&in_frame); c++)
+		check_component (params, &in_frame, &out_frame, c);
+	gst_video_frame_unmap (&out_frame);
+	gst_video_frame_unmap (&in_frame);
+
+	gst_buffer_unref (out);
+	gst_buffer_unref (reference_copy);
+	gst_harness_teardown (h);
+	g_rand_free (rand);
+}
+
+static const GstVideoFormat formats[] = {
+	GST_VIDEO_FORMAT_RGB, GST_VIDEO_FORMAT_BGR, GST_VIDEO_FORMAT_GRAY8, GST_VIDEO_FORMAT_GRAY16_LE,
+	GST_VIDEO_FORMAT_GRAY16_BE, GST_VIDEO_FORMAT_I420, GST_VIDEO_FORMAT_NV12, GST_VIDEO_FORMAT_YUY2
+};
+
+// Every format with the given engine, at an odd and an even size, small and large kernels.
+// 1 to 3 have unrolled C row functions, 4 runs the generic ones.
+static void
+run_engine (gint engine)
+{
+	static const gint sizes[][2] = { {33, 17}, {64, 48} };
+	static const gint kernelsizes[] = { 1, 2, 3, 4 };
+	static const gdouble sigmas[] = { 1.2, 4.0 };
+	guint f, s, k, g, simd;
+
+	for (f = 0; f < G_N_ELEMENTS (formats); f++)
+		for (s = 0; s < G_N_ELEMENTS (sizes); s++)
+			for (k = 0; k < G_N_ELEMENTS (kernelsizes); k++)
+				for (g = 0; g < G_N_ELEMENTS (sigmas); g++)
+					for (simd = 0; simd < 2; simd++) {
+						SmoothingParams params = { 0 };
+
+						if (sigmas[g] < engines[engine].min_sigma)
+							continue;
+						params.format = formats[f];
+						params.width = sizes[s][0];
+						params.height = sizes[s][1];
+						params.engine = &engines[engine];
+						params.kernelsize = kernelsizes[k];
+						params.sigma = sigmas[g];
+						params.n_threads = 1;
+						params.simd = simd;
+						run_smoothing (&params);
+					}
+}
+
+GST_START_TEST (test_direct)
+{
+	run_engine (ENGINE_DIRECT);
+}
+GST_END_TEST;
+
+GST_START_TEST (test_direct_fixed)
+{
+	run_engine (ENGINE_DIRECT + 1);
+}
+GST_END_TEST;
+
+GST_START_TEST (test_separable)
+{
+	run_engine (ENGINE_SEPARABLE);
+}
+GST_END_TEST;
+
+GST_START_TEST (test_separable_fixed)
+{
+	run_engine (ENGINE_SEPARABLE + 1);
+}
+GST_END_TEST;
+
+GST_START_TEST (test_iir)
+{
+	run_engine (ENGINE_IIR);
+}
+GST_END_TEST;
+
+// Padded rows, several threads, in-place and chroma smoothing, with every engine
+GST_START_TEST (test_layouts)
+{
+	guint e, f, variant;
+
+	for (e = 0; e < G_N_ELEMENTS (engines); e++)
+		for (f = 0; f < G_N_ELEMENTS (formats); f++)
+			for (variant = 0; variant < 4; variant++) {
+				SmoothingParams params = { 0 };
+
+				params.format = formats[f];
+				params.width = 45;
+				params.height = 39;
+				params.engine = &engines[e];
+				params.kernelsize = 2;
+				params.sigma = MAX (2.0, engines[e].min_sigma);
+				params.n_threads = variant == 1 ? 3 : 1;
+				params.in_place = variant == 2;
+				params.chroma = variant == 3;
+				params.padding = variant == 0 ? 24 : 0;
+				params.simd = TRUE;
+				run_smoothing (&params);
+			}
+}
+GST_END_TEST;
+
+// Images smaller than the kernel, which the direct engines leave as they are
+GST_START_TEST (test_small_images)
+{
+	static const gint sizes[][2] = { {1, 1}, {3, 2}, {7, 5}, {2, 9} };
+	guint e, s;
+
+	for (e = 0; e < G_N_ELEMENTS (engines); e++)
+		for (s = 0; s < G_N_ELEMENTS (sizes); s++) {
+			SmoothingParams params = { 0 };
+
+			params.format = GST_VIDEO_FORMAT_RGB;
+			params.width = sizes[s][0];
+			params.height = sizes[s][1];
+			params.engine = &engines[e];
+			params.kernelsize = 3;
+			params.sigma = MAX (1.5, engines[e].min_sigma);
+			params.n_threads = 3;
+			params.simd = TRUE;
+			run_smoothing (&params);
+		}
+}
+GST_END_TEST;
+
+// kernelsize 0 passes buffers through untouched
+GST_START_TEST (test_passthrough)
+{
+	GstHarness *h = gst_harness_new ("smoothingfilter");
+	GstBuffer *in, *out;
+	GstMapInfo a, b;
+
+	g_object_set (h->element, "kernelsize", 0, NULL);
+	gst_harness_set_caps_str (h, "video/x-raw,format=RGB,width=32,height=8,framerate=30/1",
+			"video/x-raw,format=RGB,width=32,height=8,framerate=30/1");
+
+	in = gst_harness_create_buffer (h, 32 * 3 * 8);
+	gst_buffer_memset (in, 0, 0x5a, 32 * 3 * 8);
+	gst_buffer_ref (in);
+	fail_unless_equals_int (gst_harness_push (h, in), GST_FLOW_OK);
+	out = gst_harness_pull (h);
+
+	gst_buffer_map (in, &a, GST_MAP_READ);
+	gst_buffer_map (out, &b, GST_MAP_READ);
+	fail_unless_equals_int (a.size, b.size);
+	fail_unless (memcmp (a.data, b.data, a.size) == 0);
+	gst_buffer_unmap (out, &b);
+	gst_buffer_unmap (in, &a);
+
+	gst_buffer_unref (out);
+	gst_buffer_unref (in);
+	gst_harness_teardown (h);
+}
+GST_END_TEST;
+
+// The stats properties count timed frames only, and report the engine that ran
+GST_START_TEST (test_stats)
+{
+	GstHarness *h = gst_harness_new ("smoothingfilter");
+	guint64 frames, mean_time, max_time, p99_time;
+	gdouble mpixels;
+	gchar *engine;
+	gint i;
+
+	gst_util_set_object_arg (G_OBJECT (h->element), "method", "direct");
+	gst_harness_set_caps_str (h, "video/x-raw,format=GRAY8,width=64,height=48,framerate=30/1",
+			"video/x-raw,format=GRAY8,width=64,height=48,framerate=30/1");
+
+	fail_unless_equals_int (gst_harness_push (h, gst_harness_create_buffer (h, 64 * 48)), GST_FLOW_OK);
+	gst_buffer_unref (gst_harness_pull (h));
+	g_object_get (h->element, "frames", &frames, "engine", &engine, NULL);
+	fail_unless (frames == 0);
+	fail_unless (engine == NULL);
+
+	g_object_set (h->element, "stats", TRUE, NULL);
+	for (i = 0; i < 3; i++) {
+		fail_unless_equals_int (gst_harness_push (h, gst_harness_create_buffer (h, 64 * 48)), GST_FLOW_OK);
+		gst_buffer_unref (gst_harness_pull (h));
+	}
+	g_object_get (h->element, "frames", &frames, "mean-time", &mean_time, "max-time", &max_time,
+			"p99-time", &p99_time, "mpixels-per-second", &mpixels, "engine", &engine, NULL);
+	fail_unless (frames == 3);
+	fail_unless (mean_time > 0 && mean_time <= max_time);
+	fail_unless (p99_time <= max_time);
+	fail_unless (mpixels > 0);
+	fail_unless (engine != NULL && g_str_has_prefix (engine, "direct"), "engine is %s", engine);
+	g_free (engine);
+
+	gst_harness_teardown (h);
+}
+GST_END_TEST;
+
+static GstBuffer *
+push_pull (GstHarness * h, GstBuffer * in)
+{
+	fail_unless_equals_int (gst_harness_push (h, gst_buffer_ref (in)), GST_FLOW_OK);
+	return gst_harness_pull (h);
+}
+
+// The reference downscale of one component, in lut units: the kernel centred on the middle of each output pixel's block
+static gdouble *
+reference_downscale (const GstVideoFrame * in, gint comp, const Curve * curve, gint out_width, gint out_height,
+		gint factor, gint n, gdouble sigma)
+{
+	gint width = GST_VIDEO_FRAME_COMP_WIDTH (in, comp);
+	gint height = GST_VIDEO_FRAME_COMP_HEIGHT (in, comp);
+	gint taps = 2 * n + 1 + (factor % 2 == 0);
+	gint offset = (factor - taps) / 2;
+	gdouble *lin = g_new (gdouble, width * height), *tmp = g_new (gdouble, out_width * height);
+	gdouble *ref = g_new0 (gdouble, out_width * out_height);
+	gdouble *kernel = g_new (gdouble, taps), sum = 0;
+	gint x, y, i;
+
+	for (i = 0; i < taps; i++) {
+		gdouble d = i - (taps - 1) / 2.0;
+		sum += kernel[i] = exp (-(d * d) / (sigma * sigma));
+	}
+	for (i = 0; i < taps; i++)
+		kernel[i] /= sum;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			lin[y * width + x] = curve_forward (curve, read_value (in, comp, x, y));
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < out_width; x++) {
+			tmp[y * out_width + x] = 0;
+			for (i = 0; i < taps; i++)
+				tmp[y * out_width + x] += kernel[i] * lin[y * width + CLAMP (x * factor + offset + i, 0, width - 1)];
+		}
+	for (y = 0; y < out_height; y++)
+		for (x = 0; x < out_width; x++)
+			for (i = 0; i < taps; i++)
+				ref[y * out_width + x] += kernel[i] * tmp[CLAMP (y * factor + offset + i, 0, height - 1) * out_width + x];
+
+	g_free (kernel);
+	g_free (tmp);
+	g_free (lin);
+
+	return ref;
+}
+
+// downscale-factor negotiates the smaller size and anti-aliases every component, as the separable engine would
+GST_START_TEST (test_downscale)
+{
+	static const gint sizes[][2] = { {64, 48}, {37, 23} };
+	guint f, s, factor;
+	gint c, x, y;
+
+	for (f = 0; f < G_N_ELEMENTS (formats); f++)
+		for (s = 0; s < G_N_ELEMENTS (sizes); s++)
+			for (factor = 2; factor <= 3; factor++) {
+				GRand *rand = g_rand_new_with_seed (factor * 1000 + s);
+				GstHarness *h;
+				GstVideoInfo in_info, out_info;
+				GstVideoFrame in_frame, out_frame;
+				GstBuffer *in, *out;
+
+				init_video_info (&in_info, formats[f], sizes[s][0], sizes[s][1]);
+				init_video_info (&out_info, formats[f], (sizes[s][0] + factor - 1) / factor,
+						(sizes[s][1] + factor - 1) / factor);
+				h = new_harness (&in_info, &out_info, "kernelsize", 2, "sigma", 2.0f, "downscale-factor", factor,
+						"gamma", GAMMA, "lut-precision", LUT_PRECISION, NULL);
+				in = make_input (&in_info, 0, rand);
+				out = push_pull (h, in);
+
+				fail_unless (gst_video_frame_map (&in_frame, &in_info, in, GST_MAP_READ));
+				fail_unless (gst_video_frame_map (&out_frame, &out_info, out, GST_MAP_READ));
+				for (c = 0; c < GST_VIDEO_FRAME_N_COMPONENTS (&in_frame); c++) {
+					gint out_width = GST_VIDEO_FRAME_COMP_WIDTH (&out_frame, c);
+					gint out_height = GST_VIDEO_FRAME_COMP_HEIGHT (&out_frame, c);
+					Curve curve;
+					gdouble *ref, tolerance;
+
+					curve.linear = GST_VIDEO_FORMAT_INFO_IS_YUV (in_info.finfo) && c > 0;
+					curve.in_bits = GST_VIDEO_FRAME_COMP_DEPTH (&in_frame, c);
+					curve.out_bits = curve.in_bits > 8 ? LUT_PRECISION + 8 : LUT_PRECISION;
+					tolerance = engines[ENGINE_SEPARABLE].tolerance * (1 << curve.out_bits) / (1 << LUT_PRECISION);
+					ref = reference_downscale (&in_frame, c, &curve, out_width, out_height, factor, 2, 2.0);
+
+					for (y = 0; y < out_height; y++)
+						for (x = 0; x < out_width; x++) {
+							gdouble r = ref[y * out_width + x] + 0.5;
+							guint v = read_value (&out_frame, c, x, y);
+							guint lo = curve_inverse (&curve, r - tolerance), hi = curve_inverse (&curve, r + tolerance);
+
+							fail_unless (v >= lo && v <= hi, "%s %dx%d / %u component %d: pixel %d,%d is %u, expected %u to %u",
+									gst_video_format_to_string (formats[f]), sizes[s][0], sizes[s][1], factor, c, x, y, v, lo, hi);
+						}
+					g_free (ref);
+				}
+				gst_video_frame_unmap (&out_frame);
+				gst_video_frame_unmap (&in_frame);
+
+				gst_buffer_unref (out);
+				gst_buffer_unref (in);
+				gst_harness_teardown (h);
+				g_rand_free (rand);
+			}
+}
+GST_END_TEST;
+
+static GstBuffer *
+smooth_rects (const GstVideoInfo * info, GstBuffer * in, const gchar * roi, gboolean roi_meta)
+{
+	GstHarness *h = new_harness (info, NULL, "kernelsize", 2, "chroma", TRUE, "roi", roi, "roi-meta", roi_meta, NULL);
+	GstBuffer *out;
+
+	fail_unless_equals_int (gst_harness_push (h, gst_buffer_ref (in)), GST_FLOW_OK);
+	out = gst_harness_pull (h);
+	gst_harness_teardown (h);
+
+	return out;
+}
+
+// Inside one of the rectangles, which are in pixels of the full size plane
+static gboolean
+in_rects (const GstVideoFrame * frame, gint comp, gint x, gint y, const gint (*rects)[4], gint n_rects)
+{
+	gint w_sub = GST_VIDEO_FORMAT_INFO_W_SUB (frame->info.finfo, comp);
+	gint h_sub = GST_VIDEO_FORMAT_INFO_H_SUB (frame->info.finfo, comp);
+	gint i;
+
+	for (i = 0; i < n_rects; i++) {
+		if (x >= rects[i][0] >> w_sub && x < -((-(rects[i][0] + rects[i][2])) >> w_sub) &&
+				y >= rects[i][1] >> h_sub && y < -((-(rects[i][1] + rects[i][3])) >> h_sub))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Only the rectangles are smoothed, exactly as they are in the whole frame, the rest is left as it is
+GST_START_TEST (test_roi)
+{
+	static const GstVideoFormat roi_formats[] = { GST_VIDEO_FORMAT_RGB, GST_VIDEO_FORMAT_I420, GST_VIDEO_FORMAT_YUY2 };
+	static const gint rects[][4] = { {0, 0, 12, 9}, {21, 13, 30, 40}, {30, 30, 40, 40} };
+	GRand *rand = g_rand_new_with_seed (42);
+	guint f, variant;
+
+	for (f = 0; f < G_N_ELEMENTS (roi_formats); f++)
+		for (variant = 0; variant < 2; variant++) {
+			GstVideoInfo info;
+			GstVideoFrame in_frame, full_frame, roi_frame;
+			GstBuffer *in, *full, *roi;
+			gint c, x, y;
+
+			init_video_info (&info, roi_formats[f], 57, 45);
+			in = make_input (&info, 0, rand);
+
+			full = smooth_rects (&info, in, NULL, FALSE);
+			if (variant == 0)
+				roi = smooth_rects (&info, in, "0,0,12,9;21,13,30,40;30,30,40,40", FALSE);
+			else {
+				in = gst_buffer_make_writable (in);
+				for (c = 0; c < 3; c++)
+					gst_buffer_add_video_region_of_interest_meta (in, "face", rects[c][0], rects[c][1], rects[c][2], rects[c][3]);
+				roi = smooth_rects (&info, in, NULL, TRUE);
+			}
+
+			fail_unless (gst_video_frame_map (&in_frame, &info, in, GST_MAP_READ));
+			fail_unless (gst_video_frame_map (&full_frame, &info, full, GST_MAP_READ));
+			fail_unless (gst_video_frame_map (&roi_frame, &info, roi, GST_MAP_READ));
+			for (c = 0; c < GST_VIDEO_FRAME_N_COMPONENTS (&in_frame); c++)
+				for (y = 0; y < GST_VIDEO_FRAME_COMP_HEIGHT (&in_frame, c); y++)
+					for (x = 0; x < GST_VIDEO_FRAME_COMP_WIDTH (&in_frame, c); x++) {
+						const GstVideoFrame *expected = in_rects (&in_frame, c, x, y, rects, 3) ? &full_frame : &in_frame;
+
+						fail_unless (read_value (&roi_frame, c, x, y) == read_value (expected, c, x, y),
+								"%s component %d pixel %d,%d is %u, expected %u", gst_video_format_to_string (roi_formats[f]),
+								c, x, y, read_value (&roi_frame, c, x, y), read_value (expected, c, x, y));
+					}
+			gst_video_frame_unmap (&roi_frame);
+			gst_video_frame_unmap (&full_frame);
+			gst_video_frame_unmap (&in_frame);
+
+			gst_buffer_unref (roi);
+			gst_buffer_unref (full);
+			gst_buffer_unref (in);
+		}
+	g_rand_free (rand);
+}
+GST_END_TEST;
+
+// alpha < 1 starts from the first frame, averages the next ones in and starts again after a flush
+GST_START_TEST (test_temporal)
+{
+	GRand *rand = g_rand_new_with_seed (19);
+	GstHarness *h;
+	GstVideoInfo info;
+	GstBuffer *a, *b, *smooth_a, *smooth_b, *out;
+	GstMapInfo sa, sb, o;
+	GstSegment segment;
+	gboolean averaged = FALSE;
+	gsize i;
+
+	init_video_info (&info, GST_VIDEO_FORMAT_GRAY8, 64, 48);
+	a = make_input (&info, 0, rand);
+	b = make_input (&info, 0, rand);
+
+	h = new_harness (&info, NULL, "kernelsize", 2, NULL);
+	smooth_a = push_pull (h, a);
+	smooth_b = push_pull (h, b);
+	gst_buffer_map (smooth_a, &sa, GST_MAP_READ);
+	gst_buffer_map (smooth_b, &sb, GST_MAP_READ);
+
+	g_object_set (h->element, "alpha", 0.5, NULL);
+	out = push_pull (h, a);
+	fail_unless (gst_buffer_memcmp (out, 0, sa.data, sa.size) == 0);
+	gst_buffer_unref (out);
+
+	out = push_pull (h, b);
+	gst_buffer_map (out, &o, GST_MAP_READ);
+	for (i = 0; i < o.size; i++) {
+		fail_unless (o.data[i] + 1 >= MIN (sa.data[i], sb.data[i]) && o.data[i] <= MAX (sa.data[i], sb.data[i]) + 1,
+				"value %u is %u, not between %u and %u", (guint) i, o.data[i], sa.data[i], sb.data[i]);
+		if (o.data[i] != sb.data[i])
+			averaged = TRUE;
+	}
+	fail_unless (averaged);
+	gst_buffer_unmap (out, &o);
+	gst_buffer_unref (out);
+
+	fail_unless (gst_harness_push_event (h, gst_event_new_flush_start ()));
+	fail_unless (gst_harness_push_event (h, gst_event_new_flush_stop (TRUE)));
+	gst_segment_init (&segment, GST_FORMAT_TIME);
+	fail_unless (gst_harness_push_event (h, gst_event_new_segment (&segment)));
+	out = push_pull (h, b);
+	fail_unless (gst_buffer_memcmp (out, 0, sb.data, sb.size) == 0);
+	gst_buffer_unref (out);
+
+	gst_buffer_unmap (smooth_b, &sb);
+	gst_buffer_unmap (smooth_a, &sa);
+	gst_buffer_unref (smooth_b);
+	gst_buffer_unref (smooth_a);
+	gst_buffer_unref (b);
+	gst_buffer_unref (a);
+	g_rand_free (rand);
+	gst_harness_teardown (h);
+}
+GST_END_TEST;
+
+typedef struct {
+	GstHarness *h;
+	GstBuffer *in;
+	GstBuffer *expected;
+	gint mismatches;
+} SharedPoolStream;
+
+static gpointer
+shared_pool_stream (gpointer data)
+{
+	SharedPoolStream *stream = (SharedPoolStream *) data;
+	GstMapInfo map;
+	gint i;
+
+	gst_buffer_map (stream->expected, &map, GST_MAP_READ);
+	for (i = 0; i < 20; i++) {
+		GstBuffer *out = push_pull (stream->h, stream->in);
+
+		if (gst_buffer_memcmp (out, 0, map.data, map.size) != 0)
+			stream->mismatches++;
+		gst_buffer_unref (out);
+	}
+	gst_buffer_unmap (stream->expected, &map);
+
+	return NULL;
+}
+
+// Streams smoothed at the same time on the shared pool come out as they do on threads of their own
+GST_START_TEST (test_shared_pool)
+{
+	GRand *rand = g_rand_new_with_seed (21);
+	SharedPoolStream streams[3];
+	GThread *threads[3];
+	GstVideoInfo info;
+	GstHarness *h;
+	gint pool;
+	guint i;
+
+	init_video_info (&info, GST_VIDEO_FORMAT_I420, 96, 80);
+
+	h = new_harness (&info, NULL, "kernelsize", 3, "chroma", TRUE, "n-threads", 1, NULL);
+	for (i = 0; i < G_N_ELEMENTS (streams); i++) {
+		streams[i].in = make_input (&info, 0, rand);
+		streams[i].expected = push_pull (h, streams[i].in);
+		streams[i].mismatches = 0;
+	}
+	gst_harness_teardown (h);
+
+	for (i = 0; i < G_N_ELEMENTS (streams); i++) {
+		streams[i].h = new_harness (&info, NULL, "kernelsize", 3, "chroma", TRUE, "n-threads", 2 + i, NULL);
+		gst_util_set_object_arg (G_OBJECT (streams[i].h->element), "pool", "shared");
+	}
+	g_object_get (streams[0].h->element, "pool", &pool, NULL);
+	fail_unless_equals_int (pool, 1);   // shared
+
+	for (i = 0; i < G_N_ELEMENTS (streams); i++)
+		threads[i] = g_thread_new ("stream", shared_pool_stream, &streams[i]);
+	for (i = 0; i < G_N_ELEMENTS (streams); i++)
+		g_thread_join (threads[i]);
+
+	// back to a private pool while streaming
+	gst_util_set_object_arg (G_OBJECT (streams[0].h->element), "pool", "private");
+	shared_pool_stream (&streams[0]);
+
+	for (i = 0; i < G_N_ELEMENTS (streams); i++) {
+		fail_unless_equals_int (streams[i].mismatches, 0);
+		gst_harness_teardown (streams[i].h);
+		gst_buffer_unref (streams[i].expected);
+		gst_buffer_unref (streams[i].in);
+	}
+	g_rand_free (rand);
+}
+GST_END_TEST;
+
+// A copy of the frame with the given rows of plane 0 inverted, the last of them in the last plane instead
+static GstBuffer *
+change_rows (GstBuffer * in, const GstVideoInfo * info, const gint * rows, gint n_rows)
+{
+	GstBuffer *out = gst_buffer_copy_deep (in);
+	GstVideoFrame frame;
+	gint p, i, x;
+
+	fail_unless (gst_video_frame_map (&frame, (GstVideoInfo *) info, out, GST_MAP_WRITE));
+	for (i = 0; i < n_rows; i++) {
+		guint8 *row;
+
+		p = i == n_rows - 1 ? GST_VIDEO_FRAME_N_PLANES (&frame) - 1 : 0;
+		row = (guint8 *) GST_VIDEO_FRAME_PLANE_DATA (&frame, p) +
+				MIN (rows[i], GST_VIDEO_FRAME_COMP_HEIGHT (&frame, p) - 1) * GST_VIDEO_FRAME_PLANE_STRIDE (&frame, p);
+		for (x = 0; x < GST_VIDEO_FRAME_COMP_WIDTH (&frame, 0); x++)
+			row[x] = 255 - row[x];
+	}
+	gst_video_frame_unmap (&frame);
+
+	return out;
+}
+
+// skip-static gives exactly the output of smoothing every frame in full, as the rows change and stay still
+GST_START_TEST (test_skip_static)
+{
+	static const GstVideoFormat static_formats[] = {
+		GST_VIDEO_FORMAT_RGB, GST_VIDEO_FORMAT_GRAY16_LE, GST_VIDEO_FORMAT_I420, GST_VIDEO_FORMAT_YUY2
+	};
+	static const gchar *methods[] = { "direct", "separable" };
+	static const gint middle[] = { 30, 31, 5 }, edges[] = { 0, 59, 29 };
+	guint f, m, variant, i;
+
+	for (f = 0; f < G_N_ELEMENTS (static_formats); f++)
+		for (m = 0; m < G_N_ELEMENTS (methods); m++)
+			for (variant = 0; variant < 4; variant++) {
+				GRand *rand = g_rand_new_with_seed (23 + f);
+				GstHarness *plain, *h;
+				GstBuffer *frames[5];
+				GstVideoInfo info;
+
+				init_video_info (&info, static_formats[f], 80, 60);
+				frames[0] = make_input (&info, 0, rand);
+				frames[1] = change_rows (frames[0], &info, middle, G_N_ELEMENTS (middle));
+				frames[2] = gst_buffer_ref (frames[1]);
+				frames[3] = gst_buffer_ref (frames[0]);
+				frames[4] = change_rows (frames[0], &info, edges, G_N_ELEMENTS (edges));
+
+				plain = new_harness (&info, NULL, "kernelsize", 2, "sigma", 2.0f, "chroma", variant & 1, NULL);
+				h = new_harness (&info, NULL, "kernelsize", 2, "sigma", 2.0f, "chroma", variant & 1,
+						"in-place", variant >> 1, "skip-static", TRUE, NULL);
+				gst_util_set_object_arg (G_OBJECT (plain->element), "method", methods[m]);
+				gst_util_set_object_arg (G_OBJECT (h->element), "method", methods[m]);
+
+				for (i = 0; i < G_N_ELEMENTS (frames); i++) {
+					GstBuffer *expected = push_pull (plain, frames[i]);
+					GstBuffer *out = push_pull (h, frames[i]);
+					GstMapInfo map;
+
+					gst_buffer_map (expected, &map, GST_MAP_READ);
+					fail_unless (gst_buffer_memcmp (out, 0, map.data, map.size) == 0,
+							"%s %s chroma %d in-place %d frame %u differs", gst_video_format_to_string (static_formats[f]),
+							methods[m], variant & 1, variant >> 1, i);
+					gst_buffer_unmap (expected, &map);
+					gst_buffer_unref (expected);
+					gst_buffer_unref (out);
+				}
+
+				for (i = 0; i < G_N_ELEMENTS (frames); i++)
+					gst_buffer_unref (frames[i]);
+				gst_harness_teardown (h);
+				gst_harness_teardown (plain);
+				g_rand_free (rand);
+			}
+}
+GST_END_TEST;
+
+// async-depth pushes the same frames in the same order from the src pad task, drains before EOS,
+// carries on after a flush, keeps the order when set to 0 and adds the queue to the latency
+GST_START_TEST (test_async)
+{
+	GRand *rand = g_rand_new_with_seed (22);
+	GstHarness *sync_h, *h;
+	GstVideoInfo info;
+	GstBuffer *in[6], *expected[6], *out;
+	GstMapInfo map;
+	GstSegment segment;
+	GstEvent *event;
+	guint i;
+
+	init_video_info (&info, GST_VIDEO_FORMAT_RGB, 64, 48);
+
+	sync_h = new_harness (&info, NULL, "kernelsize", 2, NULL);
+	for (i = 0; i < G_N_ELEMENTS (in); i++) {
+		in[i] = make_input (&info, 0, rand);
+		GST_BUFFER_PTS (in[i]) = i * GST_SECOND / 30;
+		expected[i] = push_pull (sync_h, in[i]);
+	}
+	gst_harness_teardown (sync_h);
+
+	h = new_harness (&info, NULL, "kernelsize", 2, "async-depth", 2, NULL);
+	fail_unless_equals_uint64 (gst_harness_query_latency (h), gst_util_uint64_scale_int (2 * GST_SECOND, 1, 30));
+
+	for (i = 0; i < G_N_ELEMENTS (in); i++)
+		fail_unless_equals_int (gst_harness_push (h, gst_buffer_ref (in[i])), GST_FLOW_OK);
+	for (i = 0; i < G_N_ELEMENTS (in); i++) {
+		out = gst_harness_pull (h);
+		gst_buffer_map (expected[i], &map, GST_MAP_READ);
+		fail_unless (gst_buffer_memcmp (out, 0, map.data, map.size) == 0, "frame %u differs", i);
+		fail_unless_equals_uint64 (GST_BUFFER_PTS (out), GST_BUFFER_PTS (in[i]));
+		gst_buffer_unmap (expected[i], &map);
+		gst_buffer_unref (out);
+	}
+
+	fail_unless (gst_harness_push_event (h, gst_event_new_flush_start ()));
+	fail_unless (gst_harness_push_event (h, gst_event_new_flush_stop (TRUE)));
+	gst_segment_init (&segment, GST_FORMAT_TIME);
+	fail_unless (gst_harness_push_event (h, gst_event_new_segment (&segment)));
+	for (i = 0; i < 3; i++)
+		fail_unless_equals_int (gst_harness_push (h, gst_buffer_ref (in[i])), GST_FLOW_OK);
+
+	// with async-depth 0 the next frame goes after the queued ones, and queued frames do not leave
+	// a DISCONT for the base class to set on the next passthrough buffer
+	g_object_set (h->element, "async-depth", 0, NULL);
+	fail_unless_equals_int (gst_harness_push (h, gst_buffer_ref (in[3])), GST_FLOW_OK);
+	g_object_set (h->element, "kernelsize", 0, NULL);
+	fail_unless_equals_int (gst_harness_push (h, gst_buffer_ref (in[4])), GST_FLOW_OK);
+	for (i = 0; i < 5; i++) {
+		out = gst_harness_pull (h);
+		gst_buffer_map (i < 4 ? expected[i] : in[i], &map, GST_MAP_READ);
+		fail_unless (gst_buffer_memcmp (out, 0, map.data, map.size) == 0, "frame %u differs after the flush", i);
+		gst_buffer_unmap (i < 4 ? expected[i] : in[i], &map);
+		fail_if (GST_BUFFER_FLAG_IS_SET (out, GST_BUFFER_FLAG_DISCONT));
+		gst_buffer_unref (out);
+	}
+
+	// every frame is downstream by the time EOS is
+	fail_unless (gst_harness_push_event (h, gst_event_new_eos ()));
+	fail_unless_equals_int (gst_harness_buffers_received (h), G_N_ELEMENTS (in) + 5);
+	while ((event = gst_harness_try_pull_event (h)) != NULL) {
+		gboolean eos = GST_EVENT_TYPE (event) == GST_EVENT_EOS;
+
+		gst_event_unref (event);
+		if (eos)
+			break;
+	}
+	fail_unless (event != NULL);
+
+	for (i = 0; i < G_N_ELEMENTS (in); i++) {
+		gst_buffer_unref (expected[i]);
+		gst_buffer_unref (in[i]);
+	}
+	gst_harness_teardown (h);
+	g_rand_free (rand);
+}
+GST_END_TEST;
+
+static gint
+get_quality (GstHarness * h)
+{
+	gint quality;
+
+	g_object_get (h->element, "quality", &quality, NULL);
+	return quality;
+}
+
+static void
+push_qos (GstHarness * h, gdouble proportion, GstClockTimeDiff diff, GstClockTime timestamp)
+{
+	fail_unless (gst_harness_push_upstream_event (h, gst_event_new_qos (GST_QOS_TYPE_UNDERFLOW, proportion, diff, timestamp)));
+}
+
+// adaptive=true steps down to 3x3 then passthrough when late, waits between changes and steps back up,
+// going straight to passthrough when a 3x3 kernel would be no cheaper
+GST_START_TEST (test_adaptive)
+{
+	GstHarness *h = gst_harness_new ("smoothingfilter");
+
+	g_object_set (h->element, "kernelsize", 3, "adaptive", TRUE, NULL);
+	gst_harness_set_caps_str (h, "video/x-raw,format=GRAY8,width=64,height=48,framerate=30/1",
+			"video/x-raw,format=GRAY8,width=64,height=48,framerate=30/1");
+	fail_unless_equals_int (gst_harness_push (h, gst_harness_create_buffer (h, 64 * 48)), GST_FLOW_OK);
+	gst_buffer_unref (gst_harness_pull (h));
+	fail_unless_equals_int (get_quality (h), 0);
+
+	push_qos (h, 1.5, GST_MSECOND, GST_SECOND);
+	fail_unless_equals_int (get_quality (h), 1);
+	push_qos (h, 1.5, GST_MSECOND, GST_SECOND + GST_MSECOND);
+	fail_unless_equals_int (get_quality (h), 1);   // too soon after the last change
+	push_qos (h, 1.5, GST_MSECOND, 2 * GST_SECOND);
+	fail_unless_equals_int (get_quality (h), 2);
+	fail_unless (gst_base_transform_is_passthrough (GST_BASE_TRANSFORM (h->element)));
+
+	push_qos (h, 0.9, -GST_MSECOND, 3 * GST_SECOND);
+	fail_unless_equals_int (get_quality (h), 2);   // between the thresholds
+	push_qos (h, 0.5, -GST_MSECOND, 4 * GST_SECOND);
+	fail_unless_equals_int (get_quality (h), 1);
+	fail_unless (!gst_base_transform_is_passthrough (GST_BASE_TRANSFORM (h->element)));
+	push_qos (h, 0.5, -GST_MSECOND, 5 * GST_SECOND);
+	fail_unless_equals_int (get_quality (h), 0);
+
+	// no 3x3 step when the kernel is already 3x3
+	g_object_set (h->element, "kernelsize", 1, NULL);
+	push_qos (h, 1.5, GST_MSECOND, 6 * GST_SECOND);
+	fail_unless_equals_int (get_quality (h), 2);
+	push_qos (h, 0.5, -GST_MSECOND, 7 * GST_SECOND);
+	fail_unless_equals_int (get_quality (h), 0);
+
+	// nor with iir, which costs the same for any kernelsize
+	g_object_set (h->element, "kernelsize", 3, NULL);
+	gst_util_set_object_arg (G_OBJECT (h->element), "method", "iir");
+	push_qos (h, 1.5, GST_MSECOND, 8 * GST_SECOND);
+	fail_unless_equals_int (get_quality (h), 2);
+
+	g_object_set (h->element, "adaptive", FALSE, NULL);
+	fail_unless_equals_int (get_quality (h), 0);
+	fail_unless (!gst_base_transform_is_passthrough (GST_BASE_TRANSFORM (h->element)));
+
+	gst_harness_teardown (h);
+}
+GST_END_TEST;
+
+// A noisy frame with a hard vertical edge down the middle of every component
+static GstBuffer *
+make_edge (const GstVideoInfo * info, GRand * rand)
+{
+	GstBuffer *buffer = gst_buffer_new_allocate (NULL, GST_VIDEO_INFO_SIZE (info), NULL);
+	GstVideoFrame frame;
+	gint c, x, y;
+
+	fail_unless (gst_video_frame_map (&frame, (GstVideoInfo *) info, buffer, GST_MAP_WRITE));
+	for (c = 0; c < GST_VIDEO_FRAME_N_COMPONENTS (&frame); c++) {
+		gint scale = GST_VIDEO_FRAME_COMP_DEPTH (&frame, c) > 8 ? 257 : 1;
+		gint width = GST_VIDEO_FRAME_COMP_WIDTH (&frame, c);
+
+		for (y = 0; y < GST_VIDEO_FRAME_COMP_HEIGHT (&frame, c); y++)
+			for (x = 0; x < width; x++)
+				write_value (&frame, c, x, y, ((x < width / 2 ? 40 : 200) + g_rand_int_range (rand, -3, 4)) * scale);
+	}
+	gst_video_frame_unmap (&frame);
+
+	return buffer;
+}
+
+// Squared distance of every value from the middle of the noise on its side of the edge, and the largest distance
+static gdouble
+edge_error (GstBuffer * buffer, const GstVideoInfo * info, gint * max)
+{
+	GstVideoFrame frame;
+	gdouble error = 0;
+	gint c, x, y;
+
+	*max = 0;
+	fail_unless (gst_video_frame_map (&frame, (GstVideoInfo *) info, buffer, GST_MAP_READ));
+	for (c = 0; c < GST_VIDEO_FRAME_N_COMPONENTS (&frame); c++) {
+		gint scale = GST_VIDEO_FRAME_COMP_DEPTH (&frame, c) > 8 ? 257 : 1;
+		gint width = GST_VIDEO_FRAME_COMP_WIDTH (&frame, c);
+
+		for (y = 0; y < GST_VIDEO_FRAME_COMP_HEIGHT (&frame, c); y++)
+			for (x = 0; x < width; x++) {
+				gdouble d = ((gdouble) read_value (&frame, c, x, y) - (x < width / 2 ? 40 : 200) * scale) / scale;
+
+				error += d * d;
+				*max = MAX (*max, (gint) ceil (fabs (d)));
+			}
+	}
+	gst_video_frame_unmap (&frame);
+
+	return error;
+}
+
+// method=bilateral smooths the noise on either side of an edge without blurring the edge, which the Gaussian does,
+// with the same output for any number of threads and in-place
+GST_START_TEST (test_bilateral)
+{
+	static const GstVideoFormat bilateral_formats[] = {
+		GST_VIDEO_FORMAT_RGB, GST_VIDEO_FORMAT_GRAY8, GST_VIDEO_FORMAT_GRAY16_BE, GST_VIDEO_FORMAT_I420, GST_VIDEO_FORMAT_YUY2
+	};
+	static const gint kernelsizes[] = { 1, 3 };   // the 2D filter and the separable approximation
+	guint f, k;
+
+	for (f = 0; f < G_N_ELEMENTS (bilateral_formats); f++)
+		for (k = 0; k < G_N_ELEMENTS (kernelsizes); k++) {
+			GRand *rand = g_rand_new_with_seed (41 + f);
+			GstHarness *h, *threaded, *gaussian;
+			GstBuffer *in, *out, *out_threaded, *blurred;
+			GstVideoInfo info;
+			GstMapInfo map;
+			gdouble in_error, out_error;
+			gint max;
+
+			init_video_info (&info, bilateral_formats[f], 64, 24);
+			in = make_edge (&info, rand);
+
+			h = new_harness (&info, NULL, "kernelsize", kernelsizes[k], "sigma", 2.0f, "sigma-range", 20.0f,
+					"chroma", TRUE, "n-threads", 1, NULL);
+			threaded = new_harness (&info, NULL, "kernelsize", kernelsizes[k], "sigma", 2.0f, "sigma-range", 20.0f,
+					"chroma", TRUE, "n-threads", 3, "in-place", TRUE, NULL);
+			gaussian = new_harness (&info, NULL, "kernelsize", kernelsizes[k], "sigma", 2.0f, "chroma", TRUE, NULL);
+			gst_util_set_object_arg (G_OBJECT (h->element), "method", "bilateral");
+			gst_util_set_object_arg (G_OBJECT (threaded->element), "method", "bilateral");
+
+			// the noise is +-3, every output value stays within it (and rounding) and the noise is reduced
+			in_error = edge_error (in, &info, &max);
+			out = push_pull (h, in);
+			out_error = edge_error (out, &info, &max);
+			fail_unless (max <= 4, "%s kernelsize %d: a value is %d from its side of the edge",
+					gst_video_format_to_string (bilateral_formats[f]), kernelsizes[k], max);
+			fail_unless (out_error < in_error / 2, "%s kernelsize %d: error %g from %g",
+					gst_video_format_to_string (bilateral_formats[f]), kernelsizes[k], out_error, in_error);
+
+			out_threaded = push_pull (threaded, in);
+			gst_buffer_map (out, &map, GST_MAP_READ);
+			fail_unless (gst_buffer_memcmp (out_threaded, 0, map.data, map.size) == 0,
+					"%s kernelsize %d differs with 3 threads in-place", gst_video_format_to_string (bilateral_formats[f]),
+					kernelsizes[k]);
+			gst_buffer_unmap (out, &map);
+
+			// the Gaussian leaves values near the edge far from either side
+			blurred = push_pull (gaussian, in);
+			edge_error (blurred, &info, &max);
+			fail_unless (max > 20);
+
+			gst_buffer_unref (in);
+			gst_buffer_unref (out);
+			gst_buffer_unref (out_threaded);
+			gst_buffer_unref (blurred);
+			gst_harness_teardown (h);
+			gst_harness_teardown (threaded);
+			gst_harness_teardown (gaussian);
+			g_rand_free (rand);
+		}
+}
+GST_END_TEST;
+
+static Suite *
+smoothingfilter_suite (void)
+{
+	Suite *s = suite_create ("smoothingfilter");
+	TCase *tc = tcase_create ("conformance");
+
+	tcase_set_timeout (tc, 300);
+	suite_add_tcase (s, tc);
+	tcase_add_test (tc, test_direct);
+	tcase_add_test (tc, test_direct_fixed);
+	tcase_add_test (tc, test_separable);
+	tcase_add_test (tc, test_separable_fixed);
+	tcase_add_test (tc, test_iir);
+	tcase_add_test (tc, test_bilateral);
+	tcase_add_test (tc, test_layouts);
+	tcase_add_test (tc, test_small_images);
+	tcase_add_test (tc, test_passthrough);
+	tcase_add_test (tc, test_roi);
+	tcase_add_test (tc, test_temporal);
+	tcase_add_test (tc, test_skip_static);
+	tcase_add_test (tc, test_downscale);
+	tcase_add_test (tc, test_shared_pool);
+	tcase_add_test (tc, test_async);
+	tcase_add_test (tc, test_stats);
+	tcase_add_test (tc, test_adaptive);
+
+	return s;
+}
+
+GST_CHECK_MAIN (smoothingfilter);